@@ -0,0 +1,226 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "audio-buffer.h"
+#include "log.h"
+
+#include <algorithm>
+
+#pragma warning(push)
+#pragma warning(disable:4244)
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+#pragma warning(pop)
+
+// Output timestamps are re-anchored to the schedule when they are this far off
+static const int64_t MaxTimestampError = 200 * 1000000LL;
+
+AudioJitterBuffer::AudioJitterBuffer()
+{
+}
+
+AudioJitterBuffer::~AudioJitterBuffer()
+{
+	swr_free(&m_swrContext);
+}
+
+void AudioJitterBuffer::Reset()
+{
+	m_chunks.clear();
+	m_queuedBytes = 0;
+	m_clockOffsetSet = false;
+	m_nextTimestampSet = false;
+	m_droppedChunks = 0;
+	m_compensatedSamples = 0;
+	swr_free(&m_swrContext);
+	m_swrChannels = 0;
+}
+
+void AudioJitterBuffer::SetSampleRate(uint32_t sampleRate)
+{
+	if (sampleRate != m_sampleRate)
+	{
+		m_sampleRate = sampleRate;
+		m_nextTimestampSet = false;
+	}
+}
+
+void AudioJitterBuffer::Push(FramePtr frame)
+{
+	if (frame->m_payloadLength < sizeof(AudioDataHeader))
+	{
+		OM_LOG(LOG_ERROR, "[AUDIO_DATA] payload too short: %u bytes", frame->m_payloadLength);
+		return;
+	}
+
+	const AudioDataHeader* header = (const AudioDataHeader*)frame->PayloadData();
+	if (header->dataLength < 0 || sizeof(AudioDataHeader) + header->dataLength > frame->m_payloadLength)
+	{
+		OM_LOG(LOG_ERROR, "[AUDIO_DATA] data length %d does not fit payload of %u bytes", header->dataLength, frame->m_payloadLength);
+		return;
+	}
+
+	// Follow the lowest receive delay seen; creep upwards slowly so that a
+	// lasting change in network delay or clock rate is picked up as well, and
+	// start over if the sender's clock jumps back
+	int64_t offset = (int64_t)frame->m_receiveTime - (int64_t)header->timestamp;
+	if (!m_clockOffsetSet || offset < m_clockOffset || offset - m_clockOffset > 1000000000LL)
+	{
+		m_clockOffset = offset;
+		m_clockOffsetSet = true;
+	}
+	else
+	{
+		m_clockOffset += (offset - m_clockOffset) / 256;
+	}
+
+	uint64_t timestamp = header->timestamp;
+	auto position = m_chunks.end();
+	while (position != m_chunks.begin() &&
+		((const AudioDataHeader*)(*(position - 1))->PayloadData())->timestamp > timestamp)
+	{
+		--position;
+	}
+
+	m_queuedBytes += frame->m_payloadLength;
+	m_chunks.insert(position, std::move(frame));
+
+	while (m_queuedBytes > m_byteBudget && !m_chunks.empty())
+	{
+		if (m_droppedChunks++ == 0)
+		{
+			OM_LOG(LOG_WARNING, "Audio buffer over budget (%u bytes), dropping oldest audio", (uint32_t)m_byteBudget);
+		}
+		m_queuedBytes -= m_chunks.front()->m_payloadLength;
+		m_chunks.pop_front();
+		m_nextTimestampSet = false;
+	}
+}
+
+bool AudioJitterBuffer::PrepareResampler(int channels)
+{
+	if (m_swrContext && m_swrChannels == channels && m_swrSampleRate == m_sampleRate)
+	{
+		return true;
+	}
+
+	swr_free(&m_swrContext);
+#if LIBSWRESAMPLE_VERSION_INT >= AV_VERSION_INT(4, 5, 100)
+	// FFmpeg 5.1 replaced the channel layout masks, and 7.0 removed them
+	AVChannelLayout layout;
+	av_channel_layout_default(&layout, channels);
+	int ret = swr_alloc_set_opts2(&m_swrContext,
+		&layout, AV_SAMPLE_FMT_FLT, (int)m_sampleRate,
+		&layout, AV_SAMPLE_FMT_FLT, (int)m_sampleRate,
+		0, nullptr);
+	av_channel_layout_uninit(&layout);
+	if (ret < 0 || swr_init(m_swrContext) < 0)
+#else
+	int64_t layout = av_get_default_channel_layout(channels);
+	m_swrContext = swr_alloc_set_opts(nullptr,
+		layout, AV_SAMPLE_FMT_FLT, (int)m_sampleRate,
+		layout, AV_SAMPLE_FMT_FLT, (int)m_sampleRate,
+		0, nullptr);
+	if (!m_swrContext || swr_init(m_swrContext) < 0)
+#endif
+	{
+		OM_LOG(LOG_ERROR, "Unable to create audio resampler for %d channels at %u Hz", channels, m_sampleRate);
+		swr_free(&m_swrContext);
+		return false;
+	}
+
+	m_swrChannels = channels;
+	m_swrSampleRate = m_sampleRate;
+	return true;
+}
+
+bool AudioJitterBuffer::Pop(uint64_t now, AudioChunk& chunk)
+{
+	while (!m_chunks.empty())
+	{
+		FramePtr& frame = m_chunks.front();
+		const AudioDataHeader* header = (const AudioDataHeader*)frame->PayloadData();
+
+		int64_t due = (int64_t)header->timestamp + m_clockOffset + (int64_t)m_targetDelay;
+		if ((int64_t)now < due)
+		{
+			return false;
+		}
+
+		int channels = header->channels;
+		uint32_t frames = (uint32_t)(header->dataLength / sizeof(float) / (channels > 0 ? channels : 1));
+		if ((channels != 1 && channels != 2) || !PrepareResampler(channels))
+		{
+			OM_LOG(LOG_ERROR, "[AUDIO_DATA] unimplemented audio channels %d", channels);
+			m_queuedBytes -= frame->m_payloadLength;
+			m_chunks.pop_front();
+			continue;
+		}
+
+		int64_t error = m_nextTimestampSet ? due - (int64_t)m_nextTimestamp : 0;
+		if (!m_nextTimestampSet || error > MaxTimestampError || error < -MaxTimestampError)
+		{
+			m_nextTimestamp = (uint64_t)due;
+			m_nextTimestampSet = true;
+			error = 0;
+		}
+
+		// Positive error means output has fallen behind the schedule, so
+		// stretch this chunk a little; negative means squeeze it
+		int delta = (int)(error * (int64_t)m_sampleRate / 1000000000LL);
+		int maxDelta = (int)(frames / 200);
+		delta = std::max(-maxDelta, std::min(maxDelta, delta));
+		if (delta != 0)
+		{
+			swr_set_compensation(m_swrContext, delta, (int)frames);
+			m_compensatedSamples += delta;
+		}
+
+		int outFrames = swr_get_out_samples(m_swrContext, (int)frames);
+		if (m_output.size() < (size_t)outFrames * channels)
+		{
+			m_output.resize((size_t)outFrames * channels);
+		}
+
+		const uint8_t* in[1] = { frame->PayloadData() + sizeof(AudioDataHeader) };
+		uint8_t* out[1] = { (uint8_t*)m_output.data() };
+		int converted = swr_convert(m_swrContext, out, outFrames, in, (int)frames);
+
+		m_queuedBytes -= frame->m_payloadLength;
+		m_chunks.pop_front();
+
+		if (converted <= 0)
+		{
+			continue;
+		}
+
+		chunk.data = m_output.data();
+		chunk.frames = (uint32_t)converted;
+		chunk.channels = channels;
+		chunk.sampleRate = m_sampleRate;
+		chunk.timestamp = m_nextTimestamp;
+		m_nextTimestamp += (uint64_t)converted * 1000000000ULL / m_sampleRate;
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+#include "frame.h"
+
+struct SwrContext;
+
+struct AudioDataHeader
+{
+	uint64_t timestamp;
+	int channels;
+	int dataLength;
+};
+
+// Interleaved float samples ready to hand to OBS. data stays valid until the
+// next call to AudioJitterBuffer::Pop.
+struct AudioChunk
+{
+	const float* data = nullptr;
+	uint32_t frames = 0;
+	int channels = 0;
+	uint32_t sampleRate = 0;
+	uint64_t timestamp = 0;
+};
+
+// Schedules AUDIO_DATA frames by their sender timestamp instead of by how
+// many video frames have been decoded. The sender clock is mapped onto the
+// local steady clock using the smallest observed receive delay, and each
+// chunk is released targetDelay after its mapped time. Output timestamps are
+// kept continuous; any drift between them and the schedule is absorbed by
+// letting libswresample stretch or squeeze the audio by up to 0.5%.
+class AudioJitterBuffer
+{
+public:
+	AudioJitterBuffer();
+	~AudioJitterBuffer();
+
+	void Reset();
+
+	void SetSampleRate(uint32_t sampleRate);
+
+	void SetTargetDelay(uint64_t delayNs)
+	{
+		m_targetDelay = delayNs;
+	}
+
+	// Oldest chunks are dropped once more than this many payload bytes are queued
+	void SetByteBudget(size_t bytes)
+	{
+		m_byteBudget = bytes;
+	}
+
+	void Push(FramePtr frame);
+
+	// Returns the oldest chunk if it is due at now (steady_clock nanoseconds)
+	bool Pop(uint64_t now, AudioChunk& chunk);
+
+	size_t GetQueuedBytes() const
+	{
+		return m_queuedBytes;
+	}
+
+	size_t GetQueuedChunkCount() const
+	{
+		return m_chunks.size();
+	}
+
+	uint64_t GetDroppedChunkCount() const
+	{
+		return m_droppedChunks;
+	}
+
+	// Net samples added (positive) or removed by drift compensation
+	int64_t GetCompensatedSampleCount() const
+	{
+		return m_compensatedSamples;
+	}
+
+private:
+	bool PrepareResampler(int channels);
+
+	std::deque<FramePtr> m_chunks;	// ordered by sender timestamp
+	size_t m_queuedBytes = 0;
+	size_t m_byteBudget = 1024 * 1024;
+
+	uint32_t m_sampleRate = 48000;
+	uint64_t m_targetDelay = 40 * 1000000ULL;
+
+	bool m_clockOffsetSet = false;
+	int64_t m_clockOffset = 0;		// local receive time minus sender timestamp
+
+	bool m_nextTimestampSet = false;
+	uint64_t m_nextTimestamp = 0;	// where the previous output chunk ended
+
+	SwrContext* m_swrContext = nullptr;
+	int m_swrChannels = 0;
+	uint32_t m_swrSampleRate = 0;
+	std::vector<float> m_output;
+
+	uint64_t m_droppedChunks = 0;
+	int64_t m_compensatedSamples = 0;
+};
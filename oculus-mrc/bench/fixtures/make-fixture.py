@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+# Regenerates the H.264 fixture used by oculus-mrc-bench.
+#
+# Requires PyAV (pip install av) built with libx264. The stream mimics what
+# the headset's MRC encoder produces: constrained baseline, no B-frames, one
+# slice per picture and an IDR every second, encoded as Annex B.
+
+import argparse
+from fractions import Fraction
+
+import av
+import numpy as np
+
+
+def make_picture(index, width, height):
+    y, x = np.mgrid[0:height, 0:width]
+    r = (x * 255 // width + index * 4) % 256
+    g = (y * 255 // height + index * 2) % 256
+    b = ((x + y + index * 8) // 16 % 2) * 160 + 48
+    image = np.stack([r, g, b], axis=-1).astype(np.uint8)
+
+    # a block moving across the frame so every picture has real motion
+    size = height // 4
+    left = (index * 7) % (width - size)
+    top = (index * 3) % (height - size)
+    image[top:top + size, left:left + size] = (240, 240, 32)
+    return image
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--output", default="mrc-640x360.h264")
+    parser.add_argument("--width", type=int, default=640)
+    parser.add_argument("--height", type=int, default=360)
+    parser.add_argument("--frames", type=int, default=60)
+    parser.add_argument("--fps", type=int, default=30)
+    args = parser.parse_args()
+
+    codec = av.CodecContext.create("libx264", "w")
+    codec.width = args.width
+    codec.height = args.height
+    codec.pix_fmt = "yuv420p"
+    codec.time_base = Fraction(1, args.fps)
+    codec.options = {
+        "profile": "baseline",
+        "preset": "veryfast",
+        "tune": "zerolatency",
+        "crf": "34",
+        "g": str(args.fps),
+        "x264-params": "sliced-threads=0:threads=1:annexb=1:repeat-headers=1",
+    }
+
+    with open(args.output, "wb") as out:
+        for index in range(args.frames):
+            frame = av.VideoFrame.from_ndarray(make_picture(index, args.width, args.height), format="rgb24")
+            frame.pts = index
+            for packet in codec.encode(frame):
+                out.write(bytes(packet))
+        for packet in codec.encode(None):
+            out.write(bytes(packet))
+
+
+if __name__ == "__main__":
+    main()
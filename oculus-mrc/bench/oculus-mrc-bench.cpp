@@ -0,0 +1,1288 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+// Headless benchmark for the MRC ingest path. Stress-tests the lock-free
+// queue between two threads, feeds synthetic MRC streams
+// through FrameCollection with different chunk sizes, payload mixes and
+// thread layouts, then replays a recorded H.264 stream, or a capture written
+// by the plugin, through MrcPipeline's reassembly, decode and RGBA
+// conversion at maximum speed, and
+// finally streams it over loopback to a growing number of pipelines
+// sharing one I/O reactor and decode pool. Builds without libobs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma warning(push)
+#pragma warning(disable:4244)
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#pragma warning(pop)
+
+#include "frame.h"
+#include "audio-buffer.h"
+#include "latency-stats.h"
+#include "stream-capture.h"
+#include "mrc-pipeline.h"
+#include "mrc-connection.h"
+#include "spsc-queue.h"
+#include "log.h"
+
+#ifndef OCULUS_MRC_BENCH_FIXTURE
+#define OCULUS_MRC_BENCH_FIXTURE "mrc-640x360.h264"
+#endif
+
+static const uint32_t MrcMagic = 0x2877AF94;
+
+// Every heap allocation in the process is counted, so allocations made by
+// the hot path show up even when they bypass the frame pool. With glibc,
+// malloc and its aligned variants are replaced as well, which catches the
+// av_malloc calls libavutil and libavcodec make for every packet (AVBuffer,
+// AVBufferRef); elsewhere only operator new is seen.
+static std::atomic<uint64_t> g_heapAllocations { 0 };
+
+#if defined(__GLIBC__)
+#define OM_BENCH_COUNTS_MALLOC 1
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size)
+{
+	++g_heapAllocations;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+	++g_heapAllocations;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+	++g_heapAllocations;
+	return __libc_realloc(p, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+	++g_heapAllocations;
+	return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+	++g_heapAllocations;
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size)
+{
+	++g_heapAllocations;
+	*p = __libc_memalign(alignment, size);
+	return *p ? 0 : ENOMEM;
+}
+}
+#endif
+
+void* operator new(size_t size)
+{
+#if !OM_BENCH_COUNTS_MALLOC
+	++g_heapAllocations;
+#endif
+	void* p = malloc(size ? size : 1);
+	if (!p)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+static bool g_verbose = false;
+
+extern "C" void blog(int log_level, const char *format, ...)
+{
+	if (log_level > LOG_WARNING && !g_verbose)
+	{
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+enum class PayloadMix {
+	Video,	// large VIDEO_DATA payloads only
+	Audio,	// 10 ms AUDIO_DATA chunks only
+	Mixed,	// three audio chunks per video payload, like a 30 fps stream
+};
+
+static const char* GetPayloadMixName(PayloadMix mix)
+{
+	switch (mix)
+	{
+	case PayloadMix::Video:
+		return "video";
+	case PayloadMix::Audio:
+		return "audio";
+	case PayloadMix::Mixed:
+		return "mixed";
+	}
+	return "unknown";
+}
+
+enum class ThreadLayout {
+	Inline,		// AddData and PopFrame on one thread
+	Threaded,	// recv-style writes on one thread, PopAllFrames on another
+};
+
+static const char* GetThreadLayoutName(ThreadLayout layout)
+{
+	return layout == ThreadLayout::Inline ? "inline" : "threaded";
+}
+
+static void AppendFrame(std::vector<uint8_t>& stream, Frame::PayloadType type, const void* payload, uint32_t length)
+{
+	FrameHeader header;
+	header.Magic = MrcMagic;
+	header.TotalDataLengthExcludingMagic = (uint32_t)(sizeof(FrameHeader) - sizeof(uint32_t)) + length;
+	header.PayloadType = (uint32_t)type;
+	header.PayloadLength = length;
+
+	const uint8_t* headerBytes = (const uint8_t*)&header;
+	stream.insert(stream.end(), headerBytes, headerBytes + sizeof(header));
+	stream.insert(stream.end(), (const uint8_t*)payload, (const uint8_t*)payload + length);
+}
+
+static void AppendAudio(std::vector<uint8_t>& stream, uint64_t timestamp)
+{
+	const int channels = 2;
+	const int samples = 480;
+	std::vector<uint8_t> payload(sizeof(AudioDataHeader) + samples * channels * sizeof(float));
+	AudioDataHeader header = { timestamp, channels, (int)(samples * channels * sizeof(float)) };
+	memcpy(payload.data(), &header, sizeof(header));
+	AppendFrame(stream, Frame::PayloadType::AUDIO_DATA, payload.data(), (uint32_t)payload.size());
+}
+
+static void AppendVideo(std::vector<uint8_t>& stream, std::mt19937& random)
+{
+	// typical P-frame sizes for a 3840x1080 stream, with the odd large IDR
+	std::uniform_int_distribution<uint32_t> size(8 * 1024, 120 * 1024);
+	uint32_t length = random() % 30 == 0 ? 400 * 1024 : size(random);
+	std::vector<uint8_t> payload(length);
+	for (uint32_t i = 0; i < length; i += 4)
+	{
+		payload[i] = (uint8_t)random();
+	}
+	AppendFrame(stream, Frame::PayloadType::VIDEO_DATA, payload.data(), length);
+}
+
+static std::vector<uint8_t> MakeSyntheticStream(PayloadMix mix, size_t size)
+{
+	std::vector<uint8_t> stream;
+	stream.reserve(size + 512 * 1024);
+	std::mt19937 random(14);
+
+	int dimension[2] = { 1920 * 2, 1080 };
+	AppendFrame(stream, Frame::PayloadType::VIDEO_DIMENSION, dimension, sizeof(dimension));
+	uint32_t sampleRate = 48000;
+	AppendFrame(stream, Frame::PayloadType::AUDIO_SAMPLERATE, &sampleRate, sizeof(sampleRate));
+
+	uint64_t audioTimestamp = 0;
+	while (stream.size() < size)
+	{
+		if (mix != PayloadMix::Audio)
+		{
+			AppendVideo(stream, random);
+		}
+		if (mix != PayloadMix::Video)
+		{
+			for (int i = 0; i < 3; ++i)
+			{
+				AppendAudio(stream, audioTimestamp);
+				audioTimestamp += 10000000;
+			}
+		}
+	}
+	return stream;
+}
+
+static double GetSeconds(std::chrono::steady_clock::duration duration)
+{
+	return std::chrono::duration<double>(duration).count();
+}
+
+static double ToMs(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+struct IngestResult
+{
+	double seconds = 0;
+	uint64_t bytes = 0;
+	uint64_t frames = 0;
+	uint64_t poolAllocations = 0;
+	uint64_t heapAllocations = 0;
+	uint64_t bytesCopied = 0;
+	LatencyStats latency;
+};
+
+static void RecordPopped(const Frame& frame, LatencyStats& latency)
+{
+	PipelineTimestamps timestamps;
+	timestamps.receive = frame.m_receiveStartTime;
+	timestamps.parsed = frame.m_receiveTime;
+	timestamps.decodeIn = GetSteadyTimeNs();	// taken off the queue
+	latency.RecordPicture(timestamps);
+}
+
+static void FeedInline(FrameCollection& frames, const uint8_t* data, size_t size, size_t chunkSize, IngestResult& result)
+{
+	for (size_t offset = 0; offset < size; offset += chunkSize)
+	{
+		frames.AddData(data + offset, (uint32_t)std::min(chunkSize, size - offset));
+
+		while (frames.HasCompletedFrame())
+		{
+			FramePtr frame = frames.PopFrame();
+			RecordPopped(*frame, result.latency);
+			++result.frames;
+		}
+	}
+}
+
+static void FeedThreaded(FrameCollection& frames, const uint8_t* data, size_t size, size_t chunkSize, IngestResult& result)
+{
+	std::atomic<bool> receiving { true };
+
+	std::thread consumer([&]() {
+		for (;;)
+		{
+			bool done = !receiving;
+			frames.WaitForFrame(std::chrono::milliseconds(5));
+			frames.PopAllFrames([&](FramePtr frame) {
+				RecordPopped(*frame, result.latency);
+				++result.frames;
+			});
+			if (done && !frames.HasCompletedFrame())
+			{
+				break;
+			}
+		}
+	});
+
+	// stands in for the receive thread, with recv() replaced by a memcpy
+	for (size_t offset = 0; offset < size; )
+	{
+		size_t available = 0;
+		uint8_t* buffer = frames.GetReceiveBuffer(available);
+		size_t length = std::min(std::min(available, chunkSize), size - offset);
+		memcpy(buffer, data + offset, length);
+		frames.CommitReceivedData((uint32_t)length);
+		offset += length;
+	}
+
+	receiving = false;
+	consumer.join();
+}
+
+static void RunIngest(const std::vector<uint8_t>& stream, size_t size, size_t chunkSize, ThreadLayout layout,
+	IngestResult& result)
+{
+	FrameCollection frames;
+
+	auto feed = [&](size_t bytes, IngestResult& into) {
+		if (layout == ThreadLayout::Inline)
+		{
+			FeedInline(frames, stream.data(), bytes, chunkSize, into);
+		}
+		else
+		{
+			FeedThreaded(frames, stream.data(), bytes, chunkSize, into);
+		}
+	};
+
+	// warm the frame and payload pools so the measured run shows the steady state
+	IngestResult warmup;
+	feed(std::min<size_t>(size, 4 * 1024 * 1024), warmup);
+	frames.Reset();
+
+	uint64_t poolAllocations = frames.GetAllocationCount();
+	uint64_t heapAllocations = g_heapAllocations;
+	auto start = std::chrono::steady_clock::now();
+
+	feed(size, result);
+
+	result.seconds = GetSeconds(std::chrono::steady_clock::now() - start);
+	result.bytes = frames.GetBytesReceived();
+	result.bytesCopied = frames.GetBytesCopied();
+	result.poolAllocations = frames.GetAllocationCount() - poolAllocations;
+	result.heapAllocations = g_heapAllocations - heapAllocations;
+
+	if (frames.GetResyncCount() > 0)
+	{
+		fprintf(stderr, "ingest: parser resynchronised %llu times on a clean stream\n",
+			(unsigned long long)frames.GetResyncCount());
+	}
+}
+
+// The reassembly FrameCollection used before the ring buffer, kept as the
+// baseline for the copy counts: every chunk is appended to a vector, each
+// payload copied out of it, and each frame erased from its front, which
+// moves every byte still buffered behind it
+class VectorReassembler
+{
+public:
+	void AddData(const uint8_t* data, size_t len)
+	{
+		m_scratchPad.insert(m_scratchPad.end(), data, data + len);
+		m_bytesReceived += len;
+		m_bytesCopied += len;
+
+		while (m_scratchPad.size() >= sizeof(FrameHeader))
+		{
+			FrameHeader header;
+			memcpy(&header, m_scratchPad.data(), sizeof(header));
+			size_t frameLength = sizeof(uint32_t) + header.TotalDataLengthExcludingMagic;
+			if (m_scratchPad.size() < frameLength)
+			{
+				break;
+			}
+
+			auto first = m_scratchPad.begin() + sizeof(FrameHeader);
+			m_payload.assign(first, first + header.PayloadLength);
+			m_bytesCopied += header.PayloadLength;
+			++m_frames;
+
+			m_scratchPad.erase(m_scratchPad.begin(), m_scratchPad.begin() + frameLength);
+			m_bytesCopied += m_scratchPad.size();
+		}
+	}
+
+	uint64_t m_bytesReceived = 0;
+	uint64_t m_bytesCopied = 0;
+	uint64_t m_frames = 0;
+
+private:
+	std::vector<uint8_t> m_scratchPad;
+	std::vector<uint8_t> m_payload;
+};
+
+// Bytes copied per byte received, before and after the ring buffer, for
+// the chunk sizes a socket hands over
+static void RunReassemblyBaseline(const std::vector<uint8_t>& stream, PayloadMix mix, size_t size)
+{
+	const size_t chunkSizes[] = { 1460, 64 * 1024, 1024 * 1024 };
+	for (size_t chunkSize : chunkSizes)
+	{
+		VectorReassembler vector;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t offset = 0; offset < size; offset += chunkSize)
+		{
+			vector.AddData(stream.data() + offset, std::min(chunkSize, size - offset));
+		}
+		double vectorSeconds = GetSeconds(std::chrono::steady_clock::now() - start);
+
+		IngestResult ring;
+		RunIngest(stream, size, chunkSize, ThreadLayout::Inline, ring);
+
+		printf("%-6s %8zu %12.3f %12.3f %12.1f %12.1f\n",
+			GetPayloadMixName(mix),
+			chunkSize,
+			(double)vector.m_bytesCopied / vector.m_bytesReceived,
+			ring.bytes ? (double)ring.bytesCopied / ring.bytes : 0.0,
+			vector.m_bytesReceived / 1e6 / vectorSeconds,
+			ring.bytes / 1e6 / ring.seconds);
+		fflush(stdout);
+	}
+}
+
+// Damages the mixed stream every corruptionInterval bytes, alternating
+// between a flipped byte, a dropped run and an inserted run as a bad link
+// or a buggy sender would, and checks the parser keeps delivering frames
+static void RunResync(const std::vector<uint8_t>& clean, size_t corruptionInterval)
+{
+	std::mt19937 random(7);
+	std::vector<uint8_t> stream;
+	stream.reserve(clean.size() + clean.size() / corruptionInterval * 64);
+	int damage = 0;
+	for (size_t offset = 0; offset < clean.size(); )
+	{
+		size_t length = std::min(corruptionInterval, clean.size() - offset);
+		stream.insert(stream.end(), clean.begin() + offset, clean.begin() + offset + length);
+		offset += length;
+		if (offset >= clean.size())
+		{
+			break;
+		}
+
+		size_t run = 1 + random() % 64;
+		switch (damage++ % 3)
+		{
+		case 0:
+			stream[stream.size() - 1 - random() % length] ^= 0xff;
+			break;
+		case 1:
+			offset += std::min(run, clean.size() - offset);
+			break;
+		case 2:
+			for (size_t i = 0; i < run; ++i)
+			{
+				stream.push_back((uint8_t)random());
+			}
+			break;
+		}
+	}
+
+	FrameCollection cleanFrames;
+	IngestResult cleanResult;
+	FeedInline(cleanFrames, clean.data(), clean.size(), 64 * 1024, cleanResult);
+
+	FrameCollection frames;
+	IngestResult result;
+	auto start = std::chrono::steady_clock::now();
+	FeedInline(frames, stream.data(), stream.size(), 64 * 1024, result);
+	double seconds = GetSeconds(std::chrono::steady_clock::now() - start);
+
+	printf("resync every %7zu B: %10.1f MB/s, %llu of %llu frames delivered, %llu resyncs, %llu bytes skipped\n",
+		corruptionInterval,
+		stream.size() / 1e6 / seconds,
+		(unsigned long long)result.frames,
+		(unsigned long long)cleanResult.frames,
+		(unsigned long long)frames.GetResyncCount(),
+		(unsigned long long)frames.GetResyncBytesSkipped());
+	fflush(stdout);
+}
+
+static void RunIngestSuite(bool quick)
+{
+	const size_t chunkSizes[] = { 1, 64, 1460, 16 * 1024, 64 * 1024, 1024 * 1024 };
+	const PayloadMix mixes[] = { PayloadMix::Video, PayloadMix::Audio, PayloadMix::Mixed };
+	const ThreadLayout layouts[] = { ThreadLayout::Inline, ThreadLayout::Threaded };
+
+	size_t streamSize = (quick ? 16 : 128) * 1024 * 1024;
+
+	printf("%-6s %-9s %8s %10s %10s %12s %12s %9s %19s %19s\n",
+		"mix", "layout", "chunk", "MB/s", "frames/s", "pool-alloc/f", "heap-alloc/f", "copied/B",
+		"reassembly p50/p99", "queue p50/p99");
+
+	for (PayloadMix mix : mixes)
+	{
+		std::vector<uint8_t> stream = MakeSyntheticStream(mix, streamSize);
+		for (ThreadLayout layout : layouts)
+		{
+			for (size_t chunkSize : chunkSizes)
+			{
+				// tiny chunks are dominated by per-call overhead, a shorter run says as much
+				size_t size = std::min(stream.size(), std::max<size_t>(chunkSize * 256 * 1024, 4 * 1024 * 1024));
+				IngestResult result;
+				RunIngest(stream, size, chunkSize, layout, result);
+
+				const LatencyHistogram& reassembly = result.latency.GetHistogram(LatencyStage::Reassembly);
+				const LatencyHistogram& queue = result.latency.GetHistogram(LatencyStage::Queue);
+				printf("%-6s %-9s %8zu %10.1f %10.0f %12.4f %12.4f %9.3f %9.3f/%-9.3f %9.3f/%-9.3f\n",
+					GetPayloadMixName(mix),
+					GetThreadLayoutName(layout),
+					chunkSize,
+					result.bytes / 1e6 / result.seconds,
+					result.frames / result.seconds,
+					result.frames ? (double)result.poolAllocations / result.frames : 0.0,
+					result.frames ? (double)result.heapAllocations / result.frames : 0.0,
+					result.bytes ? (double)result.bytesCopied / result.bytes : 0.0,
+					ToMs(reassembly.GetPercentile(50)), ToMs(reassembly.GetPercentile(99)),
+					ToMs(queue.GetPercentile(50)), ToMs(queue.GetPercentile(99)));
+				fflush(stdout);
+			}
+		}
+	}
+
+	printf("\nreassembly copies, vector insert/erase (before) vs ring buffer (after), inline\n");
+	printf("%-6s %8s %12s %12s %12s %12s\n", "mix", "chunk", "copied/B old", "copied/B new", "MB/s old", "MB/s new");
+	for (PayloadMix mix : mixes)
+	{
+		size_t size = (quick ? 8 : 32) * 1024 * 1024;
+		std::vector<uint8_t> stream = MakeSyntheticStream(mix, size);
+		RunReassemblyBaseline(stream, mix, std::min(size, stream.size()));
+	}
+
+	printf("\n");
+	std::vector<uint8_t> mixed = MakeSyntheticStream(PayloadMix::Mixed, (quick ? 16 : 64) * 1024 * 1024);
+	const size_t corruptionIntervals[] = { 64 * 1024, 1024 * 1024 };
+	for (size_t interval : corruptionIntervals)
+	{
+		RunResync(mixed, interval);
+	}
+}
+
+// One producer and one consumer hammering a small SpscQueue. The consumer
+// alternates between TryPop and PopAll and checks every value arrives
+// exactly once and in order. Both sides yield when blocked so the test
+// also makes progress on a single core.
+static bool RunQueueStress(size_t capacity, uint64_t count)
+{
+	SpscQueue<uint64_t> queue(capacity);
+	std::atomic<uint64_t> producerFull { 0 };
+
+	auto start = std::chrono::steady_clock::now();
+	std::thread producer([&]() {
+		uint64_t full = 0;
+		for (uint64_t value = 0; value < count; )
+		{
+			if (queue.TryPush(value))
+			{
+				++value;
+			}
+			else
+			{
+				++full;
+				std::this_thread::yield();
+			}
+		}
+		producerFull = full;
+	});
+
+	uint64_t expected = 0;
+	uint64_t outOfOrder = 0;
+	uint64_t empty = 0;
+	auto check = [&](uint64_t value) {
+		if (value != expected)
+		{
+			++outOfOrder;
+		}
+		expected = value + 1;
+	};
+	for (uint64_t popped = 0, round = 0; popped < count; ++round)
+	{
+		size_t taken = 0;
+		uint64_t value;
+		if (round % 2 == 0)
+		{
+			if (queue.TryPop(value))
+			{
+				check(value);
+				taken = 1;
+			}
+		}
+		else
+		{
+			taken = queue.PopAll(check);
+		}
+		if (taken == 0)
+		{
+			++empty;
+			std::this_thread::yield();
+		}
+		popped += taken;
+	}
+	producer.join();
+	double seconds = GetSeconds(std::chrono::steady_clock::now() - start);
+
+	bool passed = outOfOrder == 0 && expected == count && queue.IsEmpty();
+	printf("spsc capacity %4zu: %10.1f M items/s, %llu items, %llu out of order, producer full %llu, consumer empty %llu  %s\n",
+		queue.Capacity(),
+		count / 1e6 / seconds,
+		(unsigned long long)count,
+		(unsigned long long)outOfOrder,
+		(unsigned long long)producerFull.load(),
+		(unsigned long long)empty,
+		passed ? "ok" : "FAILED");
+	fflush(stdout);
+	return passed;
+}
+
+static bool RunQueueSuite(bool quick)
+{
+	const size_t capacities[] = { 2, 16, 1024 };
+	uint64_t count = (quick ? 1 : 10) * 1000000ULL;
+	bool passed = true;
+	for (size_t capacity : capacities)
+	{
+		passed = RunQueueStress(capacity, count) && passed;
+	}
+	printf("\n");
+	return passed;
+}
+
+static bool ReadFile(const char* path, std::vector<uint8_t>& data)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+	{
+		return false;
+	}
+
+	uint8_t buffer[64 * 1024];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		data.insert(data.end(), buffer, buffer + read);
+	}
+	fclose(file);
+	return true;
+}
+
+// Splits an Annex B elementary stream into access units, one VIDEO_DATA
+// payload each, the way the headset sends them
+static bool SplitAccessUnits(const std::vector<uint8_t>& elementaryStream, std::vector<std::vector<uint8_t>>& accessUnits,
+	int& width, int& height)
+{
+	AVCodecParserContext* parser = av_parser_init(AV_CODEC_ID_H264);
+	const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+	AVCodecContext* context = codec ? avcodec_alloc_context3(codec) : nullptr;
+	if (!parser || !context)
+	{
+		av_parser_close(parser);
+		avcodec_free_context(&context);
+		return false;
+	}
+
+	const uint8_t* data = elementaryStream.data();
+	int remaining = (int)elementaryStream.size();
+	for (;;)
+	{
+		uint8_t* unit = nullptr;
+		int unitSize = 0;
+		int used = av_parser_parse2(parser, context, &unit, &unitSize,
+			data, remaining, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+		data += used;
+		remaining -= used;
+
+		if (unitSize > 0)
+		{
+			accessUnits.emplace_back(unit, unit + unitSize);
+			if (parser->width > 0)
+			{
+				width = parser->width;
+				height = parser->height;
+			}
+		}
+		if (remaining == 0 && unitSize == 0 && used == 0)
+		{
+			break;
+		}
+	}
+
+	av_parser_close(parser);
+	avcodec_free_context(&context);
+	return !accessUnits.empty();
+}
+
+// Wraps the fixture's access units in MRC frames, loops times over
+static bool BuildFixtureStream(const char* fixturePath, int loops, std::vector<uint8_t>& stream, std::string& description)
+{
+	std::vector<uint8_t> elementaryStream;
+	if (!ReadFile(fixturePath, elementaryStream))
+	{
+		fprintf(stderr, "decode: unable to read %s\n", fixturePath);
+		return false;
+	}
+
+	std::vector<std::vector<uint8_t>> accessUnits;
+	int width = 0;
+	int height = 0;
+	if (!SplitAccessUnits(elementaryStream, accessUnits, width, height))
+	{
+		fprintf(stderr, "decode: no H.264 access units in %s\n", fixturePath);
+		return false;
+	}
+
+	int dimension[2] = { width, height };
+	AppendFrame(stream, Frame::PayloadType::VIDEO_DIMENSION, dimension, sizeof(dimension));
+	for (int loop = 0; loop < loops; ++loop)
+	{
+		for (const std::vector<uint8_t>& unit : accessUnits)
+		{
+			AppendFrame(stream, Frame::PayloadType::VIDEO_DATA, unit.data(), (uint32_t)unit.size());
+		}
+	}
+
+	char text[512];
+	snprintf(text, sizeof(text), "%s: %dx%d, %zu access units x %d loops", fixturePath, width, height, accessUnits.size(), loops);
+	description = text;
+	return true;
+}
+
+// Concatenates the chunks of a capture written by the plugin, loops times over
+static bool BuildReplayStream(const char* capturePath, int loops, std::vector<uint8_t>& stream, std::string& description)
+{
+	StreamCaptureReader reader;
+	if (!reader.Open(capturePath))
+	{
+		return false;
+	}
+
+	size_t chunks = 0;
+	for (int loop = 0; loop < loops; ++loop)
+	{
+		reader.Rewind();
+		StreamCaptureReader::Chunk chunk;
+		while (reader.ReadChunk(chunk))
+		{
+			stream.insert(stream.end(), chunk.data, chunk.data + chunk.length);
+			++chunks;
+		}
+	}
+
+	char text[512];
+	snprintf(text, sizeof(text), "%s: %zu chunks, %zu bytes x %d loops", capturePath, chunks / std::max(loops, 1),
+		stream.size() / std::max(loops, 1), loops);
+	description = text;
+	return !stream.empty();
+}
+
+// A capture file in the temporary directory, for the decode suite to replay
+static std::string GetTempCapturePath(const char* name)
+{
+	const char* directory = getenv("TMPDIR");
+	if (!directory)
+	{
+		directory = getenv("TEMP");
+	}
+	return std::string(directory ? directory : "/tmp") + "/" + name;
+}
+
+// Writes the stream as a capture of 64 KB chunks, as a socket would hand
+// them over
+static bool WriteCapture(const std::vector<uint8_t>& stream, const std::string& path)
+{
+	StreamCaptureWriter writer;
+	uint64_t now = GetSteadyTimeNs();
+	if (!writer.Open(path, now))
+	{
+		return false;
+	}
+	for (size_t offset = 0; offset < stream.size(); offset += 64 * 1024)
+	{
+		writer.Write(stream.data() + offset, (uint32_t)std::min<size_t>(64 * 1024, stream.size() - offset), now);
+	}
+	writer.Close();
+	return true;
+}
+
+// Replays the stream through MrcPipeline at maximum speed, so reassembly,
+// decode and conversion are the plugin's own, with a consumer taking the
+// newest picture every millisecond. Only the newest picture of each decode
+// batch is converted, as in the plugin.
+static bool RunDecodeSuite(const std::vector<uint8_t>& stream, const std::string& description, int threadCount)
+{
+	std::string capturePath = GetTempCapturePath("oculus-mrc-bench-decode.mrccap");
+	if (!WriteCapture(stream, capturePath))
+	{
+		return false;
+	}
+
+	MrcPipelineSettings settings;
+	settings.decoderThreadCount = threadCount;
+	settings.replayPacing = ReplayPacing::MaxSpeed;
+
+	MrcIoReactor ioReactor;
+	MrcDecodePool decodePool(1);
+	MrcPipeline pipeline(ioReactor, decodePool);
+	pipeline.SetName("decode");
+
+	auto start = std::chrono::steady_clock::now();
+	if (!pipeline.StartReplay(capturePath, settings))
+	{
+		fprintf(stderr, "decode: unable to replay %s\n", capturePath.c_str());
+		remove(capturePath.c_str());
+		return false;
+	}
+	// the decoder is open by now, what follows is per frame
+	uint64_t heapAllocations = g_heapAllocations;
+
+	// once the replay ends, keep consuming until the decoder stops producing
+	const auto drainTime = std::chrono::milliseconds(100);
+	auto lastProgress = start;
+	uint64_t lastProgressCount = 0;
+	LatencyStats& latency = pipeline.GetLatencyStats();
+	for (;;)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		DecodedImage* image = pipeline.TakeNewestImage();
+		if (image)
+		{
+			PipelineTimestamps timestamps = image->m_timestamps;
+			timestamps.upload = GetSteadyTimeNs();
+			latency.RecordPicture(timestamps);
+			if (timestamps.receive)
+			{
+				latency.Record(LatencyStage::Total, timestamps.upload - timestamps.receive);
+			}
+			pipeline.ReturnImage(image);
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		MrcPipelineStats progressStats = pipeline.GetStats();
+		uint64_t progressCount = progressStats.picturesDecoded + progressStats.imagesTaken;
+		if (progressCount != lastProgressCount)
+		{
+			lastProgressCount = progressCount;
+			lastProgress = now;
+		}
+		else if (pipeline.HasInputEnded() && now - lastProgress >= drainTime)
+		{
+			break;
+		}
+	}
+
+	double seconds = GetSeconds(lastProgress - start);
+	uint64_t allocations = g_heapAllocations - heapAllocations;
+	MrcPipelineStats stats = pipeline.GetStats();
+	pipeline.Stop();
+	remove(capturePath.c_str());
+
+	printf("\ndecode+convert %s, %d decoder threads (0 = auto), replayed at maximum speed\n",
+		description.c_str(), threadCount);
+	printf("  %.1f MB/s, %.1f pictures/s, %llu pictures, %llu converted, %.4f heap-alloc/frame\n",
+		seconds > 0 ? stream.size() / 1e6 / seconds : 0.0,
+		seconds > 0 ? stats.picturesDecoded / seconds : 0.0,
+		(unsigned long long)stats.picturesDecoded,
+		(unsigned long long)stats.picturesConverted,
+		stats.framesParsed ? (double)allocations / stats.framesParsed : 0.0);
+
+	const LatencyStage stages[] = { LatencyStage::Reassembly, LatencyStage::Queue, LatencyStage::Decode,
+		LatencyStage::Convert, LatencyStage::Total };
+	for (LatencyStage stage : stages)
+	{
+		const LatencyHistogram& histogram = latency.GetHistogram(stage);
+		printf("  %-10s p50 %8.3f ms  p99 %8.3f ms\n", GetLatencyStageName(stage),
+			ToMs(histogram.GetPercentile(50)), ToMs(histogram.GetPercentile(99)));
+	}
+	return stats.picturesDecoded > 0;
+}
+
+// Splits an MRC stream into whole frames, header included
+static void SplitMrcFrames(const std::vector<uint8_t>& stream, std::vector<std::vector<uint8_t>>& frames)
+{
+	size_t offset = 0;
+	while (offset + sizeof(FrameHeader) <= stream.size())
+	{
+		FrameHeader header;
+		memcpy(&header, stream.data() + offset, sizeof(header));
+		size_t length = sizeof(uint32_t) + header.TotalDataLengthExcludingMagic;
+		if (header.Magic != MrcMagic || offset + length > stream.size())
+		{
+			break;
+		}
+		frames.emplace_back(stream.begin() + offset, stream.begin() + offset + length);
+		offset += length;
+	}
+}
+
+// Stands in for a headset on the loopback interface: accepts one
+// connection and sends the stream's frames at 60 fps, looping until stopped
+class FakeHeadset
+{
+public:
+	bool Start(const std::vector<std::vector<uint8_t>>& frames)
+	{
+		m_listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (m_listenSocket == INVALID_SOCKET)
+		{
+			return false;
+		}
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = 0;
+		socklen_t addressLength = sizeof(address);
+		if (bind(m_listenSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+			listen(m_listenSocket, 1) == SOCKET_ERROR ||
+			getsockname(m_listenSocket, (sockaddr*)&address, &addressLength) == SOCKET_ERROR)
+		{
+			closesocket(m_listenSocket);
+			m_listenSocket = INVALID_SOCKET;
+			return false;
+		}
+		m_port = ntohs(address.sin_port);
+
+		m_thread = std::thread(&FakeHeadset::Run, this, std::cref(frames));
+		return true;
+	}
+
+	void Stop()
+	{
+		m_stopping = true;
+		if (m_thread.joinable())
+		{
+			m_thread.join();
+		}
+		if (m_listenSocket != INVALID_SOCKET)
+		{
+			closesocket(m_listenSocket);
+			m_listenSocket = INVALID_SOCKET;
+		}
+	}
+
+	uint32_t GetPort() const
+	{
+		return m_port;
+	}
+
+private:
+	void Run(const std::vector<std::vector<uint8_t>>& frames)
+	{
+		SOCKET client = INVALID_SOCKET;
+		while (!m_stopping && client == INVALID_SOCKET)
+		{
+			fd_set readSet;
+			FD_ZERO(&readSet);
+			FD_SET(m_listenSocket, &readSet);
+			timeval timeout = { 0, 50000 };
+			if (select((int)m_listenSocket + 1, &readSet, nullptr, nullptr, &timeout) > 0)
+			{
+				client = accept(m_listenSocket, nullptr, nullptr);
+			}
+		}
+		if (client == INVALID_SOCKET)
+		{
+			return;
+		}
+
+		// the first frame, VIDEO_DIMENSION in the fixture stream, is sent once
+#ifdef MSG_NOSIGNAL
+		const int sendFlags = MSG_NOSIGNAL;	// the pipeline may hang up first
+#else
+		const int sendFlags = 0;
+#endif
+		const auto interval = std::chrono::microseconds(1000000 / 60);
+		auto next = std::chrono::steady_clock::now();
+		size_t index = 0;
+		while (!m_stopping)
+		{
+			const std::vector<uint8_t>& frame = frames[index];
+			index = index + 1 < frames.size() ? index + 1 : std::min<size_t>(1, frames.size() - 1);
+			if (send(client, (const char*)frame.data(), (int)frame.size(), sendFlags) != (int)frame.size())
+			{
+				break;
+			}
+			next += interval;
+			std::this_thread::sleep_until(next);
+		}
+		closesocket(client);
+	}
+
+	SOCKET m_listenSocket = INVALID_SOCKET;
+	uint32_t m_port = 0;
+	std::thread m_thread;
+	std::atomic<bool> m_stopping { false };
+};
+
+// Runs sourceCount pipelines on one I/O reactor and decode pool against
+// fake headsets streaming at 60 fps, with one consumer taking pictures at
+// 60 Hz like the video tick. Per-source latency should stay flat as the
+// source count grows, until the decode pool runs out of cores.
+static bool RunMultiSource(const std::vector<std::vector<uint8_t>>& frames, int sourceCount, int decodeWorkers,
+	double seconds)
+{
+	std::vector<std::unique_ptr<FakeHeadset>> headsets;
+	for (int i = 0; i < sourceCount; ++i)
+	{
+		headsets.emplace_back(new FakeHeadset());
+		if (!headsets.back()->Start(frames))
+		{
+			fprintf(stderr, "multi-source: unable to listen on the loopback interface\n");
+			headsets.pop_back();
+			for (auto& headset : headsets)
+			{
+				headset->Stop();
+			}
+			return false;
+		}
+	}
+
+	MrcPipelineSettings settings;
+	settings.reconnect = false;
+
+	bool started = true;
+	{
+		MrcIoReactor ioReactor;
+		MrcDecodePool decodePool(decodeWorkers);
+		std::vector<std::unique_ptr<MrcPipeline>> pipelines;
+		for (int i = 0; i < sourceCount; ++i)
+		{
+			pipelines.emplace_back(new MrcPipeline(ioReactor, decodePool));
+			MrcPipeline& pipeline = *pipelines.back();
+			pipeline.SetName("source " + std::to_string(i));
+			pipeline.SetGpuConversion(true);
+			started = pipeline.StartNetwork("127.0.0.1", headsets[i]->GetPort(), settings) && started;
+		}
+
+		auto consume = [&](double duration) {
+			const auto interval = std::chrono::microseconds(1000000 / 60);
+			auto start = std::chrono::steady_clock::now();
+			auto next = start;
+			while (std::chrono::steady_clock::now() - start < std::chrono::duration<double>(duration))
+			{
+				next += interval;
+				std::this_thread::sleep_until(next);
+				for (auto& pipeline : pipelines)
+				{
+					DecodedImage* image = pipeline->TakeNewestImage();
+					if (!image)
+					{
+						continue;
+					}
+					PipelineTimestamps timestamps = image->m_timestamps;
+					timestamps.upload = GetSteadyTimeNs();
+					LatencyStats& latency = pipeline->GetLatencyStats();
+					latency.RecordPicture(timestamps);
+					if (timestamps.receive)
+					{
+						latency.Record(LatencyStage::Total, timestamps.upload - timestamps.receive);
+					}
+					pipeline->ReturnImage(image);
+				}
+			}
+		};
+
+		// connect and warm up the decoders, then measure
+		consume(std::min(seconds, 1.0));
+		std::vector<MrcPipelineStats> before;
+		for (auto& pipeline : pipelines)
+		{
+			pipeline->GetLatencyStats().ResetHistograms();
+			before.push_back(pipeline->GetStats());
+		}
+		consume(seconds);
+
+		double minFps = 1e9;
+		double totalP50 = 0;
+		uint64_t worstTotalP99 = 0;
+		uint64_t worstDecodeP99 = 0;
+		uint64_t dropped = 0;
+		for (int i = 0; i < sourceCount; ++i)
+		{
+			MrcPipeline& pipeline = *pipelines[i];
+			MrcPipelineStats stats = pipeline.GetStats();
+			minFps = std::min(minFps, (stats.picturesDecoded - before[i].picturesDecoded) / seconds);
+			dropped += stats.framesDropped - before[i].framesDropped;
+
+			const LatencyStats& latency = pipeline.GetLatencyStats();
+			totalP50 += ToMs(latency.GetHistogram(LatencyStage::Total).GetPercentile(50));
+			worstTotalP99 = std::max(worstTotalP99, latency.GetHistogram(LatencyStage::Total).GetPercentile(99));
+			worstDecodeP99 = std::max(worstDecodeP99, latency.GetHistogram(LatencyStage::Decode).GetPercentile(99));
+			pipeline.Stop();
+		}
+
+		printf("%7d %8d %14.1f %15.3f %16.3f %17.3f %13llu\n", sourceCount, decodePool.GetWorkerCount(), minFps,
+			totalP50 / sourceCount, ToMs(worstTotalP99), ToMs(worstDecodeP99), (unsigned long long)dropped);
+		fflush(stdout);
+		started = started && minFps > 0;
+	}
+
+	for (auto& headset : headsets)
+	{
+		headset->Stop();
+	}
+	return started;
+}
+
+static bool RunMultiSourceSuite(const std::vector<uint8_t>& stream, const std::string& description, int maxSources,
+	int decodeWorkers, bool quick)
+{
+	std::vector<std::vector<uint8_t>> frames;
+	SplitMrcFrames(stream, frames);
+	if (frames.size() < 2)
+	{
+		fprintf(stderr, "multi-source: no MRC frames in %s\n", description.c_str());
+		return false;
+	}
+
+	printf("\nmulti-source %s, 60 fps per source, one I/O reactor and decode pool\n", description.c_str());
+	printf("%7s %8s %14s %15s %16s %17s %13s\n", "sources", "workers", "min fps/src",
+		"total p50 ms", "worst total p99", "worst decode p99", "parser drops");
+
+	for (int sourceCount = 1; sourceCount <= maxSources; sourceCount *= 2)
+	{
+		if (!RunMultiSource(frames, sourceCount, decodeWorkers, quick ? 2.0 : 5.0))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void PrintUsage()
+{
+	printf("usage: oculus-mrc-bench [--quick] [--skip-queues] [--skip-ingest] [--skip-decode] [--skip-multi-source]\n"
+		"                         [--fixture file.h264] [--replay capture.mrccap] [--loops n] [--decoder-threads n] [--max-sources n]\n"
+		"                         [--decode-workers n] [--verbose]\n");
+}
+
+int main(int argc, char** argv)
+{
+	bool quick = false;
+	bool queues = true;
+	bool ingest = true;
+	bool decode = true;
+	bool multiSource = true;
+	const char* fixturePath = OCULUS_MRC_BENCH_FIXTURE;
+	const char* replayPath = nullptr;
+	int loops = 20;
+	int threadCount = 0;
+	int maxSources = 8;
+	int decodeWorkers = MrcDecodePool::GetDefaultWorkerCount();
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--quick")
+		{
+			quick = true;
+		}
+		else if (arg == "--skip-queues")
+		{
+			queues = false;
+		}
+		else if (arg == "--skip-ingest")
+		{
+			ingest = false;
+		}
+		else if (arg == "--skip-decode")
+		{
+			decode = false;
+		}
+		else if (arg == "--skip-multi-source")
+		{
+			multiSource = false;
+		}
+		else if (arg == "--fixture" && i + 1 < argc)
+		{
+			fixturePath = argv[++i];
+		}
+		else if (arg == "--replay" && i + 1 < argc)
+		{
+			replayPath = argv[++i];
+		}
+		else if (arg == "--loops" && i + 1 < argc)
+		{
+			loops = atoi(argv[++i]);
+		}
+		else if (arg == "--decoder-threads" && i + 1 < argc)
+		{
+			threadCount = atoi(argv[++i]);
+		}
+		else if (arg == "--max-sources" && i + 1 < argc)
+		{
+			maxSources = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--decode-workers" && i + 1 < argc)
+		{
+			decodeWorkers = atoi(argv[++i]);
+		}
+		else if (arg == "--verbose")
+		{
+			g_verbose = true;
+		}
+		else
+		{
+			PrintUsage();
+			return arg == "--help" ? 0 : 1;
+		}
+	}
+
+	if (quick)
+	{
+		loops = std::min(loops, 3);
+	}
+
+#if OM_BENCH_COUNTS_MALLOC
+	printf("heap-alloc counts every malloc, the libav* libraries' included\n\n");
+#else
+	printf("heap-alloc counts operator new only, the libav* libraries' allocations are not seen\n\n");
+#endif
+
+	if (queues && !RunQueueSuite(quick))
+	{
+		return 1;
+	}
+
+	if (ingest)
+	{
+		RunIngestSuite(quick);
+	}
+
+	if (decode)
+	{
+		std::vector<uint8_t> stream;
+		std::string description;
+		bool built = replayPath ? BuildReplayStream(replayPath, loops, stream, description) :
+			BuildFixtureStream(fixturePath, loops, stream, description);
+		if (!built || !RunDecodeSuite(stream, description, threadCount))
+		{
+			return 1;
+		}
+	}
+
+	if (multiSource)
+	{
+		std::vector<uint8_t> stream;
+		std::string description;
+		bool built = replayPath ? BuildReplayStream(replayPath, 1, stream, description) :
+			BuildFixtureStream(fixturePath, 1, stream, description);
+		if (!built || !InitializeSockets())
+		{
+			return 1;
+		}
+		bool succeeded = RunMultiSourceSuite(stream, description, maxSources, decodeWorkers, quick);
+		ShutdownSockets();
+		if (!succeeded)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,35 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// Shared indices of the lock-free handoffs are kept this far apart, so the
+// producer's and the consumer's never share a cache line
+static const size_t CacheLineSize = 64;
+
+// A value with a cache line of padding on either side. Padding rather than
+// alignas(64): the handoffs live inside heap-allocated sources and
+// pipelines, and operator new honours over-alignment only from C++17 on.
+template<typename T>
+struct CacheLinePadded
+{
+	char before[CacheLineSize];
+	T value;
+	char after[CacheLineSize - sizeof(T) % CacheLineSize];
+};
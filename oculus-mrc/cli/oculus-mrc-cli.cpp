@@ -0,0 +1,427 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+// Runs the MRC pipeline without OBS: from the headset's socket or a capture
+// file through parsing, decoding and conversion, with a consumer thread
+// standing in for the video tick. Prints per-stage throughput every second
+// and the latency percentiles at the end, so the pipeline can be profiled
+// (perf, VTune) on a machine without a display.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "mrc-pipeline.h"
+#include "stats-report.h"
+#include "mrc-connection.h"
+#include "log.h"
+
+static bool g_verbose = false;
+static std::atomic<bool> g_interrupted { false };
+
+extern "C" void blog(int log_level, const char *format, ...)
+{
+	if (log_level > LOG_INFO && !g_verbose)
+	{
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+static void OnInterrupt(int)
+{
+	g_interrupted = true;
+}
+
+// Counts what the pipeline hands out, and the timestamps that failed to
+// increase; the pictures themselves are dropped. Called from one decode
+// task at a time.
+class CountingSink : public MrcPipelineSink
+{
+public:
+	void OnAudio(const AudioChunk& chunk) override
+	{
+		m_audioFrames += chunk.frames;
+		if (m_lastAudioTimestamp != 0 && chunk.timestamp <= m_lastAudioTimestamp)
+		{
+			++m_audioTimestampRepeats;
+		}
+		m_lastAudioTimestamp = chunk.timestamp;
+	}
+
+	void OnPicture(const AVFrame* picture, const PipelineTimestamps& /*timestamps*/) override
+	{
+		++m_pictures;
+		if (m_lastPictureTimestamp != AV_NOPTS_VALUE &&
+			(picture->pts == AV_NOPTS_VALUE || picture->pts <= m_lastPictureTimestamp))
+		{
+			++m_pictureTimestampRepeats;
+		}
+		m_lastPictureTimestamp = picture->pts;
+	}
+
+	std::atomic<uint64_t> m_audioFrames { 0 };
+	std::atomic<uint64_t> m_pictures { 0 };
+	std::atomic<uint64_t> m_audioTimestampRepeats { 0 };
+	std::atomic<uint64_t> m_pictureTimestampRepeats { 0 };
+
+private:
+	uint64_t m_lastAudioTimestamp = 0;
+	int64_t m_lastPictureTimestamp = AV_NOPTS_VALUE;
+};
+
+static bool ParseThreading(const std::string& name, DecoderThreading& threading)
+{
+	const DecoderThreading values[] = { DecoderThreading::Auto, DecoderThreading::Slice,
+		DecoderThreading::Frame, DecoderThreading::None };
+	for (DecoderThreading value : values)
+	{
+		if (name == GetDecoderThreadingName(value))
+		{
+			threading = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool ParseBacklogPolicy(const std::string& name, BacklogPolicy& policy)
+{
+	if (name == "off")
+	{
+		policy = BacklogPolicy::Off;
+	}
+	else if (name == "nonref")
+	{
+		policy = BacklogPolicy::DropNonReference;
+	}
+	else if (name == "idr")
+	{
+		policy = BacklogPolicy::SkipToIdr;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+static void PrintUsage()
+{
+	printf("usage: oculus-mrc-cli (--host address [--port n] [--no-reconnect] | --replay capture.mrccap [--max-speed])\n"
+		"                       [--duration seconds] [--consume-hz n] [--yuv] [--async]\n"
+		"                       [--decoder-threading slice|frame|auto|none] [--decoder-threads n] [--decode-workers n]\n"
+		"                       [--capture file.mrccap] [--audio-delay ms] [--frame-pacing ms]\n"
+		"                       [--backlog off|nonref|idr] [--backlog-latency ms] [--stats-json file.jsonl]\n"
+		"                       [--parameter-set-cache file.h264] [--verbose]\n");
+}
+
+static void PrintRates(const MrcPipelineStats& now, const MrcPipelineStats& last, double seconds, bool framePacing)
+{
+	printf("in %7.2f MB/s  parsed %6.1f/s  decoded %6.1f/s  converted %6.1f/s  taken %6.1f/s  audio %6.1f/s"
+		"  | skipped %llu  superseded %llu  parser drops %llu  resyncs %llu (%llu bytes)  shed %llu (%llu IDR skips)\n",
+		(now.bytesReceived - last.bytesReceived) / 1e6 / seconds,
+		(now.framesParsed - last.framesParsed) / seconds,
+		(now.picturesDecoded - last.picturesDecoded) / seconds,
+		(now.picturesConverted - last.picturesConverted) / seconds,
+		(now.imagesTaken - last.imagesTaken) / seconds,
+		(now.audioChunks - last.audioChunks) / seconds,
+		(unsigned long long)now.skippedConversions,
+		(unsigned long long)now.supersededImages,
+		(unsigned long long)now.framesDropped,
+		(unsigned long long)now.parserResyncs,
+		(unsigned long long)now.parserBytesSkipped,
+		(unsigned long long)now.backlogDroppedFrames,
+		(unsigned long long)now.backlogIdrSkips);
+	if (framePacing)
+	{
+		printf("    frame pacing: repeated %llu  dropped %llu  delay %.1f ms\n",
+			(unsigned long long)now.repeatedPictures,
+			(unsigned long long)now.pacerDroppedPictures,
+			now.pacerDelayNs / 1e6);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	std::string host;
+	uint32_t port = 28734;
+	std::string replayPath;
+	double duration = 0;
+	int consumeHz = 60;
+	bool yuv = false;
+	uint32_t audioDelayMs = 40;
+	uint32_t frameDelayMs = 0;
+	std::string statsPath;
+	int decodeWorkers = MrcDecodePool::GetDefaultWorkerCount();
+	MrcPipelineSettings settings;
+	settings.expectedWidth = 1920 * 2;
+	settings.expectedHeight = 1080;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--host" && hasValue)
+		{
+			host = argv[++i];
+		}
+		else if (arg == "--port" && hasValue)
+		{
+			port = (uint32_t)atoi(argv[++i]);
+		}
+		else if (arg == "--replay" && hasValue)
+		{
+			replayPath = argv[++i];
+		}
+		else if (arg == "--no-reconnect")
+		{
+			settings.reconnect = false;
+		}
+		else if (arg == "--max-speed")
+		{
+			settings.replayPacing = ReplayPacing::MaxSpeed;
+		}
+		else if (arg == "--duration" && hasValue)
+		{
+			duration = atof(argv[++i]);
+		}
+		else if (arg == "--consume-hz" && hasValue)
+		{
+			consumeHz = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--yuv")
+		{
+			yuv = true;
+		}
+		else if (arg == "--async")
+		{
+			settings.asyncOutput = true;
+		}
+		else if (arg == "--decoder-threading" && hasValue)
+		{
+			if (!ParseThreading(argv[++i], settings.decoderThreading))
+			{
+				PrintUsage();
+				return 1;
+			}
+		}
+		else if (arg == "--decoder-threads" && hasValue)
+		{
+			settings.decoderThreadCount = atoi(argv[++i]);
+		}
+		else if (arg == "--decode-workers" && hasValue)
+		{
+			decodeWorkers = atoi(argv[++i]);
+		}
+		else if (arg == "--capture" && hasValue)
+		{
+			settings.captureFile = argv[++i];
+		}
+		else if (arg == "--audio-delay" && hasValue)
+		{
+			audioDelayMs = (uint32_t)atoi(argv[++i]);
+		}
+		else if (arg == "--frame-pacing" && hasValue)
+		{
+			settings.framePacing = true;
+			frameDelayMs = (uint32_t)atoi(argv[++i]);
+		}
+		else if (arg == "--backlog" && hasValue)
+		{
+			if (!ParseBacklogPolicy(argv[++i], settings.backlogPolicy))
+			{
+				PrintUsage();
+				return 1;
+			}
+		}
+		else if (arg == "--backlog-latency" && hasValue)
+		{
+			settings.backlogMaxLatencyMs = (uint32_t)atoi(argv[++i]);
+		}
+		else if (arg == "--parameter-set-cache" && hasValue)
+		{
+			settings.parameterSetCacheFile = argv[++i];
+		}
+		else if (arg == "--stats-json" && hasValue)
+		{
+			statsPath = argv[++i];
+		}
+		else if (arg == "--verbose")
+		{
+			g_verbose = true;
+		}
+		else
+		{
+			PrintUsage();
+			return arg == "--help" ? 0 : 1;
+		}
+	}
+
+	if (host.empty() == replayPath.empty())
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	if (!InitializeSockets())
+	{
+		return 1;
+	}
+	signal(SIGINT, OnInterrupt);
+
+	CountingSink sink;
+	MrcIoReactor ioReactor;
+	MrcDecodePool decodePool(decodeWorkers);
+	MrcPipeline pipeline(ioReactor, decodePool);
+	pipeline.SetName("cli");
+	pipeline.SetSink(&sink);
+	pipeline.SetGpuConversion(yuv);
+	pipeline.SetAudioDelay(audioDelayMs);
+	pipeline.SetFrameDelay(frameDelayMs);
+
+	// as the plugin does when the source is created, so the time to the
+	// first picture does not include opening the decoder
+	pipeline.PrepareDecoder(settings);
+
+	bool started = false;
+	if (!replayPath.empty())
+	{
+		started = pipeline.StartReplay(replayPath, settings);
+	}
+	else
+	{
+		started = pipeline.StartNetwork(host, port, settings);
+	}
+	if (!started)
+	{
+		ShutdownSockets();
+		return 1;
+	}
+
+	// one JSON line per second, as the plugin writes them
+	MrcStatsReport statsReport;
+	if (!statsPath.empty() && !statsReport.OpenFile(statsPath))
+	{
+		pipeline.Stop();
+		ShutdownSockets();
+		return 1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto lastReport = start;
+	MrcPipelineStats lastStats;
+	LatencyStats& latency = pipeline.GetLatencyStats();
+
+	// once the input ends, keep consuming until the decoder stops producing
+	// and the frame pacer has nothing left to hand out
+	const auto drainTime = std::chrono::milliseconds(200);
+	auto lastProgress = start;
+	uint64_t lastProgressCount = 0;
+
+	// the consumer: takes the newest (or with frame pacing, the due) picture
+	// at the rate a video tick would
+	while (!g_interrupted)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(1000000 / consumeHz));
+
+		DecodedImage* image = pipeline.TakeNewestImage();
+		if (image)
+		{
+			PipelineTimestamps timestamps = image->m_timestamps;
+			timestamps.upload = GetSteadyTimeNs();
+			latency.RecordPicture(timestamps);
+			if (timestamps.receive)
+			{
+				latency.Record(LatencyStage::Total, timestamps.upload - timestamps.receive);
+			}
+			pipeline.ReturnImage(image);
+		}
+
+		statsReport.Sample(pipeline, GetSteadyTimeNs(), 1000000000ULL);
+
+		auto now = std::chrono::steady_clock::now();
+		double sinceReport = std::chrono::duration<double>(now - lastReport).count();
+		if (sinceReport >= 1.0)
+		{
+			MrcPipelineStats stats = pipeline.GetStats();
+			if (replayPath.empty() && pipeline.GetConnectionState() != ConnectionState::Streaming)
+			{
+				MrcConnectionStatus status = pipeline.GetConnectionStatus();
+				printf("%s (%u failed attempts): %s\n", GetConnectionStateName(status.state),
+					status.failedAttempts, status.lastError.c_str());
+			}
+			PrintRates(stats, lastStats, sinceReport, settings.framePacing);
+			lastStats = stats;
+			lastReport = now;
+		}
+
+		if (duration > 0 && std::chrono::duration<double>(now - start).count() >= duration)
+		{
+			break;
+		}
+
+		MrcPipelineStats progressStats = pipeline.GetStats();
+		uint64_t progressCount = progressStats.picturesConverted + progressStats.imagesTaken;
+		if (progressCount != lastProgressCount)
+		{
+			lastProgressCount = progressCount;
+			lastProgress = now;
+		}
+		else if (pipeline.HasInputEnded() && now - lastProgress >= drainTime)
+		{
+			break;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	MrcPipelineStats stats = pipeline.GetStats();
+	pipeline.Stop();
+
+	printf("\n%.2f s total\n", seconds);
+	PrintRates(stats, MrcPipelineStats(), seconds, settings.framePacing);
+	if (settings.asyncOutput)
+	{
+		printf("%llu pictures and %llu audio frames output, timestamps not increasing: %llu pictures, %llu audio chunks\n",
+			(unsigned long long)sink.m_pictures.load(), (unsigned long long)sink.m_audioFrames.load(),
+			(unsigned long long)sink.m_pictureTimestampRepeats.load(), (unsigned long long)sink.m_audioTimestampRepeats.load());
+	}
+	if (replayPath.empty())
+	{
+		printf("%llu reconnects\n", (unsigned long long)pipeline.GetConnectionStatus().reconnects);
+	}
+	printf("first picture after %.1f ms, %llu pictures skipped before the first IDR\n",
+		stats.firstPictureNs / 1e6, (unsigned long long)stats.framesBeforeIdr);
+	printf("%s", latency.GetSummary().c_str());
+
+	ShutdownSockets();
+	return sink.m_pictureTimestampRepeats == 0 && sink.m_audioTimestampRepeats == 0 ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "decode-pool.h"
+#include "frame.h"
+#include "log.h"
+
+#include <algorithm>
+
+int MrcDecodePool::GetDefaultWorkerCount()
+{
+	int cores = (int)std::thread::hardware_concurrency();
+	return std::min(std::max(cores / 2, 1), 8);
+}
+
+MrcDecodePool::MrcDecodePool(int workerCount)
+{
+	workerCount = std::max(workerCount, 1);
+	for (int i = 0; i < workerCount; ++i)
+	{
+		m_workers.emplace_back(&MrcDecodePool::WorkerThread, this);
+	}
+	OM_LOG(LOG_INFO, "Decode pool started with %d workers", workerCount);
+}
+
+MrcDecodePool::~MrcDecodePool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_workAvailable.notify_all();
+	for (std::thread& worker : m_workers)
+	{
+		worker.join();
+	}
+
+	if (!m_tasks.empty())
+	{
+		OM_LOG(LOG_WARNING, "Decode pool destroyed with %d tasks still registered", (int)m_tasks.size());
+	}
+}
+
+MrcDecodePool::TaskState* MrcDecodePool::FindTask(MrcDecodeTask* task)
+{
+	for (TaskState& state : m_tasks)
+	{
+		if (state.task == task)
+		{
+			return &state;
+		}
+	}
+	return nullptr;
+}
+
+void MrcDecodePool::Register(MrcDecodeTask* task)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!FindTask(task))
+	{
+		m_tasks.push_back({ task, false, false, false });
+	}
+}
+
+void MrcDecodePool::Unregister(MrcDecodeTask* task)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_taskFinished.wait(lock, [&]() {
+		TaskState* state = FindTask(task);
+		return !state || !state->running;
+	});
+
+	m_runQueue.erase(std::remove(m_runQueue.begin(), m_runQueue.end(), task), m_runQueue.end());
+	m_tasks.erase(std::remove_if(m_tasks.begin(), m_tasks.end(), [&](const TaskState& state) {
+		return state.task == task;
+	}), m_tasks.end());
+}
+
+void MrcDecodePool::Schedule(MrcDecodeTask* task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		TaskState* state = FindTask(task);
+		if (!state)
+		{
+			return;
+		}
+		if (state->running)
+		{
+			state->rescheduled = true;
+			return;
+		}
+		if (state->queued)
+		{
+			return;
+		}
+		Enqueue(*state);
+	}
+	m_workAvailable.notify_one();
+}
+
+// called with m_mutex held
+void MrcDecodePool::Enqueue(TaskState& state)
+{
+	state.queued = true;
+	m_runQueue.push_back(state.task);
+}
+
+void MrcDecodePool::WorkerThread()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stopping)
+	{
+		uint64_t now = GetSteadyTimeNs();
+		if (now >= m_nextTick)
+		{
+			// time-driven work: every idle task gets a turn
+			m_nextTick = now + TickIntervalNs;
+			bool queuedAny = false;
+			for (TaskState& state : m_tasks)
+			{
+				if (!state.queued && !state.running)
+				{
+					Enqueue(state);
+					queuedAny = true;
+				}
+			}
+			if (queuedAny)
+			{
+				m_workAvailable.notify_all();
+			}
+		}
+
+		if (m_runQueue.empty())
+		{
+			m_workAvailable.wait_for(lock, std::chrono::nanoseconds(m_nextTick - now));
+			continue;
+		}
+
+		MrcDecodeTask* task = m_runQueue.front();
+		m_runQueue.pop_front();
+		TaskState* state = FindTask(task);
+		state->queued = false;
+		state->running = true;
+
+		lock.unlock();
+		task->RunDecode();
+		lock.lock();
+
+		// Unregister waits for running to clear, so the task is still there
+		state = FindTask(task);
+		state->running = false;
+		if (state->rescheduled)
+		{
+			state->rescheduled = false;
+			Enqueue(*state);
+		}
+		m_taskFinished.notify_all();
+	}
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work a source hands to MrcDecodePool. RunDecode is called on a pool
+// worker, never on two workers at the same time, and should do a bounded
+// amount of work before returning so other sources get their turn.
+class MrcDecodeTask
+{
+public:
+	virtual ~MrcDecodeTask() = default;
+
+	virtual void RunDecode() = 0;
+};
+
+// A fixed set of worker threads decoding for every MRC source. Sources
+// that have work wait in a single FIFO run queue, each at most once, so a
+// source with a backlog goes to the back of the queue after its turn
+// instead of starving the others. Every registered task is also run at
+// least every TickIntervalNs, for work driven by time such as releasing
+// scheduled audio.
+class MrcDecodePool
+{
+public:
+	static const uint64_t TickIntervalNs = 5000000;
+
+	// Half the cores, between 1 and 8
+	static int GetDefaultWorkerCount();
+
+	explicit MrcDecodePool(int workerCount = GetDefaultWorkerCount());
+	~MrcDecodePool();
+
+	int GetWorkerCount() const
+	{
+		return (int)m_workers.size();
+	}
+
+	void Register(MrcDecodeTask* task);
+
+	// Returns once the task is neither queued nor running
+	void Unregister(MrcDecodeTask* task);
+
+	// Queues the task to run; called from any thread, including from the
+	// task's own RunDecode to ask for another turn
+	void Schedule(MrcDecodeTask* task);
+
+private:
+	struct TaskState
+	{
+		MrcDecodeTask* task;
+		bool queued;
+		bool running;
+		bool rescheduled;	// scheduled again while running
+	};
+
+	void WorkerThread();
+	TaskState* FindTask(MrcDecodeTask* task);
+	void Enqueue(TaskState& state);
+
+	std::mutex m_mutex;
+	std::condition_variable m_workAvailable;
+	std::condition_variable m_taskFinished;
+	std::vector<TaskState> m_tasks;
+	std::deque<MrcDecodeTask*> m_runQueue;
+	uint64_t m_nextTick = 0;
+	bool m_stopping = false;
+
+	std::vector<std::thread> m_workers;
+};
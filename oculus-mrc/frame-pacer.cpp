@@ -0,0 +1,141 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "frame-pacer.h"
+
+#include <algorithm>
+
+// Assumed until arrivals have been measured
+static const uint64_t DefaultIntervalNs = 1000000000ULL / 60;
+// Measured intervals are clamped to this range, so bursts and stalls
+// cannot drag the estimate far off
+static const uint64_t MinIntervalNs = 1000000000ULL / 240;
+static const uint64_t MaxIntervalNs = 1000000000ULL / 10;
+// A gap this long is a new stream rather than jitter
+static const uint64_t RestartGapNs = 500 * 1000000ULL;
+// Weight of each new arrival, as a shift: the interval and the cadence
+// follow the stream over about 16 pictures
+static const int SmoothingShift = 4;
+static const uint32_t WarmupArrivals = 1 << SmoothingShift;
+// The extra delay given back per picture arriving in time, as a fraction
+// of the frame interval: 5 ms per second of stream
+static const uint64_t DelayDecayDivisor = 200;
+
+void FramePacer::Reset()
+{
+	m_started = false;
+	m_delay = m_targetDelay;
+	m_interval = DefaultIntervalNs;
+	m_arrivals = 0;
+	m_lastDue = 0;
+	m_lastStamp = 0;
+}
+
+void FramePacer::SetTargetDelay(uint64_t delayNs)
+{
+	m_targetDelay = delayNs;
+	m_delay = std::min(std::max(m_delay, m_targetDelay), m_targetDelay + MaxExtraDelayNs);
+}
+
+// Moves the cadence on to the picture that arrived at arrivalTime
+void FramePacer::TrackArrival(uint64_t arrivalTime)
+{
+	if (!m_started || arrivalTime < m_lastArrival || arrivalTime - m_lastArrival > RestartGapNs)
+	{
+		// start a new cadence on this picture, keeping the interval measured so far
+		m_started = true;
+		m_cadence = arrivalTime;
+		m_lastDue = 0;
+		if (m_interval == 0)
+		{
+			m_interval = DefaultIntervalNs;
+		}
+	}
+	else
+	{
+		uint64_t delta = std::min(std::max(arrivalTime - m_lastArrival, MinIntervalNs), MaxIntervalNs);
+		if (m_arrivals < WarmupArrivals)
+		{
+			// plain average of the first intervals, the default may be far off
+			m_interval = m_arrivals == 0 ? delta : (m_interval * m_arrivals + delta) / (m_arrivals + 1);
+			++m_arrivals;
+			m_cadence = arrivalTime;
+		}
+		else
+		{
+			m_interval = m_interval - (m_interval >> SmoothingShift) + (delta >> SmoothingShift);
+
+			// follow the arrivals slowly, so the cadence tracks clock drift and
+			// lasting shifts in transit time but not frame-to-frame jitter
+			uint64_t expected = m_cadence + m_interval;
+			int64_t error = (int64_t)(arrivalTime - expected);
+			m_cadence = expected + (error >> SmoothingShift);
+		}
+	}
+	m_lastArrival = arrivalTime;
+}
+
+uint64_t FramePacer::Schedule(uint64_t arrivalTime, uint64_t readyTime)
+{
+	TrackArrival(arrivalTime);
+
+	uint64_t due = m_cadence + m_delay;
+	if (m_lastDue != 0)
+	{
+		// never closer than half a frame to the previous picture
+		due = std::max(due, m_lastDue + m_interval / 2);
+	}
+
+	if (m_arrivals < WarmupArrivals)
+	{
+		// no cadence to be late for yet
+		due = std::max(due, readyTime);
+	}
+	else if (readyTime > due)
+	{
+		// late for its slot: wait that much longer for every picture from now on
+		uint64_t lateness = readyTime - due;
+		m_delay = std::min(m_delay + lateness, m_targetDelay + MaxExtraDelayNs);
+		due = readyTime;
+	}
+	else if (m_delay > m_targetDelay)
+	{
+		m_delay -= std::min(m_delay - m_targetDelay, m_interval / DelayDecayDivisor);
+	}
+
+	m_lastDue = due;
+	return due;
+}
+
+uint64_t FramePacer::Stamp(uint64_t arrivalTime)
+{
+	TrackArrival(arrivalTime);
+
+	uint64_t stamp = m_cadence;
+	if (m_lastStamp != 0)
+	{
+		// unlike m_lastDue this survives a new cadence, stamps only go forward
+		stamp = std::max(stamp, m_lastStamp + m_interval / 2);
+	}
+	m_lastStamp = stamp;
+	return stamp;
+}
+
+void FramePacer::ReportOverrun()
+{
+	m_delay -= std::min(m_delay - m_targetDelay, m_interval);
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+// Presentation clock for decoded pictures. Arrival times are smoothed into
+// a steady cadence at the measured frame interval, and each picture is due
+// a delay after its place on that cadence, so network and decoder jitter
+// smaller than the delay no longer shows as judder. The delay starts at the
+// target, grows by however late a picture turned out to be for its slot,
+// and creeps back toward the target while pictures keep arriving in time.
+class FramePacer
+{
+public:
+	// Above the target delay, the most a run of late pictures can add
+	static const uint64_t MaxExtraDelayNs = 100 * 1000000ULL;
+
+	void Reset();
+
+	void SetTargetDelay(uint64_t delayNs);
+
+	// Returns when a picture that arrived at arrivalTime, and was ready to
+	// show at readyTime, should be shown (steady_clock nanoseconds)
+	uint64_t Schedule(uint64_t arrivalTime, uint64_t readyTime);
+
+	// For a consumer that buffers and paces pictures itself: where a picture
+	// that arrived at arrivalTime sits on the smoothed cadence, with no delay
+	// added. Pictures arriving together get stamps half a frame apart or
+	// more, so a stamp never repeats or goes back.
+	uint64_t Stamp(uint64_t arrivalTime);
+
+	// More pictures are waiting than the consumer can hold: the delay is
+	// longer than the stream needs, shorten it by a frame
+	void ReportOverrun();
+
+	uint64_t GetDelay() const
+	{
+		return m_delay;
+	}
+
+	uint64_t GetFrameInterval() const
+	{
+		return m_interval;
+	}
+
+private:
+	void TrackArrival(uint64_t arrivalTime);
+
+	uint64_t m_targetDelay = 0;
+	uint64_t m_delay = 0;
+
+	bool m_started = false;
+	uint64_t m_lastArrival = 0;
+	uint64_t m_interval = 0;	// smoothed time between arrivals
+	uint32_t m_arrivals = 0;	// intervals measured, up to the warm-up count
+	uint64_t m_cadence = 0;		// smoothed arrival time of the last picture
+	uint64_t m_lastDue = 0;
+	uint64_t m_lastStamp = 0;
+};
@@ -18,119 +18,556 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "frame.h"
 #include "log.h"
 
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OM_HAS_SSE2 1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static const size_t NotFound = (size_t)-1;
+
+#if OM_HAS_SSE2
+static int CountTrailingZeros(uint32_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return (int)index;
+#else
+	return __builtin_ctz(value);
+#endif
+}
+#endif
+
+// Offset of the first occurrence of the little-endian magic in data, or
+// NotFound. Compares 16 candidate positions at a time where SSE2 is
+// available; the tail, and other targets, go through memchr.
+static size_t FindMagic(const uint8_t* data, size_t size, uint32_t magic)
+{
+	if (size < sizeof(uint32_t))
+	{
+		return NotFound;
+	}
+
+	size_t offset = 0;
+#if OM_HAS_SSE2
+	const __m128i byte0 = _mm_set1_epi8((char)(magic & 0xff));
+	const __m128i byte1 = _mm_set1_epi8((char)((magic >> 8) & 0xff));
+	const __m128i byte2 = _mm_set1_epi8((char)((magic >> 16) & 0xff));
+	const __m128i byte3 = _mm_set1_epi8((char)(magic >> 24));
+	for (; offset + 16 + 3 <= size; offset += 16)
+	{
+		__m128i match = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + offset)), byte0);
+		match = _mm_and_si128(match, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + offset + 1)), byte1));
+		match = _mm_and_si128(match, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + offset + 2)), byte2));
+		match = _mm_and_si128(match, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + offset + 3)), byte3));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(match);
+		if (mask)
+		{
+			return offset + CountTrailingZeros(mask);
+		}
+	}
+#endif
+
+	size_t last = size - sizeof(uint32_t);
+	while (offset <= last)
+	{
+		const uint8_t* candidate = (const uint8_t*)memchr(data + offset, (int)(magic & 0xff), last + 1 - offset);
+		if (!candidate)
+		{
+			break;
+		}
+		offset = (size_t)(candidate - data);
+
+		uint32_t value;
+		memcpy(&value, candidate, sizeof(value));
+		if (value == magic)
+		{
+			return offset;
+		}
+		++offset;
+	}
+	return NotFound;
+}
+
+const char* Frame::GetPayloadTypeName(PayloadType type)
+{
+	switch (type)
+	{
+	case PayloadType::VIDEO_DIMENSION:
+		return "video_dimension";
+	case PayloadType::VIDEO_DATA:
+		return "video_data";
+	case PayloadType::AUDIO_SAMPLERATE:
+		return "audio_samplerate";
+	case PayloadType::AUDIO_DATA:
+		return "audio_data";
+	}
+	return "unknown";
+}
+
+void FrameRecycler::operator()(Frame* frame) const
+{
+	if (m_pool)
+	{
+		m_pool->ReleaseFrame(frame);
+	}
+	else
+	{
+		delete frame;
+	}
+}
+
+FramePool::FramePool()
+{
+	for (int i = 0; i < NumSizeClasses; ++i)
+	{
+		m_payloadPools[i] = av_buffer_pool_init2(1 << (MinSizeClassShift + i), this, &FramePool::AllocatePayloadBlock, nullptr);
+	}
+}
+
+FramePool::~FramePool()
+{
+	// Buffers still referenced elsewhere keep their pool alive until released
+	for (int i = 0; i < NumSizeClasses; ++i)
+	{
+		av_buffer_pool_uninit(&m_payloadPools[i]);
+	}
+
+	for (Frame* frame : m_freeFrames)
+	{
+		delete frame;
+	}
+	m_freeFrames.clear();
+}
+
+AVBufferRef* FramePool::AllocatePayloadBlock(void* opaque, BufferPoolSize size)
+{
+	FramePool* pool = (FramePool*)opaque;
+	++pool->m_allocationCount;
+	return av_buffer_alloc(size);
+}
+
+FramePtr FramePool::AcquireFrame()
+{
+	++m_acquireCount;
+
+	Frame* frame = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(m_freeFramesMutex);
+		if (!m_freeFrames.empty())
+		{
+			frame = m_freeFrames.back();
+			m_freeFrames.pop_back();
+		}
+	}
+
+	if (!frame)
+	{
+		++m_allocationCount;
+		frame = new Frame();
+	}
+
+	return FramePtr(frame, FrameRecycler{ this });
+}
+
+void FramePool::ReleaseFrame(Frame* frame)
+{
+	av_buffer_unref(&frame->m_payload);
+	frame->m_payloadLength = 0;
+	frame->m_discontinuity = false;
+
+	std::lock_guard<std::mutex> lock(m_freeFramesMutex);
+	m_freeFrames.push_back(frame);
+}
+
+bool FramePool::AllocatePayload(Frame& frame, uint32_t length)
+{
+	av_buffer_unref(&frame.m_payload);
+	frame.m_payloadLength = 0;
+
+	size_t required = (size_t)length + AV_INPUT_BUFFER_PADDING_SIZE;
+	int sizeClass = 0;
+	while (sizeClass < NumSizeClasses && ((size_t)1 << (MinSizeClassShift + sizeClass)) < required)
+	{
+		++sizeClass;
+	}
+
+	if (sizeClass < NumSizeClasses && m_payloadPools[sizeClass])
+	{
+		frame.m_payload = av_buffer_pool_get(m_payloadPools[sizeClass]);
+	}
+	else
+	{
+		// larger than any size class, not worth keeping around
+		++m_allocationCount;
+		frame.m_payload = av_buffer_alloc((int)required);
+	}
+
+	if (!frame.m_payload)
+	{
+		return false;
+	}
+	memset(frame.m_payload->data + length, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	frame.m_payloadLength = length;
+	return true;
+}
+
 FrameCollection::FrameCollection()
-	: m_hasError(false)
+	: m_scratchPad(16 * 1024 * 1024)
+	, m_frames(1024)
 {
-	m_scratchPad.reserve(16 * 1024 * 1024);
 }
 
 FrameCollection::~FrameCollection()
 {
+	DrainFrames();
+}
+
+void FrameCollection::DrainFrames()
+{
+	Frame* frame = nullptr;
+	while (m_frames.TryPop(frame))
+	{
+		CountQueuedFrame(*frame, false);
+		FramePtr released(frame, FrameRecycler{ &m_framePool });
+	}
 }
 
 void FrameCollection::Reset()
 {
 	std::lock_guard<std::mutex> lock(m_frameMutex);
 
-	m_hasError = false;
-	m_scratchPad.clear();
-	m_frames.clear();
+	m_scratchPad.Clear();
+	DrainFrames();
 	m_firstFrameTimeSet = false;
+	m_bytesReceived = 0;
+	m_bytesCopied = 0;
+	m_pushCancelled = false;
+	m_droppedFrames = 0;
+	for (std::atomic<uint64_t>& count : m_parsedFrames)
+	{
+		count = 0;
+	}
+	m_bufferedBytes = 0;
+	m_discontinuity = false;
+	m_resyncing = false;
+	m_resyncSkippedThisEvent = 0;
+	m_resyncCount = 0;
+	m_resyncBytesSkipped = 0;
 }
 
-void FrameCollection::AddData(const uint8_t* data, uint32_t len)
+void FrameCollection::BeginNewStream()
 {
 	std::lock_guard<std::mutex> lock(m_frameMutex);
 
-	if (m_hasError)
-	{
-		return;
-	}
+	m_scratchPad.Clear();
+	m_bufferedBytes = 0;
+	m_discontinuity = true;
+	m_resyncing = false;
+}
+
+void FrameCollection::AddData(const uint8_t* data, uint32_t len)
+{
+	std::lock_guard<std::mutex> lock(m_frameMutex);
 
 #if _DEBUG
 	OM_LOG(LOG_DEBUG, "FrameCollection::AddData, len = %u", len);
 #endif
-	m_scratchPad.insert(m_scratchPad.end(), data, data + len);
+	uint64_t now = GetSteadyTimeNs();
+	if (m_scratchPad.Size() == 0)
+	{
+		m_frameStartTime = now;
+	}
+	m_scratchPad.Write(data, len);
+	m_bytesReceived += len;
+	m_bytesCopied += len;
+
+	ParseFrames(now);
+	m_bufferedBytes = m_scratchPad.Size();
+}
+
+uint8_t* FrameCollection::GetReceiveBuffer(size_t& size)
+{
+	std::lock_guard<std::mutex> lock(m_frameMutex);
+
+	return m_scratchPad.GetWriteSpace(64 * 1024, size);
+}
+
+void FrameCollection::CommitReceivedData(uint32_t len)
+{
+	std::lock_guard<std::mutex> lock(m_frameMutex);
+
+	uint64_t now = GetSteadyTimeNs();
+	if (m_scratchPad.Size() == 0)
+	{
+		m_frameStartTime = now;
+	}
+	m_scratchPad.CommitWrite(len);
+	m_bytesReceived += len;
+
+	ParseFrames(now);
+	m_bufferedBytes = m_scratchPad.Size();
+}
+
+bool FrameCollection::IsValidHeader(const FrameHeader& header)
+{
+	if (header.Magic != Magic)
+	{
+		return false;
+	}
+	if (header.PayloadType < (uint32_t)Frame::PayloadType::VIDEO_DIMENSION ||
+		header.PayloadType > (uint32_t)Frame::PayloadType::AUDIO_DATA)
+	{
+		return false;
+	}
+	if (header.PayloadLength > MaxPayloadLength)
+	{
+		return false;
+	}
+	return (uint64_t)header.TotalDataLengthExcludingMagic + sizeof(uint32_t) == sizeof(FrameHeader) + (uint64_t)header.PayloadLength;
+}
 
-	while (m_scratchPad.size() >= sizeof(FrameHeader))
+// Offset of the first magic in [from, end) of the scratch pad whose header
+// is valid, or not fully received yet and so cannot be ruled out
+size_t FrameCollection::FindFrameHeader(size_t from, size_t end) const
+{
+	size_t offset = from;
+	while (offset + sizeof(uint32_t) <= end)
 	{
-		const FrameHeader* frameHeader = (const FrameHeader*)m_scratchPad.data();
-		if (frameHeader->Magic != Magic)
+		size_t length = 0;
+		const uint8_t* span = m_scratchPad.GetReadSpan(offset, length);
+		length = std::min(length, end - offset);
+
+		size_t found = NotFound;
+		size_t searched = 1;
+		if (length >= sizeof(uint32_t))
+		{
+			found = FindMagic(span, length, Magic);
+			// a magic may straddle the end of the storage, its first bytes are
+			// searched again with the ones that follow
+			searched = length - (sizeof(uint32_t) - 1);
+		}
+		else
+		{
+			uint32_t magic;
+			m_scratchPad.Peek(&magic, sizeof(magic), offset);
+			found = magic == Magic ? 0 : NotFound;
+		}
+
+		if (found == NotFound)
+		{
+			offset += searched;
+			continue;
+		}
+
+		size_t candidate = offset + found;
+		if (m_scratchPad.Size() < candidate + sizeof(FrameHeader))
 		{
-			OM_LOG(LOG_ERROR, "Frame magic mismatch: expected 0x%08x get 0x%08x", Magic, frameHeader->Magic);
-			m_hasError = true;
-			return;
+			return candidate;
 		}
-		uint32_t frameLengthExcludingMagic = frameHeader->TotalDataLengthExcludingMagic;
-		if (m_scratchPad.size() >= sizeof(uint32_t) + frameLengthExcludingMagic)
+		FrameHeader header;
+		m_scratchPad.Peek(&header, sizeof(header), candidate);
+		if (IsValidHeader(header))
 		{
-			if (frameHeader->PayloadLength != frameHeader->TotalDataLengthExcludingMagic + sizeof(uint32_t) - sizeof(FrameHeader))
+			return candidate;
+		}
+		offset = candidate + 1;
+	}
+	return NotFound;
+}
+
+void FrameCollection::SkipCorruptBytes(size_t length)
+{
+	if (!m_resyncing)
+	{
+		m_resyncing = true;
+		m_resyncSkippedThisEvent = 0;
+		m_resyncStartOffset = m_bytesReceived - m_scratchPad.Size();
+		++m_resyncCount;
+	}
+	m_resyncSkippedThisEvent += length;
+	m_resyncBytesSkipped += length;
+	m_scratchPad.Consume(length);
+}
+
+void FrameCollection::ParseFrames(uint64_t receiveTime)
+{
+	while (m_scratchPad.Size() >= sizeof(FrameHeader))
+	{
+		FrameHeader frameHeader;
+		m_scratchPad.Peek(&frameHeader, sizeof(FrameHeader));
+		if (!IsValidHeader(frameHeader))
+		{
+			// drop everything up to the next plausible header, keeping the last
+			// bytes when there is none in case they start one
+			size_t next = FindFrameHeader(1, m_scratchPad.Size());
+			SkipCorruptBytes(next != NotFound ? next : m_scratchPad.Size() - (sizeof(uint32_t) - 1));
+			if (next == NotFound)
 			{
-				OM_LOG(LOG_ERROR, "Frame length mismatch: length %u, payload length %u", frameHeader->TotalDataLengthExcludingMagic, frameHeader->PayloadLength);
-				m_hasError = true;
-				return;
+				break;
 			}
+			continue;
+		}
 
-			std::shared_ptr<Frame> frame = std::make_shared<Frame>();
-			frame->m_type = (Frame::PayloadType)frameHeader->PayloadType;
-			//frame->m_secondsSinceEpoch = frameHeader->SecondsSinceEpoch;
-			auto first = m_scratchPad.begin() + sizeof(FrameHeader);
-			auto last = first + frameHeader->PayloadLength;
+		size_t frameLength = sizeof(FrameHeader) + frameHeader.PayloadLength;
+		if (m_scratchPad.Size() < frameLength)
+		{
+			break;
+		}
 
-			if (m_scratchPad.size() >= sizeof(uint32_t) + frameHeader->TotalDataLengthExcludingMagic + sizeof(uint32_t))
+		// A frame that is not followed by a magic lost or gained bytes. When a
+		// valid header starts inside it, it was cut short and is dropped; if
+		// not, the damage is in what follows and is dealt with on the next pass.
+		if (m_scratchPad.Size() >= frameLength + sizeof(uint32_t))
+		{
+			uint32_t magic;
+			m_scratchPad.Peek(&magic, sizeof(uint32_t), frameLength);
+			if (magic != Magic)
 			{
-				uint32_t* magic = (uint32_t*)&m_scratchPad.at(sizeof(uint32_t) + frameHeader->TotalDataLengthExcludingMagic);
-				if (*magic != Magic)
+				size_t next = FindFrameHeader(1, frameLength);
+				if (next != NotFound)
 				{
-					OM_LOG(LOG_ERROR, "Will have magic number error in next frame: current frame type %d, frame length %d, scratchPad size %d",
-						frame->m_type,
-						sizeof(uint32_t) + frameHeader->TotalDataLengthExcludingMagic,
-						m_scratchPad.size());
+					SkipCorruptBytes(next);
+					continue;
 				}
 			}
+		}
 
-			frame->m_payload.assign(first, last);
-			m_frames.push_back(frame);
+		if (m_resyncing)
+		{
+			m_resyncing = false;
+			OM_LOG(LOG_WARNING, "Corrupt frame data at stream offset %llu, skipped %llu bytes to the next frame (type %u)",
+				(unsigned long long)m_resyncStartOffset, (unsigned long long)m_resyncSkippedThisEvent, frameHeader.PayloadType);
+		}
 
-			if (!m_firstFrameTimeSet)
-			{
-				m_firstFrameTimeSet = true;
-				m_firstFrameTime = std::chrono::system_clock::now();
-			}
-#if _DEBUG
-			std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_firstFrameTime;
+		FramePtr frame = m_framePool.AcquireFrame();
+		frame->m_type = (Frame::PayloadType)frameHeader.PayloadType;
+		++m_parsedFrames[Frame::GetPayloadTypeIndex(frame->m_type)];
+		frame->m_receiveStartTime = m_frameStartTime;
+		frame->m_receiveTime = receiveTime;
+		frame->m_discontinuity = m_discontinuity;
+		//frame->m_secondsSinceEpoch = frameHeader.SecondsSinceEpoch;
 
-			static int frameIndex = 0;
-			OM_LOG(LOG_DEBUG, "[%f] new frame(%d) pushed, type %u, payload %u bytes", timePassed.count(), frameIndex++, frame->m_type, frame->m_payload.size());
-#endif
-			m_scratchPad.erase(m_scratchPad.begin(), last);
+		if (!m_framePool.AllocatePayload(*frame, frameHeader.PayloadLength))
+		{
+			OM_LOG(LOG_ERROR, "Unable to allocate %u bytes for frame payload, dropping the frame", frameHeader.PayloadLength);
+			m_scratchPad.Consume(frameLength);
+			++m_droppedFrames;
+			continue;
+		}
+		m_scratchPad.Peek(frame->PayloadData(), frameHeader.PayloadLength, sizeof(FrameHeader));
+		m_bytesCopied += frameHeader.PayloadLength;
+		if (frame->m_type == Frame::PayloadType::VIDEO_DATA)
+		{
+			// lets the consumer tell which pictures it can skip when it falls behind
+			ScanH264AccessUnit(frame->PayloadData(), frame->m_payloadLength, frame->m_videoInfo);
 		}
 		else
 		{
-			break;
+			frame->m_videoInfo = H264AccessUnitInfo();
 		}
+		m_scratchPad.Consume(frameLength);
+		// whatever follows this frame arrived with the current chunk
+		m_frameStartTime = receiveTime;
+#if _DEBUG
+		Frame::PayloadType frameType = frame->m_type;
+#endif
+		if (PushFrame(frame))
+		{
+			m_discontinuity = false;
+		}
+
+		if (!m_firstFrameTimeSet)
+		{
+			m_firstFrameTimeSet = true;
+			m_firstFrameTime = std::chrono::system_clock::now();
+		}
+#if _DEBUG
+		std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_firstFrameTime;
+
+		static int frameIndex = 0;
+		OM_LOG(LOG_DEBUG, "[%f] new frame(%d) pushed, type %u, payload %u bytes", timePassed.count(), frameIndex++, frameType, frameHeader.PayloadLength);
+#endif
 	}
 }
 
-bool FrameCollection::HasCompletedFrame()
+void FrameCollection::CountQueuedFrame(const Frame& frame, bool queued)
 {
-	std::lock_guard<std::mutex> lock(m_frameMutex);
+	if (frame.m_type != Frame::PayloadType::VIDEO_DATA)
+	{
+		return;
+	}
+	if (queued)
+	{
+		++m_queuedVideoFrames;
+		m_queuedVideoBytes += frame.m_payloadLength;
+		m_queuedIdrFrames += frame.m_videoInfo.isIdr ? 1 : 0;
+	}
+	else
+	{
+		--m_queuedVideoFrames;
+		m_queuedVideoBytes -= frame.m_payloadLength;
+		m_queuedIdrFrames -= frame.m_videoInfo.isIdr ? 1 : 0;
+	}
+}
+
+bool FrameCollection::PushFrame(FramePtr& frame)
+{
+	// counted before the push, the consumer may pop it straight away
+	CountQueuedFrame(*frame, true);
+	while (!m_frames.TryPush(frame.get()))
+	{
+		if (m_overflowPolicy == OverflowPolicy::Drop || m_pushCancelled)
+		{
+			CountQueuedFrame(*frame, false);
+			if (m_droppedFrames++ == 0)
+			{
+				OM_LOG(LOG_WARNING, "Frame queue full (%u frames), dropping frames", (uint32_t)m_frames.Capacity());
+			}
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
 
-	return m_frames.size() > 0;
+	frame.release();
+
+	// taking the lock orders this push against a consumer about to wait
+	{
+		std::lock_guard<std::mutex> lock(m_frameSignalMutex);
+	}
+	m_frameSignal.notify_one();
+	return true;
 }
 
-std::shared_ptr<Frame> FrameCollection::PopFrame()
+bool FrameCollection::WaitForFrame(std::chrono::milliseconds timeout)
 {
-	std::lock_guard<std::mutex> lock(m_frameMutex);
+	if (HasCompletedFrame())
+	{
+		return true;
+	}
 
-	if (m_frames.size() > 0)
+	std::unique_lock<std::mutex> lock(m_frameSignalMutex);
+	return m_frameSignal.wait_for(lock, timeout, [this]() {
+		return HasCompletedFrame();
+	});
+}
+
+FramePtr FrameCollection::PopFrame()
+{
+	Frame* frame = nullptr;
+	if (m_frames.TryPop(frame))
 	{
-		auto result = m_frames.front();
-		m_frames.pop_front();
-		return result;
+		CountQueuedFrame(*frame, false);
+		return FramePtr(frame, FrameRecycler{ &m_framePool });
 	}
 	else
 	{
-		return std::shared_ptr<Frame>(nullptr);
+		return FramePtr();
 	}
 }
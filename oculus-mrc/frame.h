@@ -20,10 +20,40 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <stdint.h>
 #include <memory>
 #include <vector>
-#include <list>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
 #include <cassert>
 
+#pragma warning(push)
+#pragma warning(disable:4244)
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+}
+
+#pragma warning(pop)
+
+// av_buffer_pool_init2's allocator takes the size as size_t since libavutil 57
+#if LIBAVUTIL_VERSION_MAJOR >= 57
+typedef size_t BufferPoolSize;
+#else
+typedef int BufferPoolSize;
+#endif
+
+#include "ring-buffer.h"
+#include "spsc-queue.h"
+#include "h264-nal.h"
+
+// Clock used for all pipeline timestamps, in nanoseconds
+inline uint64_t GetSteadyTimeNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 struct FrameHeader
 {
 	uint32_t Magic;
@@ -41,16 +71,114 @@ struct Frame
 		AUDIO_SAMPLERATE = 12,
 		AUDIO_DATA = 13,
 	};
+
+	// The payload types are consecutive from VIDEO_DIMENSION
+	static const uint32_t NumPayloadTypes = 4;
+
+	static uint32_t GetPayloadTypeIndex(PayloadType type)
+	{
+		return (uint32_t)type - (uint32_t)PayloadType::VIDEO_DIMENSION;
+	}
+
+	static const char* GetPayloadTypeName(PayloadType type);
+
+	Frame() = default;
+	Frame(const Frame&) = delete;
+	Frame& operator=(const Frame&) = delete;
+
+	~Frame()
+	{
+		av_buffer_unref(&m_payload);
+	}
+
+	uint8_t* PayloadData() const
+	{
+		return m_payload ? m_payload->data : nullptr;
+	}
+
 	PayloadType m_type;
 	double m_secondsSinceEpoch;
-	std::vector<uint8_t> m_payload;
+	uint64_t m_receiveStartTime = 0;	// steady_clock nanoseconds when the first byte was received
+	uint64_t m_receiveTime = 0;	// steady_clock nanoseconds when the frame was fully received
+	bool m_discontinuity = false;	// first frame of a new connection
+	H264AccessUnitInfo m_videoInfo;	// VIDEO_DATA only
+	AVBufferRef* m_payload = nullptr;
+	uint32_t m_payloadLength = 0;
 };
 
 //typedef std::vector<uint8_t> Frame;
 
+class FramePool;
+
+struct FrameRecycler
+{
+	FramePool* m_pool = nullptr;
+	void operator()(Frame* frame) const;
+};
+
+// Frames hand themselves back to the pool they came from when released
+typedef std::unique_ptr<Frame, FrameRecycler> FramePtr;
+
+// Recycles Frame objects and their payload buffers so that, once the pools
+// have warmed up, parsing a packet does not touch the heap. Payloads come
+// from power-of-two size classes backed by AVBufferPool, so a buffer still
+// referenced by the decoder simply returns to its pool when libavcodec
+// releases it.
+class FramePool
+{
+public:
+	FramePool();
+	~FramePool();
+
+	FramePtr AcquireFrame();
+
+	// Gives the frame a payload of length bytes followed by
+	// AV_INPUT_BUFFER_PADDING_SIZE zeroed bytes, so it can be passed to
+	// libavcodec without copying
+	bool AllocatePayload(Frame& frame, uint32_t length);
+
+	// Heap allocations made by the pool (new Frames and payload blocks). The
+	// AVBufferRef that av_buffer_pool_get allocates for every payload is not
+	// counted here; the bench counts those at the allocator.
+	uint64_t GetAllocationCount() const
+	{
+		return m_allocationCount;
+	}
+
+	uint64_t GetAcquireCount() const
+	{
+		return m_acquireCount;
+	}
+
+private:
+	friend struct FrameRecycler;
+
+	void ReleaseFrame(Frame* frame);
+
+	static AVBufferRef* AllocatePayloadBlock(void* opaque, BufferPoolSize size);
+
+	static const int MinSizeClassShift = 12;	// 4 KB
+	static const int NumSizeClasses = 13;		// up to 16 MB
+
+	AVBufferPool* m_payloadPools[NumSizeClasses] = {};
+
+	std::mutex m_freeFramesMutex;
+	std::vector<Frame*> m_freeFrames;
+
+	std::atomic<uint64_t> m_allocationCount { 0 };
+	std::atomic<uint64_t> m_acquireCount { 0 };
+};
+
 class FrameCollection
 {
 public:
+	// What the parser does when the consumer has not kept up and the frame
+	// queue is full
+	enum class OverflowPolicy {
+		Block,	// wait for the consumer, pushing back on the TCP stream
+		Drop,	// discard the new frame and count it
+	};
+
 	FrameCollection();
 	~FrameCollection();
 
@@ -58,18 +186,134 @@ public:
 
 	void AddData(const uint8_t* data, uint32_t len);
 
-	bool HasCompletedFrame();
+	// Called by the producer when a new connection starts: drops the partial
+	// frame left by the old one and flags the next frame as a discontinuity,
+	// while frames already queued are still delivered
+	void BeginNewStream();
+
+	// Lets the receiver recv() straight into the reassembly buffer: fill up to
+	// size bytes at the returned pointer, then pass the count to CommitReceivedData
+	uint8_t* GetReceiveBuffer(size_t& size);
+	void CommitReceivedData(uint32_t len);
+
+	// Called from the producer's thread; AddData and CommitReceivedData must
+	// not be used from more than one thread at a time
+	void SetOverflowPolicy(OverflowPolicy policy)
+	{
+		m_overflowPolicy = policy;
+	}
+
+	// Makes a producer blocked on a full queue give up, so the consumer can
+	// be stopped without deadlocking. Cleared by Reset().
+	void CancelBlockingPush()
+	{
+		m_pushCancelled = true;
+	}
+
+	// The frame queue is lock-free with a single consumer: HasCompletedFrame,
+	// PopFrame and PopAllFrames must all be called from the same thread
+	bool HasCompletedFrame() const
+	{
+		return !m_frames.IsEmpty();
+	}
+
+	FramePtr PopFrame();
+
+	// Blocks the consumer until a frame is queued or the timeout expires
+	bool WaitForFrame(std::chrono::milliseconds timeout);
+
+	// Hands every frame completed so far to func, oldest first
+	template<typename Func>
+	size_t PopAllFrames(Func func)
+	{
+		return m_frames.PopAll([&](Frame* frame) {
+			CountQueuedFrame(*frame, false);
+			func(FramePtr(frame, FrameRecycler{ &m_framePool }));
+		});
+	}
 
-	std::shared_ptr<Frame> PopFrame();
+	size_t GetQueuedFrameCount() const
+	{
+		return m_frames.SizeApprox();
+	}
+
+	size_t GetQueueCapacity() const
+	{
+		return m_frames.Capacity();
+	}
 
-	bool HasError() const
+	uint64_t GetDroppedFrameCount() const
 	{
-		return m_hasError;
+		return m_droppedFrames;
+	}
+
+	// Frames parsed of one payload type, queued or dropped
+	uint64_t GetParsedFrameCount(Frame::PayloadType type) const
+	{
+		return m_parsedFrames[Frame::GetPayloadTypeIndex(type)];
+	}
+
+	// VIDEO_DATA frames, their payload bytes and the IDR pictures among
+	// them queued for the consumer
+	uint32_t GetQueuedVideoCount() const
+	{
+		return m_queuedVideoFrames;
+	}
+
+	size_t GetQueuedVideoBytes() const
+	{
+		return m_queuedVideoBytes;
+	}
+
+	uint32_t GetQueuedIdrCount() const
+	{
+		return m_queuedIdrFrames;
+	}
+
+	// Bytes in the reassembly buffer, the start of a frame still arriving
+	size_t GetBufferedBytes() const
+	{
+		return m_bufferedBytes;
+	}
+
+	// Times the parser lost the frame boundaries on corrupt data and scanned
+	// ahead for the next valid header, and the bytes it dropped doing so
+	uint64_t GetResyncCount() const
+	{
+		return m_resyncCount;
+	}
+
+	uint64_t GetResyncBytesSkipped() const
+	{
+		return m_resyncBytesSkipped;
 	}
 
 	bool HasFirstFrame() const
 	{
-		return m_firstFrameTimeSet && !m_hasError;
+		return m_firstFrameTimeSet;
+	}
+
+	// Bytes received, and bytes memcpy'd by the parser on their way into a
+	// Frame payload (AddData writes into the ring buffer and payload copies)
+	uint64_t GetBytesReceived() const
+	{
+		return m_bytesReceived;
+	}
+
+	uint64_t GetBytesCopied() const
+	{
+		return m_bytesCopied;
+	}
+
+	// Heap allocations made while parsing, including the frame pool's
+	uint64_t GetAllocationCount() const
+	{
+		return m_framePool.GetAllocationCount();
+	}
+
+	uint64_t GetFrameCount() const
+	{
+		return m_framePool.GetAcquireCount();
 	}
 
 	std::chrono::time_point<std::chrono::system_clock> GetFirstFrameTime() const
@@ -85,15 +329,49 @@ public:
 	}
 
 private:
-	uint32_t Magic = 0x2877AF94;
+	static const uint32_t Magic = 0x2877AF94;
+
+	// Larger payloads are taken as a corrupt header
+	static const uint32_t MaxPayloadLength = 32 * 1024 * 1024;
 
 	bool m_firstFrameTimeSet = false;
 	std::chrono::time_point<std::chrono::system_clock> m_firstFrameTime;
 
-	std::vector<uint8_t> m_scratchPad;
-	std::list<std::shared_ptr<Frame>> m_frames;
+	FramePool m_framePool;
+
+	RingBuffer m_scratchPad;
+	SpscQueue<Frame*> m_frames;
+	OverflowPolicy m_overflowPolicy = OverflowPolicy::Block;
+	std::atomic<bool> m_pushCancelled { false };
+	std::atomic<uint64_t> m_droppedFrames { 0 };
+	std::atomic<uint64_t> m_parsedFrames[Frame::NumPayloadTypes] = {};
+	std::atomic<size_t> m_bufferedBytes { 0 };	// m_scratchPad.Size() after the last parse
+	std::atomic<uint32_t> m_queuedVideoFrames { 0 };
+	std::atomic<size_t> m_queuedVideoBytes { 0 };
+	std::atomic<uint32_t> m_queuedIdrFrames { 0 };
+
+	std::mutex m_frameSignalMutex;
+	std::condition_variable m_frameSignal;
 
 	std::mutex m_frameMutex;
 
-	bool m_hasError;
+	uint64_t m_frameStartTime = 0;	// when the first byte of the frame at the head of m_scratchPad arrived
+	bool m_discontinuity = false;	// given to the next frame parsed
+
+	void ParseFrames(uint64_t receiveTime);
+	static bool IsValidHeader(const FrameHeader& header);
+	size_t FindFrameHeader(size_t from, size_t end) const;
+	void SkipCorruptBytes(size_t length);
+	bool PushFrame(FramePtr& frame);
+	void CountQueuedFrame(const Frame& frame, bool queued);
+	void DrainFrames();
+
+	std::atomic<uint64_t> m_bytesReceived { 0 };	// read by other threads for stats
+	uint64_t m_bytesCopied = 0;
+
+	bool m_resyncing = false;	// dropping bytes until the next valid frame
+	uint64_t m_resyncStartOffset = 0;
+	uint64_t m_resyncSkippedThisEvent = 0;
+	std::atomic<uint64_t> m_resyncCount { 0 };
+	std::atomic<uint64_t> m_resyncBytesSkipped { 0 };
 };
@@ -0,0 +1,93 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "h264-nal.h"
+
+#include <string.h>
+
+enum class H264NalType : uint8_t {
+	Slice = 1,
+	SliceIdr = 5,
+	Sps = 7,
+	Pps = 8,
+};
+
+// Offset of the NAL unit header after the next 00 00 01 start code at or
+// after from, or size if there is none
+static size_t FindNalUnit(const uint8_t* data, size_t size, size_t from)
+{
+	size_t pos = from + 2;
+	while (pos < size)
+	{
+		const uint8_t* one = (const uint8_t*)memchr(data + pos, 1, size - pos);
+		if (!one)
+		{
+			break;
+		}
+		pos = (size_t)(one - data);
+		if (data[pos - 1] == 0 && data[pos - 2] == 0)
+		{
+			return pos + 1;
+		}
+		pos += 3;
+	}
+	return size;
+}
+
+bool ScanH264AccessUnit(const uint8_t* data, size_t size, H264AccessUnitInfo& info)
+{
+	info = H264AccessUnitInfo();
+
+	size_t next = FindNalUnit(data, size, 0);
+	while (next < size)
+	{
+		size_t pos = next;
+		next = FindNalUnit(data, size, pos);
+		info.scanned = true;
+
+		uint8_t header = data[pos];
+		uint8_t nalRefIdc = (header >> 5) & 0x3;
+		H264NalType type = (H264NalType)(header & 0x1f);
+
+		if (type == H264NalType::Sps || type == H264NalType::Pps)
+		{
+			info.hasParameterSets = true;
+
+			// up to the next start code, less the zero bytes that may pad it
+			size_t end = next < size ? next - 3 : size;
+			while (end > pos + 1 && data[end - 1] == 0)
+			{
+				--end;
+			}
+			uint32_t& offset = type == H264NalType::Sps ? info.spsOffset : info.ppsOffset;
+			uint32_t& length = type == H264NalType::Sps ? info.spsSize : info.ppsSize;
+			if (length == 0)
+			{
+				offset = (uint32_t)pos;
+				length = (uint32_t)(end - pos);
+			}
+		}
+		else if (type >= H264NalType::Slice && type <= H264NalType::SliceIdr)
+		{
+			info.hasSlices = true;
+			info.isIdr = type == H264NalType::SliceIdr;
+			info.isReference = nalRefIdc != 0;
+			break;
+		}
+	}
+	return info.scanned;
+}
@@ -0,0 +1,44 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// What an H.264 access unit in Annex-B byte stream format carries, read from
+// its NAL unit headers. Parameter sets come before the slices and every
+// slice of a picture has the same type and nal_ref_idc, so the scan stops at
+// the first slice and never reads the slice data.
+struct H264AccessUnitInfo
+{
+	bool scanned = false;			// at least one start code was found
+	bool hasSlices = false;
+	bool isIdr = false;				// decodable without any earlier picture
+	bool isReference = true;		// nal_ref_idc != 0, later pictures may depend on it
+	bool hasParameterSets = false;	// SPS or PPS, needed by the pictures that follow
+
+	// The first SPS and PPS NAL units, from their header byte, without start code
+	uint32_t spsOffset = 0;
+	uint32_t spsSize = 0;
+	uint32_t ppsOffset = 0;
+	uint32_t ppsSize = 0;
+};
+
+// Returns false, leaving info as for an unknown picture, when the data has
+// no Annex-B start code
+bool ScanH264AccessUnit(const uint8_t* data, size_t size, H264AccessUnitInfo& info);
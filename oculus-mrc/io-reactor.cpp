@@ -0,0 +1,374 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "io-reactor.h"
+#include "frame.h"
+#include "log.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+MrcIoReactor::MrcIoReactor()
+{
+	if (!OpenWakeChannel())
+	{
+		OM_LOG(LOG_WARNING, "I/O reactor has no wake channel, changes wait for the next tick");
+	}
+	m_thread = std::thread(&MrcIoReactor::Run, this);
+}
+
+MrcIoReactor::~MrcIoReactor()
+{
+	m_stopping = true;
+	Wake();
+	m_thread.join();
+	CloseWakeChannel();
+
+	if (!m_handlers.empty())
+	{
+		OM_LOG(LOG_WARNING, "I/O reactor destroyed with %d handlers still registered", (int)m_handlers.size());
+	}
+}
+
+void MrcIoReactor::Register(MrcIoHandler* handler)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (std::find(m_handlers.begin(), m_handlers.end(), handler) != m_handlers.end())
+		{
+			return;
+		}
+		m_handlers.push_back(handler);
+	}
+	Wake();
+}
+
+void MrcIoReactor::Unregister(MrcIoHandler* handler)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto it = std::find(m_handlers.begin(), m_handlers.end(), handler);
+	if (it == m_handlers.end())
+	{
+		return;
+	}
+	m_handlers.erase(it);
+
+	// a wait already in progress may still have the handler's socket in
+	// its set, wait for that iteration to finish
+	uint64_t iteration = m_iteration;
+	Wake();
+	m_iterationDone.wait(lock, [&]() {
+		return m_iteration != iteration || m_stopping;
+	});
+}
+
+void MrcIoReactor::Wake()
+{
+	// one byte in flight is enough, the wait drains it before the next snapshot
+	if (m_wakePending.exchange(true))
+	{
+		return;
+	}
+
+	const char byte = 0;
+#ifdef _WIN32
+	if (m_wakeSocket != INVALID_SOCKET)
+	{
+		send(m_wakeSocket, &byte, 1, 0);
+	}
+#else
+	if (m_wakePipe[1] >= 0 && write(m_wakePipe[1], &byte, 1) < 0 && errno != EAGAIN)
+	{
+		OM_LOG(LOG_WARNING, "I/O reactor wake failed, error %d", errno);
+	}
+#endif
+}
+
+#ifdef _WIN32
+
+bool MrcIoReactor::OpenWakeChannel()
+{
+	m_wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (m_wakeSocket == INVALID_SOCKET)
+	{
+		return false;
+	}
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int addressLength = sizeof(address);
+	if (bind(m_wakeSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+		getsockname(m_wakeSocket, (sockaddr*)&address, &addressLength) == SOCKET_ERROR ||
+		connect(m_wakeSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+		!SetSocketBlocking(m_wakeSocket, false))
+	{
+		CloseWakeChannel();
+		return false;
+	}
+	return true;
+}
+
+void MrcIoReactor::CloseWakeChannel()
+{
+	if (m_wakeSocket != INVALID_SOCKET)
+	{
+		closesocket(m_wakeSocket);
+		m_wakeSocket = INVALID_SOCKET;
+	}
+}
+
+void MrcIoReactor::DrainWakeChannel()
+{
+	m_wakePending = false;
+	char buffer[64];
+	while (recv(m_wakeSocket, buffer, sizeof(buffer), 0) > 0)
+	{
+	}
+}
+
+int MrcIoReactor::WaitForEvents(std::vector<PollEntry>& entries, uint64_t timeoutNs)
+{
+	fd_set readSet, writeSet, errorSet;
+	FD_ZERO(&readSet);
+	FD_ZERO(&writeSet);
+	FD_ZERO(&errorSet);
+	SOCKET maxSocket = 0;
+
+	if (m_wakeSocket != INVALID_SOCKET)
+	{
+		FD_SET(m_wakeSocket, &readSet);
+		maxSocket = m_wakeSocket;
+	}
+	for (const PollEntry& entry : entries)
+	{
+		if (entry.wantRead)
+		{
+			FD_SET(entry.socket, &readSet);
+		}
+		if (entry.wantWrite)
+		{
+			FD_SET(entry.socket, &writeSet);
+		}
+		FD_SET(entry.socket, &errorSet);
+		maxSocket = std::max(maxSocket, entry.socket);
+	}
+
+	if (m_wakeSocket == INVALID_SOCKET && entries.empty())
+	{
+		// Winsock rejects a select() without sockets
+		std::this_thread::sleep_for(std::chrono::nanoseconds(timeoutNs));
+		return 0;
+	}
+
+	timeval timeout = { 0 };
+	timeout.tv_sec = (long)(timeoutNs / 1000000000);
+	timeout.tv_usec = (long)(timeoutNs % 1000000000 / 1000);
+	int ready = select((int)maxSocket + 1, &readSet, &writeSet, &errorSet, &timeout);
+	if (ready < 0)
+	{
+		OM_LOG(LOG_ERROR, "I/O reactor select error %d", GetLastSocketError());
+		std::this_thread::sleep_for(std::chrono::nanoseconds(timeoutNs));
+		return 0;
+	}
+
+	if (m_wakeSocket != INVALID_SOCKET && FD_ISSET(m_wakeSocket, &readSet))
+	{
+		DrainWakeChannel();
+	}
+
+	int count = 0;
+	for (PollEntry& entry : entries)
+	{
+		entry.readable = FD_ISSET(entry.socket, &readSet) != 0;
+		entry.writable = FD_ISSET(entry.socket, &writeSet) != 0;
+		entry.error = FD_ISSET(entry.socket, &errorSet) != 0;
+		count += entry.readable || entry.writable || entry.error;
+	}
+	return count;
+}
+
+#else
+
+bool MrcIoReactor::OpenWakeChannel()
+{
+	if (pipe(m_wakePipe) != 0)
+	{
+		m_wakePipe[0] = m_wakePipe[1] = -1;
+		return false;
+	}
+	for (int fd : m_wakePipe)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	return true;
+}
+
+void MrcIoReactor::CloseWakeChannel()
+{
+	for (int& fd : m_wakePipe)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+}
+
+void MrcIoReactor::DrainWakeChannel()
+{
+	m_wakePending = false;
+	char buffer[64];
+	while (read(m_wakePipe[0], buffer, sizeof(buffer)) > 0)
+	{
+	}
+}
+
+int MrcIoReactor::WaitForEvents(std::vector<PollEntry>& entries, uint64_t timeoutNs)
+{
+	// poll() has no FD_SETSIZE limit on descriptor numbers
+	std::vector<pollfd> pollFds;
+	pollFds.reserve(entries.size() + 1);
+	if (m_wakePipe[0] >= 0)
+	{
+		pollFds.push_back({ m_wakePipe[0], POLLIN, 0 });
+	}
+	size_t first = pollFds.size();
+	for (const PollEntry& entry : entries)
+	{
+		short events = (short)((entry.wantRead ? POLLIN : 0) | (entry.wantWrite ? POLLOUT : 0));
+		pollFds.push_back({ entry.socket, events, 0 });
+	}
+
+	// rounded up, so the tick is never woken for early
+	int timeoutMs = (int)((timeoutNs + 999999) / 1000000);
+	int ready = poll(pollFds.data(), (nfds_t)pollFds.size(), timeoutMs);
+	if (ready < 0)
+	{
+		if (errno != EINTR)
+		{
+			OM_LOG(LOG_ERROR, "I/O reactor poll error %d", errno);
+			std::this_thread::sleep_for(std::chrono::nanoseconds(timeoutNs));
+		}
+		return 0;
+	}
+
+	if (first > 0 && (pollFds[0].revents & POLLIN))
+	{
+		DrainWakeChannel();
+	}
+
+	int count = 0;
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		PollEntry& entry = entries[i];
+		short revents = pollFds[first + i].revents;
+		entry.readable = (revents & POLLIN) != 0;
+		entry.writable = (revents & POLLOUT) != 0;
+		entry.error = (revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+		count += entry.readable || entry.writable || entry.error;
+	}
+	return count;
+}
+
+#endif
+
+void MrcIoReactor::Run()
+{
+	std::vector<PollEntry> entries;
+	uint64_t nextTick = 0;
+
+	while (!m_stopping)
+	{
+		entries.clear();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			int unserviced = 0;
+			for (MrcIoHandler* handler : m_handlers)
+			{
+				bool wantRead = false;
+				bool wantWrite = false;
+				SOCKET socket = handler->GetPollSocket(wantRead, wantWrite);
+				if (socket == INVALID_SOCKET || (!wantRead && !wantWrite))
+				{
+					continue;
+				}
+#ifdef _WIN32
+				// a Winsock fd_set holds FD_SETSIZE sockets, one is the wake socket
+				if (entries.size() + 1 >= FD_SETSIZE)
+				{
+					++unserviced;
+					continue;
+				}
+#endif
+				entries.push_back({ handler, socket, wantRead, wantWrite, false, false, false });
+			}
+			if (unserviced > 0 && !m_outOfSlots)
+			{
+				OM_LOG(LOG_ERROR, "I/O reactor is out of select() slots, %d sockets are not serviced", unserviced);
+			}
+			m_outOfSlots = unserviced > 0;
+		}
+
+		uint64_t now = GetSteadyTimeNs();
+		int ready = WaitForEvents(entries, nextTick > now ? nextTick - now : 0);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (ready > 0)
+			{
+				for (const PollEntry& entry : entries)
+				{
+					// skip handlers unregistered during the wait
+					if (std::find(m_handlers.begin(), m_handlers.end(), entry.handler) == m_handlers.end())
+					{
+						continue;
+					}
+
+					if (entry.readable || entry.writable || entry.error)
+					{
+						entry.handler->OnSocketReady(entry.readable, entry.writable, entry.error);
+					}
+				}
+			}
+
+			now = GetSteadyTimeNs();
+			if (now >= nextTick)
+			{
+				nextTick = now + TickIntervalNs;
+				for (MrcIoHandler* handler : m_handlers)
+				{
+					handler->OnTick(now);
+				}
+			}
+
+			++m_iteration;
+		}
+		m_iterationDone.notify_all();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_iteration;
+	}
+	m_iterationDone.notify_all();
+}
@@ -0,0 +1,110 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "socket-compat.h"
+
+// Receives socket events from MrcIoReactor. Every call is made on the
+// reactor thread, one handler at a time, so state only touched from these
+// callbacks needs no locking.
+class MrcIoHandler
+{
+public:
+	virtual ~MrcIoHandler() = default;
+
+	// The socket to watch and for which events, or INVALID_SOCKET for none
+	virtual SOCKET GetPollSocket(bool& wantRead, bool& wantWrite) = 0;
+
+	// error is set for an exceptional condition or a hang-up; on Windows that
+	// is how a failed non-blocking connect shows up
+	virtual void OnSocketReady(bool readable, bool writable, bool error) = 0;
+
+	// Once per reactor iteration, at least every TickIntervalNs, for timeouts
+	virtual void OnTick(uint64_t now) = 0;
+};
+
+// One thread servicing the sockets of every MRC source with poll(), or
+// select() on Windows, so the thread count does not grow with the number of
+// headsets. Handlers keep their sockets non-blocking and must not block in
+// their callbacks. The wait also watches a wake channel, so a change made
+// from another thread takes effect at once rather than on the next tick.
+class MrcIoReactor
+{
+public:
+	static const uint64_t TickIntervalNs = 5000000;
+
+	MrcIoReactor();
+	~MrcIoReactor();
+
+	void Register(MrcIoHandler* handler);
+
+	// Returns once the reactor neither calls the handler nor selects on its
+	// socket any more, so the handler can close the socket and go away
+	void Unregister(MrcIoHandler* handler);
+
+	// Ends a wait in progress, for a handler whose poll interest changed on
+	// another thread, e.g. reading resumed after its frame queue drained
+	void Wake();
+
+private:
+	struct PollEntry
+	{
+		MrcIoHandler* handler;
+		SOCKET socket;
+		bool wantRead;
+		bool wantWrite;
+		bool readable;
+		bool writable;
+		bool error;
+	};
+
+	void Run();
+
+	// Waits up to timeoutNs for the entries' sockets or a wake, filling in
+	// their readiness; returns the number of entries with an event
+	int WaitForEvents(std::vector<PollEntry>& entries, uint64_t timeoutNs);
+
+	bool OpenWakeChannel();
+	void CloseWakeChannel();
+	void DrainWakeChannel();
+
+	std::mutex m_mutex;
+	std::condition_variable m_iterationDone;
+	std::vector<MrcIoHandler*> m_handlers;
+	uint64_t m_iteration = 0;
+	bool m_outOfSlots = false;	// logged once until there is room again
+
+	// Written to by Wake, watched by the wait: a UDP socket connected to
+	// itself on Windows, which can only select() on sockets, a pipe elsewhere
+#ifdef _WIN32
+	SOCKET m_wakeSocket = INVALID_SOCKET;
+#else
+	int m_wakePipe[2] = { -1, -1 };
+#endif
+	std::atomic<bool> m_wakePending { false };
+
+	std::thread m_thread;
+	std::atomic<bool> m_stopping { false };
+};
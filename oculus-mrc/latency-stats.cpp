@@ -0,0 +1,198 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "latency-stats.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+const char* GetLatencyStageName(LatencyStage stage)
+{
+	switch (stage)
+	{
+	case LatencyStage::Network:
+		return "network";
+	case LatencyStage::Reassembly:
+		return "reassembly";
+	case LatencyStage::Queue:
+		return "queue";
+	case LatencyStage::Decode:
+		return "decode";
+	case LatencyStage::Convert:
+		return "convert";
+	case LatencyStage::Upload:
+		return "upload";
+	case LatencyStage::Render:
+		return "render";
+	case LatencyStage::Total:
+		return "total";
+	default:
+		return "unknown";
+	}
+}
+
+int LatencyHistogram::GetBucketIndex(uint64_t us)
+{
+	const uint64_t subBuckets = 1 << SubBucketBits;
+	if (us < subBuckets)
+	{
+		return (int)us;
+	}
+
+	int msb = 63;
+	while (!(us & (1ULL << msb)))
+	{
+		--msb;
+	}
+	int shift = msb - SubBucketBits;
+	int index = ((shift + 1) << SubBucketBits) + (int)((us >> shift) & (subBuckets - 1));
+	return std::min(index, NumBuckets - 1);
+}
+
+uint64_t LatencyHistogram::GetBucketUpperBound(int index)
+{
+	const int subBuckets = 1 << SubBucketBits;
+	if (index < subBuckets)
+	{
+		return (uint64_t)index + 1;
+	}
+
+	int shift = (index >> SubBucketBits) - 1;
+	uint64_t base = (uint64_t)(subBuckets + (index & (subBuckets - 1))) << shift;
+	return base + (1ULL << shift);
+}
+
+void LatencyHistogram::Record(uint64_t durationNs)
+{
+	uint64_t us = durationNs / 1000;
+	m_buckets[GetBucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t max = m_maxUs.load(std::memory_order_relaxed);
+	while (us > max && !m_maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed))
+	{
+	}
+}
+
+void LatencyHistogram::Reset()
+{
+	for (std::atomic<uint32_t>& bucket : m_buckets)
+	{
+		bucket.store(0, std::memory_order_relaxed);
+	}
+	m_count.store(0, std::memory_order_relaxed);
+	m_maxUs.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::GetPercentile(double percentile) const
+{
+	uint64_t total = 0;
+	for (const std::atomic<uint32_t>& bucket : m_buckets)
+	{
+		total += bucket.load(std::memory_order_relaxed);
+	}
+	if (total == 0)
+	{
+		return 0;
+	}
+
+	uint64_t rank = std::max<uint64_t>(1, (uint64_t)(total * percentile / 100.0 + 0.5));
+	uint64_t seen = 0;
+	for (int i = 0; i < NumBuckets; ++i)
+	{
+		seen += m_buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+		{
+			// never report more than the largest value actually recorded
+			return std::min(GetBucketUpperBound(i), m_maxUs.load(std::memory_order_relaxed)) * 1000;
+		}
+	}
+	return GetMax();
+}
+
+void LatencyStats::RecordPicture(const PipelineTimestamps& timestamps)
+{
+	auto record = [this](LatencyStage stage, uint64_t from, uint64_t to) {
+		if (from && to >= from)
+		{
+			Record(stage, to - from);
+		}
+	};
+
+	record(LatencyStage::Reassembly, timestamps.receive, timestamps.parsed);
+	record(LatencyStage::Queue, timestamps.parsed, timestamps.decodeIn);
+	record(LatencyStage::Decode, timestamps.decodeIn, timestamps.decodeOut);
+	record(LatencyStage::Convert, timestamps.decodeOut, timestamps.convert);
+	record(LatencyStage::Upload, timestamps.convert, timestamps.upload);
+	record(LatencyStage::Render, timestamps.upload, timestamps.render);
+	if (timestamps.render)
+	{
+		record(LatencyStage::Total, timestamps.receive, timestamps.render);
+	}
+}
+
+void LatencyStats::RecordSenderTimestamp(uint64_t senderTimeNs, uint64_t receiveTimeNs)
+{
+	int64_t offset = (int64_t)receiveTimeNs - (int64_t)senderTimeNs;
+	int64_t minOffset = m_senderOffset.load(std::memory_order_relaxed);
+	if (!m_senderOffsetSet || offset < minOffset)
+	{
+		m_senderOffset.store(offset, std::memory_order_relaxed);
+		m_senderOffsetSet = true;
+		minOffset = offset;
+	}
+	Record(LatencyStage::Network, (uint64_t)(offset - minOffset));
+}
+
+void LatencyStats::ResetHistograms()
+{
+	for (LatencyHistogram& histogram : m_histograms)
+	{
+		histogram.Reset();
+	}
+}
+
+void LatencyStats::Reset()
+{
+	ResetHistograms();
+	m_senderOffsetSet = false;
+	m_senderOffset = 0;
+}
+
+std::string LatencyStats::GetSummary() const
+{
+	std::string summary;
+	char line[160];
+	for (int i = 0; i < (int)LatencyStage::Count; ++i)
+	{
+		const LatencyHistogram& histogram = m_histograms[i];
+		if (histogram.GetCount() == 0)
+		{
+			continue;
+		}
+		snprintf(line, sizeof(line), "%-10s n=%-6llu p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms\n",
+			GetLatencyStageName((LatencyStage)i),
+			(unsigned long long)histogram.GetCount(),
+			histogram.GetPercentile(50) / 1e6,
+			histogram.GetPercentile(90) / 1e6,
+			histogram.GetPercentile(99) / 1e6,
+			histogram.GetMax() / 1e6);
+		summary += line;
+	}
+	return summary;
+}
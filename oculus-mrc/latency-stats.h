@@ -0,0 +1,127 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Per-picture timestamps (steady_clock nanoseconds, 0 when not reached) as it
+// moves through the pipeline
+struct PipelineTimestamps
+{
+	uint64_t receive = 0;	// first byte of the frame received
+	uint64_t parsed = 0;	// frame fully reassembled and queued
+	uint64_t decodeIn = 0;	// packet handed to the decoder
+	uint64_t decodeOut = 0;	// picture returned by the decoder
+	uint64_t convert = 0;	// picture converted and queued for upload
+	uint64_t upload = 0;	// texture updated on the video tick
+	uint64_t render = 0;	// first draw of the uploaded texture
+};
+
+enum class LatencyStage : int {
+	Network,	// sender timestamp to receive, above the fastest transit seen
+	Reassembly,	// receive to parsed
+	Queue,		// parsed to decodeIn
+	Decode,		// decodeIn to decodeOut
+	Convert,	// decodeOut to convert
+	Upload,		// convert to upload
+	Render,		// upload to render
+	Total,		// receive to render
+	Count,
+};
+
+const char* GetLatencyStageName(LatencyStage stage);
+
+// Fixed-bucket histogram of durations. Buckets are log-linear in
+// microseconds, 8 per power of two, so any percentile is within 12.5% of
+// the recorded value. Record is wait-free and may race with readers.
+class LatencyHistogram
+{
+public:
+	static const int SubBucketBits = 3;
+	static const int NumBuckets = (28 << SubBucketBits);	// up to ~18 minutes
+
+	void Record(uint64_t durationNs);
+	void Reset();
+
+	uint64_t GetCount() const
+	{
+		return m_count.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetMax() const
+	{
+		return m_maxUs.load(std::memory_order_relaxed) * 1000;
+	}
+
+	// Upper bound of the bucket holding the given percentile (0-100), in nanoseconds
+	uint64_t GetPercentile(double percentile) const;
+
+private:
+	static int GetBucketIndex(uint64_t us);
+	static uint64_t GetBucketUpperBound(int index);
+
+	std::atomic<uint32_t> m_buckets[NumBuckets] = {};
+	std::atomic<uint64_t> m_count { 0 };
+	std::atomic<uint64_t> m_maxUs { 0 };
+};
+
+// One histogram per pipeline stage, plus the sender clock tracking used for
+// the network stage
+class LatencyStats
+{
+public:
+	// Records every stage the picture went through
+	void RecordPicture(const PipelineTimestamps& timestamps);
+
+	void Record(LatencyStage stage, uint64_t durationNs)
+	{
+		m_histograms[(int)stage].Record(durationNs);
+	}
+
+	// The sender clock is not synchronised with ours, so the network stage is
+	// the transit time above the smallest (receive - sender) offset observed
+	void RecordSenderTimestamp(uint64_t senderTimeNs, uint64_t receiveTimeNs);
+
+	// Starts a new measurement window, keeping the sender clock offset
+	void ResetHistograms();
+
+	// A new connection may come with a new sender clock
+	void ResetSenderClock()
+	{
+		m_senderOffsetSet = false;
+	}
+
+	void Reset();
+
+	const LatencyHistogram& GetHistogram(LatencyStage stage) const
+	{
+		return m_histograms[(int)stage];
+	}
+
+	// One line per stage with sample count, p50, p90, p99 and max in milliseconds
+	std::string GetSummary() const;
+
+private:
+	LatencyHistogram m_histograms[(int)LatencyStage::Count];
+
+	std::atomic<bool> m_senderOffsetSet { false };
+	std::atomic<int64_t> m_senderOffset { 0 };
+};
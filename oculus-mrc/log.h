@@ -17,7 +17,23 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #pragma once
 
+#ifdef OCULUS_MRC_HEADLESS
+// Tools built without libobs (oculus-mrc-bench) provide their own blog()
+#include <stdio.h>
+#include <memory>
+#include <string>
+
+enum {
+	LOG_ERROR = 100,
+	LOG_WARNING = 200,
+	LOG_INFO = 300,
+	LOG_DEBUG = 400,
+};
+
+extern "C" void blog(int log_level, const char *format, ...);
+#else
 #include <obs-module.h>
+#endif
 
 #define OM_LOG(level, format, ...) \
 	blog(level, "[OculusMrcSource]: " format, ##__VA_ARGS__)
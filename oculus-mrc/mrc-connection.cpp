@@ -0,0 +1,194 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "mrc-connection.h"
+#include "log.h"
+
+#include <string.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+
+bool InitializeSockets()
+{
+#ifdef _WIN32
+	WSADATA wsaData = { 0 };
+	int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (iResult != 0)
+	{
+		OM_LOG(LOG_ERROR, "WSAStartup failed: %d", iResult);
+		return false;
+	}
+#endif
+	return true;
+}
+
+void ShutdownSockets()
+{
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+bool ResolveHeadsetAddress(const std::string& host, uint32_t port, bool numericOnly,
+	HeadsetAddress& address, std::string& error)
+{
+	struct addrinfo *result = NULL;
+	struct addrinfo hints = { 0 };
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = numericOnly ? AI_NUMERICHOST : 0;
+
+	int iResult = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+	if (iResult != 0 || !result)
+	{
+		error = string_format("getaddrinfo failed: %d", iResult);
+		return false;
+	}
+
+	if (result->ai_addrlen > sizeof(address.addr))
+	{
+		error = "getaddrinfo returned an unknown address type";
+		freeaddrinfo(result);
+		return false;
+	}
+	memcpy(&address.addr, result->ai_addr, result->ai_addrlen);
+	address.addrlen = (socklen_t)result->ai_addrlen;
+	address.family = result->ai_family;
+	address.socktype = result->ai_socktype;
+	address.protocol = result->ai_protocol;
+	freeaddrinfo(result);
+	return true;
+}
+
+SOCKET BeginConnectToHeadset(const HeadsetAddress& address, bool& connected, std::string& error)
+{
+	connected = false;
+	SOCKET connectSocket = socket(address.family, address.socktype, address.protocol);
+	if (connectSocket == INVALID_SOCKET)
+	{
+		error = string_format("Error at socket(): %d", GetLastSocketError());
+		return INVALID_SOCKET;
+	}
+
+	if (!SetSocketBlocking(connectSocket, false))
+	{
+		OM_LOG(LOG_ERROR, "Unable to put socket to unblocked mode");
+	}
+
+	int iResult = connect(connectSocket, (const sockaddr*)&address.addr, (int)address.addrlen);
+	int connectError = iResult == 0 ? 0 : GetLastSocketError();
+
+	if (iResult == 0)
+	{
+		connected = true;
+	}
+	else if (!IsSocketWouldBlock(connectError))
+	{
+		// refused or unreachable straight away
+		error = string_format("Unable to connect: error %d", connectError);
+		closesocket(connectSocket);
+		return INVALID_SOCKET;
+	}
+	return connectSocket;
+}
+
+bool FinishConnectToHeadset(SOCKET connectSocket, std::string& error)
+{
+	// writable only means the attempt finished, SO_ERROR says how
+	int socketError = 0;
+	socklen_t length = sizeof(socketError);
+	if (getsockopt(connectSocket, SOL_SOCKET, SO_ERROR, (char*)&socketError, &length) != 0)
+	{
+		socketError = GetLastSocketError();
+	}
+
+	if (socketError != 0)
+	{
+		error = string_format("Unable to connect: error %d", socketError);
+		return false;
+	}
+	return true;
+}
+
+SOCKET ConnectToHeadset(const std::string& host, uint32_t port, int timeoutMs, std::string& error,
+	const std::atomic<bool>* cancel)
+{
+	HeadsetAddress address;
+	if (!ResolveHeadsetAddress(host, port, false, address, error))
+	{
+		return INVALID_SOCKET;
+	}
+
+	bool connected = false;
+	SOCKET connectSocket = BeginConnectToHeadset(address, connected, error);
+	if (connectSocket == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	// wait in short slices so a cancelled attempt returns promptly
+	const int sliceMs = 50;
+	bool finished = connected;
+	for (int waitedMs = 0; !finished && waitedMs < timeoutMs && !(cancel && *cancel); waitedMs += sliceMs)
+	{
+		fd_set setW, setE;
+
+		FD_ZERO(&setW);
+		FD_SET(connectSocket, &setW);
+		FD_ZERO(&setE);
+		FD_SET(connectSocket, &setE);
+
+		int waitMs = std::min(sliceMs, timeoutMs - waitedMs);
+		timeval timeOut = { 0 };
+		timeOut.tv_sec = waitMs / 1000;
+		timeOut.tv_usec = (waitMs % 1000) * 1000;
+
+		int ret = select((int)connectSocket + 1, NULL, &setW, &setE, &timeOut);
+		if (ret < 0)
+		{
+			error = string_format("select error %d", GetLastSocketError());
+			break;
+		}
+		else if (ret > 0)
+		{
+			finished = true;
+			connected = FinishConnectToHeadset(connectSocket, error);
+		}
+	}
+
+	if (!connected)
+	{
+		if (!finished && error.empty())
+		{
+			error = "Unable to connect: timed out";
+		}
+		closesocket(connectSocket);
+		return INVALID_SOCKET;
+	}
+
+	if (!SetSocketBlocking(connectSocket, true))
+	{
+		OM_LOG(LOG_ERROR, "Unable to put socket to blocked mode");
+	}
+	return connectSocket;
+}
@@ -0,0 +1,62 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#include "socket-compat.h"
+
+// WSAStartup/WSACleanup on Windows, nothing elsewhere
+bool InitializeSockets();
+void ShutdownSockets();
+
+// The headset's address, resolved ahead of connecting
+struct HeadsetAddress
+{
+	sockaddr_storage addr = {};
+	socklen_t addrlen = 0;
+	int family = 0;
+	int socktype = 0;
+	int protocol = 0;
+};
+
+// Looks up the MRC server's address. A host name may block for as long as
+// the resolver takes, so keep it off threads serving other sources; with
+// numericOnly only literal addresses are accepted, without a lookup.
+bool ResolveHeadsetAddress(const std::string& host, uint32_t port, bool numericOnly,
+	HeadsetAddress& address, std::string& error);
+
+// Starts a non-blocking connect to the MRC server on the headset. Returns
+// the non-blocking socket, with connected set if it completed straight
+// away; otherwise wait for the socket to become writable (or, on Windows,
+// to report an exception) and call FinishConnectToHeadset. Returns
+// INVALID_SOCKET with the reason in error when the attempt failed at once.
+// Never blocks.
+SOCKET BeginConnectToHeadset(const HeadsetAddress& address, bool& connected, std::string& error);
+
+// Whether the connect started by BeginConnectToHeadset succeeded
+bool FinishConnectToHeadset(SOCKET connectSocket, std::string& error);
+
+// Connects to the MRC server on the headset, giving up after timeoutMs or
+// as soon as cancel is set. Returns a blocking socket, or INVALID_SOCKET
+// with the reason in error.
+SOCKET ConnectToHeadset(const std::string& host, uint32_t port, int timeoutMs, std::string& error,
+	const std::atomic<bool>* cancel = nullptr);
@@ -0,0 +1,1757 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "mrc-pipeline.h"
+#include "mrc-connection.h"
+#include "log.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <algorithm>
+
+#pragma warning(push)
+#pragma warning(disable:4244)
+
+extern "C" {
+#include <libavutil/error.h>
+}
+
+#pragma warning(pop)
+
+#define OM_PLOG(level, format, ...) \
+	blog(level, "[OculusMrcSource '%s']: " format, m_name.c_str(), ##__VA_ARGS__)
+
+// Frame pacing stops counting repeats once nothing has been due for this
+// long, the stream has stalled or ended rather than run late
+static const uint64_t MaxRepeatedIntervalNs = 500 * 1000000ULL;
+
+// Async audio stamps follow arrivals over about 16 chunks, and start over
+// from the arrival time after a gap this long
+static const int AudioClockSmoothingShift = 4;
+static const uint64_t AudioClockRestartNs = 500 * 1000000ULL;
+
+// Pictures skipped waiting for a stream's first IDR before giving up on it,
+// two seconds at 60 fps
+static const uint32_t MaxFramesBeforeIdr = 120;
+
+// Larger parameter set cache files are not ours
+static const size_t MaxParameterSetsSize = 4096;
+
+static std::string GetAvErrorString(int errNum)
+{
+	char buf[1024];
+	std::string result = av_make_error_string(buf, 1024, errNum);
+	return result;
+}
+
+const char* GetDecoderThreadingName(DecoderThreading threading)
+{
+	switch (threading)
+	{
+	case DecoderThreading::Auto:
+		return "auto";
+	case DecoderThreading::Slice:
+		return "slice";
+	case DecoderThreading::Frame:
+		return "frame";
+	case DecoderThreading::None:
+		return "none";
+	}
+	return "unknown";
+}
+
+const char* GetBacklogPolicyName(BacklogPolicy policy)
+{
+	switch (policy)
+	{
+	case BacklogPolicy::Off:
+		return "off";
+	case BacklogPolicy::DropNonReference:
+		return "drop non-reference";
+	case BacklogPolicy::SkipToIdr:
+		return "skip to IDR";
+	}
+	return "unknown";
+}
+
+const char* GetConnectionStateName(ConnectionState state)
+{
+	switch (state)
+	{
+	case ConnectionState::Disconnected:
+		return "disconnected";
+	case ConnectionState::Connecting:
+		return "connecting";
+	case ConnectionState::Streaming:
+		return "streaming";
+	case ConnectionState::Backoff:
+		return "waiting to reconnect";
+	case ConnectionState::Reconnecting:
+		return "reconnecting";
+	}
+	return "unknown";
+}
+
+static bool HasSameDecoderSettings(const MrcPipelineSettings& a, const MrcPipelineSettings& b)
+{
+	return a.decoderThreading == b.decoderThreading &&
+		a.decoderThreadCount == b.decoderThreadCount &&
+		a.decoderLowDelay == b.decoderLowDelay &&
+		a.decoderFast == b.decoderFast &&
+		a.decoderErrorConcealment == b.decoderErrorConcealment;
+}
+
+MrcPipeline::MrcPipeline(MrcIoReactor& ioReactor, MrcDecodePool& decodePool)
+	: m_ioReactor(ioReactor)
+	, m_decodePool(decodePool)
+{
+	m_codec = (AVCodec*)avcodec_find_decoder(AV_CODEC_ID_H264);
+	if (!m_codec)
+	{
+		OM_LOG(LOG_ERROR, "Unable to find decoder");
+	}
+	else
+	{
+		OM_LOG(LOG_INFO, "Codec found. Capabilities 0x%x", m_codec->capabilities);
+	}
+}
+
+MrcPipeline::~MrcPipeline()
+{
+	Stop();
+	StopDecoder();
+	if (m_swsContext)
+	{
+		sws_freeContext(m_swsContext);
+		m_swsContext = nullptr;
+	}
+}
+
+bool MrcPipeline::StartNetwork(const std::string& host, uint32_t port, const MrcPipelineSettings& settings)
+{
+	if (m_running)
+	{
+		OM_PLOG(LOG_ERROR, "Already connected");
+		return false;
+	}
+
+	m_host = host;
+	m_port = port;
+	m_networkInput = true;
+	StopResolve();
+	if (ResolveHeadsetAddress(host, port, true, m_headsetAddress, m_resolveError))
+	{
+		m_resolved = true;
+		m_resolveDone = true;
+	}
+	else
+	{
+		StartResolve();
+	}
+	m_failedConnectAttempts = 0;
+	m_reconnects = 0;
+	SetConnectionError(std::string());
+	if (!settings.captureFile.empty())
+	{
+		m_captureWriter.Open(settings.captureFile, GetSteadyTimeNs());
+	}
+
+	if (!Start(settings))
+	{
+		m_captureWriter.Close();
+		m_networkInput = false;
+		StopResolve();
+		return false;
+	}
+	return true;
+}
+
+bool MrcPipeline::StartSocket(SOCKET socket, const MrcPipelineSettings& settings)
+{
+	if (m_running)
+	{
+		OM_PLOG(LOG_ERROR, "Already connected");
+		closesocket(socket);
+		return false;
+	}
+
+	if (!SetSocketBlocking(socket, false))
+	{
+		OM_PLOG(LOG_ERROR, "Unable to put socket to unblocked mode");
+	}
+	m_socket = socket;
+	m_networkInput = true;
+	if (!settings.captureFile.empty())
+	{
+		m_captureWriter.Open(settings.captureFile, GetSteadyTimeNs());
+	}
+
+	// nowhere to reconnect to
+	MrcPipelineSettings socketSettings = settings;
+	socketSettings.reconnect = false;
+	if (!Start(socketSettings))
+	{
+		m_captureWriter.Close();
+		CloseSocket();
+		m_networkInput = false;
+		return false;
+	}
+	return true;
+}
+
+bool MrcPipeline::StartReplay(const std::string& path, const MrcPipelineSettings& settings)
+{
+	if (m_running)
+	{
+		OM_PLOG(LOG_ERROR, "Already connected");
+		return false;
+	}
+
+	if (!m_replayReader.Open(path))
+	{
+		OM_PLOG(LOG_ERROR, "Unable to start replay of '%s'", path.c_str());
+		return false;
+	}
+
+	m_replaying = true;
+	if (!Start(settings))
+	{
+		m_replayReader.Close();
+		m_replaying = false;
+		return false;
+	}
+	return true;
+}
+
+bool MrcPipeline::Start(const MrcPipelineSettings& settings)
+{
+	m_settings = settings;
+
+	m_frameCollection.Reset();
+	m_audioBuffer.Reset();
+	m_latencyStats.Reset();
+	m_packetTimestampsBegin = m_packetTimestampsEnd = 0;
+	m_streamClock.Reset();
+	m_lastAudioStamp = 0;
+	m_lastAudioDuration = 0;
+	m_picturesDecoded = 0;
+	m_picturesConverted = 0;
+	m_imagesTaken = 0;
+	m_audioChunks = 0;
+	m_skippingToIdr = false;
+	m_backlogDroppedFrames = 0;
+	m_backlogIdrSkips = 0;
+	m_waitingForIdr = true;
+	m_framesBeforeIdr = 0;
+	m_totalFramesBeforeIdr = 0;
+	m_awaitingFirstPicture = true;
+	m_firstPictureNs = 0;
+	m_startTime = GetSteadyTimeNs();
+	m_streamStartTime = m_startTime;
+	m_inputEnded = false;
+
+	LoadParameterSets();
+	if (!StartDecoder())
+	{
+		return false;
+	}
+
+	m_running = true;
+	StartDecoding();
+	if (m_replaying)
+	{
+		StartReplayThread();
+	}
+	else
+	{
+		// the reactor must never block on a full frame queue; it stops
+		// reading instead, see GetPollSocket
+		m_frameCollection.SetOverflowPolicy(FrameCollection::OverflowPolicy::Drop);
+		m_failedAttempts = 0;
+		m_streamedBefore = false;
+		m_lastReceiveTime = GetSteadyTimeNs();
+		m_bytesAtConnect = 0;
+		m_connectionState = m_socket != INVALID_SOCKET ? ConnectionState::Streaming : ConnectionState::Connecting;
+		m_connectDeadline = 0;	// the first attempt starts on the next tick
+		m_ioReactor.Register(this);
+	}
+	return true;
+}
+
+void MrcPipeline::Stop()
+{
+	if (!m_running)
+	{
+		return;
+	}
+
+	if (m_replaying)
+	{
+		StopReplayThread();
+	}
+	else
+	{
+		m_ioReactor.Unregister(this);
+		CloseSocket();
+		// waits for a lookup still running
+		StopResolve();
+	}
+	// the decoder stays open for the next session
+	StopDecoding();
+	m_captureWriter.Close();
+
+	OM_PLOG(LOG_INFO, "Frame pool: %llu heap allocations for %llu frames",
+		m_frameCollection.GetAllocationCount(),
+		m_frameCollection.GetFrameCount());
+
+	if (m_replaying)
+	{
+		m_replayReader.Close();
+		m_replaying = false;
+		OM_PLOG(LOG_INFO, "Replay stopped");
+	}
+	else
+	{
+		m_networkInput = false;
+		m_connectionState = ConnectionState::Disconnected;
+		m_frameCollection.SetOverflowPolicy(FrameCollection::OverflowPolicy::Block);
+		OM_PLOG(LOG_INFO, "Socket disconnected");
+	}
+
+	m_running = false;
+}
+
+// The network input is a state machine driven by the shared I/O reactor:
+// connecting, streaming until the connection drops or stalls, then an
+// exponential backoff with jitter before the next attempt. The decoder and
+// the consumer's textures are left alone throughout; the first frame of
+// every new connection is flagged so the decoder flushes what the old one
+// left behind.
+SOCKET MrcPipeline::GetPollSocket(bool& wantRead, bool& wantWrite)
+{
+	switch (m_connectionState)
+	{
+	case ConnectionState::Connecting:
+	case ConnectionState::Reconnecting:
+		wantWrite = m_socket != INVALID_SOCKET;
+		break;
+	case ConnectionState::Streaming:
+		// a decoder that falls behind pushes back on the TCP stream
+		// instead of making the reactor wait for it. The flag is set before
+		// the queue is looked at, so a decode task draining it meanwhile
+		// wakes the reactor; the tick covers any wake missed regardless.
+		m_receivePaused = true;
+		wantRead = m_frameCollection.GetQueuedFrameCount() < m_frameCollection.GetQueueCapacity() / 2;
+		if (wantRead)
+		{
+			m_receivePaused = false;
+		}
+		break;
+	default:
+		break;
+	}
+	return m_socket;
+}
+
+void MrcPipeline::OnSocketReady(bool readable, bool writable, bool error)
+{
+	uint64_t now = GetSteadyTimeNs();
+	ConnectionState state = m_connectionState;
+	if ((state == ConnectionState::Connecting || state == ConnectionState::Reconnecting) && (writable || error))
+	{
+		std::string connectError;
+		if (FinishConnectToHeadset(m_socket, connectError))
+		{
+			OnConnected(now);
+		}
+		else
+		{
+			OnConnectionLost(connectError, now);
+		}
+	}
+	else if (state == ConnectionState::Streaming && (readable || error))
+	{
+		ReceiveAvailable(now);
+	}
+}
+
+void MrcPipeline::OnTick(uint64_t now)
+{
+	switch (m_connectionState)
+	{
+	case ConnectionState::Connecting:
+	case ConnectionState::Reconnecting:
+		if (m_socket == INVALID_SOCKET)
+		{
+			BeginConnect(now);
+		}
+		else if (now >= m_connectDeadline)
+		{
+			OnConnectionLost("Unable to connect: timed out", now);
+		}
+		break;
+	case ConnectionState::Streaming:
+		if (m_settings.stallTimeoutMs > 0 && now - m_lastReceiveTime >= (uint64_t)m_settings.stallTimeoutMs * 1000000 &&
+			m_frameCollection.GetQueuedFrameCount() == 0)
+		{
+			OnConnectionLost(string_format("No data received for %u ms", m_settings.stallTimeoutMs), now);
+		}
+		break;
+	case ConnectionState::Backoff:
+		if (now >= m_connectDeadline)
+		{
+			m_connectionState = ConnectionState::Reconnecting;
+			BeginConnect(now);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+// Starts looking up m_host; the previous lookup has finished
+void MrcPipeline::StartResolve()
+{
+	if (m_resolveThread.joinable())
+	{
+		m_resolveThread.join();
+	}
+	m_resolved = false;
+	m_resolveDone = false;
+	m_resolveThread = std::thread([this, host = m_host, port = m_port]() {
+		m_resolved = ResolveHeadsetAddress(host, port, false, m_headsetAddress, m_resolveError);
+		m_resolveDone = true;
+	});
+}
+
+void MrcPipeline::StopResolve()
+{
+	if (m_resolveThread.joinable())
+	{
+		m_resolveThread.join();
+	}
+}
+
+void MrcPipeline::BeginConnect(uint64_t now)
+{
+	if (!m_resolveDone)
+	{
+		// still looking up the host, try again on the next tick
+		return;
+	}
+	if (!m_resolved)
+	{
+		std::string error = m_resolveError;
+		// look it up again during the backoff, for the next attempt
+		StartResolve();
+		OnConnectionLost(error, now);
+		return;
+	}
+
+	bool connected = false;
+	std::string error;
+	m_socket = BeginConnectToHeadset(m_headsetAddress, connected, error);
+	if (m_socket == INVALID_SOCKET)
+	{
+		OnConnectionLost(error, now);
+	}
+	else if (connected)
+	{
+		OnConnected(now);
+	}
+	else
+	{
+		m_connectDeadline = now + (uint64_t)m_settings.connectTimeoutMs * 1000000;
+	}
+}
+
+void MrcPipeline::OnConnected(uint64_t now)
+{
+	OM_PLOG(LOG_INFO, "Socket connected to %s:%u%s", m_host.c_str(), m_port,
+		m_streamedBefore ? ", resuming the stream" : "");
+	m_frameCollection.BeginNewStream();
+	if (m_streamedBefore)
+	{
+		++m_reconnects;
+	}
+	m_bytesAtConnect = m_frameCollection.GetBytesReceived();
+	m_lastReceiveTime = now;
+	m_streamStartTime = now;
+	m_connectionState = ConnectionState::Streaming;
+}
+
+// Reads what the socket has, a bounded number of chunks so one busy
+// headset cannot hold up the others sharing the reactor
+void MrcPipeline::ReceiveAvailable(uint64_t now)
+{
+	const int MaxReadsPerWakeup = 4;
+	for (int i = 0; i < MaxReadsPerWakeup; ++i)
+	{
+		// recv directly into the frame collection's reassembly buffer
+		size_t bufferSize = 0;
+		uint8_t* buf = m_frameCollection.GetReceiveBuffer(bufferSize);
+		int iResult = recv(m_socket, (char*)buf, (int)std::min<size_t>(bufferSize, INT_MAX), 0);
+		if (iResult > 0)
+		{
+			//OM_PLOG(LOG_INFO, "recv: %d bytes received", iResult);
+			if (m_captureWriter.IsOpen())
+			{
+				m_captureWriter.Write(buf, (uint32_t)iResult, now);
+			}
+			m_frameCollection.CommitReceivedData(iResult);
+			m_lastReceiveTime = now;
+			if ((size_t)iResult < bufferSize)
+			{
+				// drained, no need for another recv() to find out
+				break;
+			}
+		}
+		else if (iResult == 0)
+		{
+			OM_PLOG(LOG_INFO, "recv 0 bytes, closing socket");
+			OnConnectionLost("Connection closed by the headset", now);
+			break;
+		}
+		else
+		{
+			int error = GetLastSocketError();
+			if (!IsSocketWouldBlock(error))
+			{
+				std::string reason = string_format("recv error %d", error);
+				OM_PLOG(LOG_ERROR, "%s, closing socket", reason.c_str());
+				OnConnectionLost(reason, now);
+			}
+			break;
+		}
+	}
+
+	if (m_frameCollection.HasCompletedFrame())
+	{
+		m_decodePool.Schedule(this);
+	}
+}
+
+// A connection attempt failed or a connection ended: back off and try
+// again, or end the input when reconnecting is off
+void MrcPipeline::OnConnectionLost(const std::string& reason, uint64_t now)
+{
+	bool wasStreaming = m_connectionState == ConnectionState::Streaming;
+	CloseSocket();
+
+	if (wasStreaming && m_frameCollection.GetBytesReceived() != m_bytesAtConnect)
+	{
+		// a connection that delivered data resets the backoff
+		m_streamedBefore = true;
+		m_failedAttempts = 0;
+	}
+	++m_failedAttempts;
+	m_failedConnectAttempts = m_failedAttempts;
+	SetConnectionError(reason);
+
+	if (!m_settings.reconnect)
+	{
+		OM_PLOG(LOG_ERROR, "%s", reason.c_str());
+		m_connectionState = ConnectionState::Disconnected;
+		m_inputEnded = true;
+		return;
+	}
+
+	uint32_t delayMs = GetReconnectDelayMs(m_failedAttempts);
+	// every attempt is worth a line at first, then only every power of two
+	if ((m_failedAttempts & (m_failedAttempts - 1)) == 0)
+	{
+		OM_PLOG(LOG_WARNING, "%s, retrying in %u ms (attempt %u)", reason.c_str(), delayMs, m_failedAttempts);
+	}
+	m_connectDeadline = now + (uint64_t)delayMs * 1000000;
+	m_connectionState = ConnectionState::Backoff;
+}
+
+void MrcPipeline::CloseSocket()
+{
+	if (m_socket != INVALID_SOCKET)
+	{
+		int ret = closesocket(m_socket);
+		if (ret == SOCKET_ERROR)
+		{
+			OM_PLOG(LOG_ERROR, "closesocket error %d", GetLastSocketError());
+		}
+		m_socket = INVALID_SOCKET;
+	}
+}
+
+// Doubles from reconnectMinDelayMs with every failed attempt, up to
+// reconnectMaxDelayMs, and picks a random point in the upper half so
+// several sources do not retry in lockstep
+uint32_t MrcPipeline::GetReconnectDelayMs(uint32_t failedAttempts)
+{
+	uint64_t delayMs = std::max<uint32_t>(m_settings.reconnectMinDelayMs, 1);
+	for (uint32_t i = 1; i < failedAttempts && delayMs < m_settings.reconnectMaxDelayMs; ++i)
+	{
+		delayMs *= 2;
+	}
+	delayMs = std::min<uint64_t>(delayMs, std::max(m_settings.reconnectMaxDelayMs, m_settings.reconnectMinDelayMs));
+
+	std::uniform_int_distribution<uint32_t> jitter((uint32_t)delayMs / 2, (uint32_t)delayMs);
+	return jitter(m_random);
+}
+
+void MrcPipeline::SetConnectionError(const std::string& error)
+{
+	std::lock_guard<std::mutex> lock(m_connectionErrorMutex);
+	m_connectionError = error;
+}
+
+MrcConnectionStatus MrcPipeline::GetConnectionStatus() const
+{
+	MrcConnectionStatus status;
+	status.state = m_connectionState;
+	status.failedAttempts = m_failedConnectAttempts;
+	status.reconnects = m_reconnects;
+	{
+		std::lock_guard<std::mutex> lock(m_connectionErrorMutex);
+		status.lastError = m_connectionError;
+	}
+	return status;
+}
+
+// Feeds a capture file through the same parser and decoder as a live
+// stream, either at the pace it was captured or as fast as possible
+void MrcPipeline::ReplayThread()
+{
+	uint64_t startTime = GetSteadyTimeNs();
+	uint64_t bytes = 0;
+
+	StreamCaptureReader::Chunk chunk;
+	while (!m_replayThreadStopping && m_replayReader.ReadChunk(chunk))
+	{
+		if (m_settings.replayPacing == ReplayPacing::Original)
+		{
+			uint64_t due = startTime + chunk.receiveTime;
+			uint64_t now;
+			while (!m_replayThreadStopping && (now = GetSteadyTimeNs()) < due)
+			{
+				std::this_thread::sleep_for(std::chrono::nanoseconds(std::min<uint64_t>(due - now, 5000000)));
+			}
+		}
+
+		m_frameCollection.AddData(chunk.data, chunk.length);
+		bytes += chunk.length;
+		if (m_frameCollection.HasCompletedFrame())
+		{
+			m_decodePool.Schedule(this);
+		}
+	}
+
+	// let the decoder finish what was queued before the consumer tears everything down
+	while (!m_replayThreadStopping && m_frameCollection.GetQueuedFrameCount() > 0)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	double seconds = (GetSteadyTimeNs() - startTime) / 1e9;
+	OM_PLOG(LOG_INFO, "Replay finished: %llu bytes, %llu frames in %.3f s (%.1f MB/s)",
+		bytes, m_frameCollection.GetFrameCount(), seconds, seconds > 0 ? bytes / 1e6 / seconds : 0.0);
+
+	m_inputEnded = true;
+}
+
+void MrcPipeline::StartReplayThread()
+{
+	assert(!m_replayThread.joinable());
+	m_replayThreadStopping = false;
+	m_replayThread = std::thread(&MrcPipeline::ReplayThread, this);
+}
+
+void MrcPipeline::StopReplayThread()
+{
+	if (m_replayThread.joinable())
+	{
+		m_replayThreadStopping = true;
+		m_frameCollection.CancelBlockingPush();
+		m_replayThread.join();
+	}
+}
+
+// Runs on a decode pool worker whenever frames arrive, and every
+// MrcDecodePool::TickIntervalNs so audio is released on time
+void MrcPipeline::RunDecode()
+{
+	// a bounded batch per turn so the other sources get theirs; only the
+	// last picture of the batch is converted
+	const int MaxFramesPerRun = 16;
+	int frameCount = 0;
+	while (frameCount < MaxFramesPerRun)
+	{
+		FramePtr frame = m_frameCollection.PopFrame();
+		if (!frame)
+		{
+			break;
+		}
+		ProcessFrame(std::move(frame));
+		++frameCount;
+	}
+	if (frameCount > 0)
+	{
+		ConvertPendingPicture();
+	}
+
+	ReleaseAudio();
+
+	// reading stopped on a full queue, resume it now rather than on the
+	// reactor's next tick
+	if (m_receivePaused && m_frameCollection.GetQueuedFrameCount() < m_frameCollection.GetQueueCapacity() / 2 &&
+		m_receivePaused.exchange(false))
+	{
+		m_ioReactor.Wake();
+	}
+
+	if (m_frameCollection.HasCompletedFrame())
+	{
+		m_decodePool.Schedule(this);
+	}
+}
+
+void MrcPipeline::StartDecoding()
+{
+	// the images are only touched here while the task is not registered and
+	// the consumer is stopped
+	m_decodedImages.Reset();
+	// size the CPU conversion buffers up front for the expected stream
+	size_t expectedImageSize = m_gpuConversion || m_settings.asyncOutput ? 0 :
+		(size_t)m_settings.expectedWidth * m_settings.expectedHeight * 4;
+	for (int i = 0; i < TripleBuffer<DecodedImage>::NumSlots; ++i)
+	{
+		DecodedImage& image = m_decodedImages.GetSlot(i);
+		if (image.m_data.size() < expectedImageSize)
+		{
+			image.m_data.resize(expectedImageSize);
+		}
+	}
+
+	m_skippedConversions = 0;
+	m_supersededImages = 0;
+
+	m_readyImages.PopAll([](DecodedImage*) {
+	});
+	m_freeImages.PopAll([](DecodedImage*) {
+	});
+	m_spareImage = nullptr;
+	m_scheduledImages.clear();
+	m_parkedImages.clear();
+	for (DecodedImage& image : m_pacedImages)
+	{
+		m_parkedImages.push_back(&image);
+	}
+	m_pacedImageCount = 0;
+	m_pacedImageBytes = (size_t)m_settings.expectedWidth * m_settings.expectedHeight * (m_gpuConversion ? 3 : 8) / 2;
+	m_pacerDelayLimited = false;
+	// start from the bare target delay, then put the images it needs into
+	// circulation
+	m_framePacer.SetTargetDelay(0);
+	m_framePacer.Reset();
+	if (m_settings.framePacing)
+	{
+		ResizePacedImages();
+	}
+	m_lastDueTime = 0;
+	m_repeatedPictures = 0;
+	m_pacerDroppedPictures = 0;
+	m_pacerDelayNs = 0;
+	m_pacedImageDepth = 0;
+	m_audioQueuedChunks = 0;
+	m_audioQueuedBytes = 0;
+
+	m_decodePool.Register(this);
+}
+
+void MrcPipeline::StopDecoding()
+{
+	m_decodePool.Unregister(this);
+
+	OM_PLOG(LOG_INFO, "Decoding stopped: %llu conversions skipped, %llu uploads skipped",
+		m_skippedConversions.load(), m_supersededImages.load());
+	if (m_settings.framePacing)
+	{
+		OM_PLOG(LOG_INFO, "Frame pacing: %llu pictures repeated, %llu dropped, delay %.1f ms",
+			m_repeatedPictures.load(), m_pacerDroppedPictures.load(), m_pacerDelayNs / 1e6);
+	}
+	OM_PLOG(LOG_INFO, "Audio: %llu chunks dropped over budget, %lld samples of drift compensation",
+		m_audioBuffer.GetDroppedChunkCount(), m_audioBuffer.GetCompensatedSampleCount());
+	OM_PLOG(LOG_INFO, "Parser: %llu resyncs on corrupt data, %llu bytes skipped",
+		m_frameCollection.GetResyncCount(), m_frameCollection.GetResyncBytesSkipped());
+	OM_PLOG(LOG_INFO, "Backlog (%s): %llu pictures shed, %llu skips to an IDR",
+		GetBacklogPolicyName(m_settings.backlogPolicy), m_backlogDroppedFrames.load(), m_backlogIdrSkips.load());
+	OM_PLOG(LOG_INFO, "Start: %llu pictures skipped before an IDR, first picture after %.1f ms",
+		m_totalFramesBeforeIdr.load(), m_firstPictureNs / 1e6);
+
+	// frames never decoded, and pictures that still reference decoder buffers
+	m_frameCollection.PopAllFrames([](FramePtr) {
+	});
+	for (int i = 0; i < TripleBuffer<DecodedImage>::NumSlots; ++i)
+	{
+		av_frame_unref(m_decodedImages.GetSlot(i).m_frame);
+	}
+	for (DecodedImage& image : m_pacedImages)
+	{
+		av_frame_unref(image.m_frame);
+	}
+}
+
+bool MrcPipeline::PrepareDecoder(const MrcPipelineSettings& settings)
+{
+	if (m_running)
+	{
+		return false;
+	}
+
+	m_settings = settings;
+	LoadParameterSets();
+	if (m_codecContext != nullptr && HasSameDecoderSettings(m_settings, m_decoderSettings))
+	{
+		return true;
+	}
+	if (!StartDecoder())
+	{
+		return false;
+	}
+	SendParameterSets();
+	return true;
+}
+
+bool MrcPipeline::StartDecoder()
+{
+	if (m_codecContext != nullptr)
+	{
+		// reopening costs tens of milliseconds and a new thread pool
+		if (HasSameDecoderSettings(m_settings, m_decoderSettings))
+		{
+			FlushDecoder();
+			OM_PLOG(LOG_INFO, "Reusing the open decoder");
+			return true;
+		}
+		StopDecoder();
+	}
+
+	if (!m_codec)
+	{
+		OM_PLOG(LOG_ERROR, "m_codec not initalized");
+		return false;
+	}
+
+	m_codecContext = avcodec_alloc_context3(m_codec);
+	if (!m_codecContext)
+	{
+		OM_PLOG(LOG_ERROR, "Unable to create codec context");
+		return false;
+	}
+
+	ConfigureDecoder();
+
+	AVDictionary* dict = nullptr;
+	int ret = avcodec_open2(m_codecContext, m_codec, &dict);
+	av_dict_free(&dict);
+	if (ret < 0)
+	{
+		OM_PLOG(LOG_ERROR, "Unable to open codec context");
+		avcodec_free_context(&m_codecContext);
+		return false;
+	}
+
+	OM_PLOG(LOG_INFO, "Decoder threading requested %s x%d, active %s x%d, low delay %d, fast %d, error concealment %d",
+		GetDecoderThreadingName(m_settings.decoderThreading),
+		m_settings.decoderThreadCount,
+		(m_codecContext->active_thread_type & FF_THREAD_FRAME) ? "frame" :
+			(m_codecContext->active_thread_type & FF_THREAD_SLICE) ? "slice" : "none",
+		m_codecContext->thread_count,
+		m_settings.decoderLowDelay,
+		m_settings.decoderFast,
+		m_settings.decoderErrorConcealment);
+
+	m_packet = av_packet_alloc();
+	m_picture = av_frame_alloc();
+	m_pendingPicture = av_frame_alloc();
+	m_decoderSettings = m_settings;
+
+	OM_PLOG(LOG_INFO, "m_codecContext constructed and opened");
+	return true;
+}
+
+void MrcPipeline::ConfigureDecoder()
+{
+	switch (m_settings.decoderThreading)
+	{
+	case DecoderThreading::Slice:
+		m_codecContext->thread_type = FF_THREAD_SLICE;
+		break;
+	case DecoderThreading::Frame:
+		m_codecContext->thread_type = FF_THREAD_FRAME;
+		break;
+	case DecoderThreading::None:
+		m_codecContext->thread_type = 0;
+		break;
+	default:
+		m_codecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		break;
+	}
+	m_codecContext->thread_count = m_settings.decoderThreading == DecoderThreading::None ? 1 : m_settings.decoderThreadCount;
+
+	// note that FFmpeg turns frame threading off when low delay is requested
+	if (m_settings.decoderLowDelay)
+	{
+		m_codecContext->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	}
+	if (m_settings.decoderFast)
+	{
+		m_codecContext->flags2 |= AV_CODEC_FLAG2_FAST;
+	}
+	m_codecContext->error_concealment = m_settings.decoderErrorConcealment ? (FF_EC_GUESS_MVS | FF_EC_DEBLOCK) : 0;
+}
+
+// Drops the pictures and references still held for the previous stream,
+// keeping the decoder's threads and buffers
+void MrcPipeline::FlushDecoder()
+{
+	avcodec_flush_buffers(m_codecContext);
+	av_frame_unref(m_pendingPicture);
+	m_packetTimestampsBegin = m_packetTimestampsEnd;
+}
+
+void MrcPipeline::StopDecoder()
+{
+	if (m_codecContext)
+	{
+		avcodec_free_context(&m_codecContext);
+		OM_PLOG(LOG_INFO, "m_codecContext freed");
+	}
+
+	av_packet_free(&m_packet);
+	av_frame_free(&m_picture);
+	av_frame_free(&m_pendingPicture);
+}
+
+DecodedImage* MrcPipeline::TakeNewestImage()
+{
+	if (m_settings.framePacing)
+	{
+		return TakeDueImage();
+	}
+
+	// only the newest picture is ever shown, the decoder overwrites the others
+	if (!m_decodedImages.TakeNewest())
+	{
+		return nullptr;
+	}
+	++m_imagesTaken;
+	return &m_decodedImages.GetFront();
+}
+
+void MrcPipeline::ReturnImage(DecodedImage* image)
+{
+	av_frame_unref(image->m_frame);
+	if (!m_settings.framePacing)
+	{
+		return;
+	}
+
+	if (m_pacedImageCount > m_pacedImageTarget)
+	{
+		// the delay needs fewer images than circulate, take this one out
+		std::vector<uint8_t>().swap(image->m_data);
+		m_parkedImages.push_back(image);
+		--m_pacedImageCount;
+	}
+	else
+	{
+		m_freeImages.TryPush(image);
+	}
+}
+
+// Consumer side of frame pacing. Keeps as many images circulating as the
+// pacer's delay needs at the measured frame interval: those scheduled over
+// the delay, two more for arrival jitter, one with the consumer and one
+// with the decoder. At most MaxPacedImages, and no more than fit in
+// PacedImageMemoryBudget at the stream's image size; a target delay longer
+// than that holds is shortened to what fits, rather than the pacer
+// overrunning and dropping pictures on every tick.
+void MrcPipeline::ResizePacedImages()
+{
+	uint64_t interval = std::max<uint64_t>(m_framePacer.GetFrameInterval(), 1);
+	int capacity = MaxPacedImages;
+	if (m_pacedImageBytes > 0)
+	{
+		capacity = (int)std::min<size_t>(std::max<size_t>(PacedImageMemoryBudget / m_pacedImageBytes, MinPacedImages), MaxPacedImages);
+	}
+
+	uint32_t delayMs = m_frameDelayMs;
+	uint64_t targetDelay = (uint64_t)delayMs * 1000000;
+	uint64_t maxTargetDelay = (uint64_t)(capacity - 4) * interval;
+	bool limited = targetDelay > maxTargetDelay;
+	if (limited)
+	{
+		if (!m_pacerDelayLimited)
+		{
+			OM_PLOG(LOG_WARNING, "Frame pacing: %u ms delay needs more than %d images of %zu bytes, shortened to %.1f ms",
+				delayMs, capacity, m_pacedImageBytes, maxTargetDelay / 1e6);
+		}
+		targetDelay = maxTargetDelay;
+	}
+	m_pacerDelayLimited = limited;
+	m_framePacer.SetTargetDelay(targetDelay);
+
+	uint64_t scheduled = (m_framePacer.GetDelay() + interval - 1) / interval + 2;
+	m_pacedImageTarget = (int)std::min<uint64_t>(scheduled + 2, capacity);
+	while (m_pacedImageCount < m_pacedImageTarget && !m_parkedImages.empty())
+	{
+		m_freeImages.TryPush(m_parkedImages.back());
+		m_parkedImages.pop_back();
+		++m_pacedImageCount;
+	}
+}
+
+// Consumer side of frame pacing. Images are scheduled as they come off the
+// decoder, each at its own place on the pacer's cadence, and the newest one
+// due by now is taken; any older ones due as well are skipped.
+DecodedImage* MrcPipeline::TakeDueImage()
+{
+	ResizePacedImages();
+	m_readyImages.PopAll([this](DecodedImage* image) {
+		image->m_dueTime = m_framePacer.Schedule(image->m_timestamps.receive, image->m_timestamps.convert);
+		m_scheduledImages.push_back(image);
+		m_pacedImageBytes = (size_t)image->m_width * image->m_height *
+			(image->m_format == DecodedImage::Format::YUV420 ? 3 : 8) / 2;
+	});
+
+	// the decoder needs a free image for the next picture; when it would
+	// have none the delay is longer than the images in circulation hold,
+	// so the oldest image goes instead of the newest picture
+	while ((int)m_scheduledImages.size() > m_pacedImageCount - 2)
+	{
+		m_framePacer.ReportOverrun();
+		++m_pacerDroppedPictures;
+		ReturnImage(m_scheduledImages.front());
+		m_scheduledImages.pop_front();
+	}
+	m_pacerDelayNs = m_framePacer.GetDelay();
+	m_pacedImageDepth = m_scheduledImages.size();
+
+	uint64_t now = GetSteadyTimeNs();
+	DecodedImage* image = nullptr;
+	while (!m_scheduledImages.empty() && m_scheduledImages.front()->m_dueTime <= now)
+	{
+		if (image)
+		{
+			++m_pacerDroppedPictures;
+			ReturnImage(image);
+		}
+		image = m_scheduledImages.front();
+		m_scheduledImages.pop_front();
+	}
+	m_pacedImageDepth = m_scheduledImages.size();
+
+	if (!image)
+	{
+		// the next picture should have been due a frame after the last one;
+		// count each frame interval it is late as one repeat, until the
+		// stream looks stopped rather than late
+		uint64_t interval = m_framePacer.GetFrameInterval();
+		if (m_lastDueTime != 0 && m_scheduledImages.empty() &&
+			now >= m_lastDueTime + interval && now - m_lastDueTime < MaxRepeatedIntervalNs)
+		{
+			++m_repeatedPictures;
+			m_lastDueTime += interval;
+		}
+		return nullptr;
+	}
+
+	m_lastDueTime = image->m_dueTime;
+	++m_imagesTaken;
+	return image;
+}
+
+// Decoder side: the image to convert the next picture into, or null if
+// every paced image is still queued or with the consumer
+DecodedImage* MrcPipeline::AcquireImage()
+{
+	if (!m_settings.framePacing)
+	{
+		// the back image may still hold a picture that was never taken
+		DecodedImage* image = &m_decodedImages.GetBack();
+		av_frame_unref(image->m_frame);
+		return image;
+	}
+
+	DecodedImage* image = m_spareImage;
+	m_spareImage = nullptr;
+	if (!image && !m_freeImages.TryPop(image))
+	{
+		++m_pacerDroppedPictures;
+		return nullptr;
+	}
+	return image;
+}
+
+void MrcPipeline::PublishImage(DecodedImage* image)
+{
+	++m_picturesConverted;
+	if (m_settings.framePacing)
+	{
+		// the free queue hands out no more images than this queue holds
+		m_readyImages.TryPush(image);
+	}
+	else if (m_decodedImages.Publish())
+	{
+		++m_supersededImages;
+	}
+}
+
+// Decoder side: an acquired image that will not be published
+void MrcPipeline::DiscardImage(DecodedImage* image)
+{
+	if (m_settings.framePacing)
+	{
+		m_spareImage = image;
+	}
+}
+
+MrcPipelineStats MrcPipeline::GetStats() const
+{
+	MrcPipelineStats stats;
+	stats.bytesReceived = m_frameCollection.GetBytesReceived();
+	stats.framesParsed = m_frameCollection.GetFrameCount();
+	for (uint32_t i = 0; i < Frame::NumPayloadTypes; ++i)
+	{
+		stats.framesParsedByType[i] = m_frameCollection.GetParsedFrameCount(
+			(Frame::PayloadType)((uint32_t)Frame::PayloadType::VIDEO_DIMENSION + i));
+	}
+	stats.framesDropped = m_frameCollection.GetDroppedFrameCount();
+	stats.parserResyncs = m_frameCollection.GetResyncCount();
+	stats.parserBytesSkipped = m_frameCollection.GetResyncBytesSkipped();
+	stats.backlogDroppedFrames = m_backlogDroppedFrames;
+	stats.backlogIdrSkips = m_backlogIdrSkips;
+	stats.framesBeforeIdr = m_totalFramesBeforeIdr;
+	stats.firstPictureNs = m_firstPictureNs;
+	stats.picturesDecoded = m_picturesDecoded;
+	stats.picturesConverted = m_picturesConverted;
+	stats.imagesTaken = m_imagesTaken;
+	stats.skippedConversions = m_skippedConversions;
+	stats.supersededImages = m_supersededImages;
+	stats.repeatedPictures = m_repeatedPictures;
+	stats.pacerDroppedPictures = m_pacerDroppedPictures;
+	stats.pacerDelayNs = m_pacerDelayNs;
+	stats.audioChunks = m_audioChunks;
+	stats.audioChunksDropped = m_audioBuffer.GetDroppedChunkCount();
+	stats.audioCompensatedSamples = m_audioBuffer.GetCompensatedSampleCount();
+	stats.reassemblyBytes = m_frameCollection.GetBufferedBytes();
+	stats.frameQueueDepth = m_frameCollection.GetQueuedFrameCount();
+	stats.frameQueueCapacity = m_frameCollection.GetQueueCapacity();
+	stats.pacedImageDepth = m_pacedImageDepth;
+	stats.audioQueuedChunks = m_audioQueuedChunks;
+	stats.audioQueuedBytes = m_audioQueuedBytes;
+	return stats;
+}
+
+// Takes every picture the decoder has ready. Only the newest one is kept
+// in m_pendingPicture for conversion; the ones it replaces were still
+// decoded, so reference frames stay intact, but are never converted.
+// With frame pacing every picture is converted, each gets its turn on screen.
+void MrcPipeline::ReceivePictures()
+{
+	for (;;)
+	{
+		int ret = avcodec_receive_frame(m_codecContext, m_picture);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+		{
+			break;
+		}
+		else if (ret < 0)
+		{
+			OM_PLOG(LOG_ERROR, "avcodec_receive_frame error %s", GetAvErrorString(ret).c_str());
+			break;
+		}
+
+#if _DEBUG
+		std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_frameCollection.GetFirstFrameTime();
+		OM_PLOG(LOG_DEBUG, "[%f][VIDEO_DATA] width %d height %d format %d", timePassed.count(), m_picture->width, m_picture->height, m_picture->format);
+#endif
+
+		++m_picturesDecoded;
+
+		PipelineTimestamps timestamps;
+		TakePacketTimestamps(m_picture->pts, timestamps);
+		timestamps.decodeOut = GetSteadyTimeNs();
+
+		if (m_awaitingFirstPicture)
+		{
+			m_awaitingFirstPicture = false;
+			uint64_t sinceConnect = timestamps.decodeOut - m_streamStartTime;
+			if (m_firstPictureNs == 0)
+			{
+				m_firstPictureNs = timestamps.decodeOut - m_startTime;
+				OM_PLOG(LOG_INFO, "First picture %.1f ms after connecting (%.1f ms after the connection was made)",
+					m_firstPictureNs / 1e6, sinceConnect / 1e6);
+			}
+			else
+			{
+				OM_PLOG(LOG_INFO, "First picture %.1f ms after reconnecting", sinceConnect / 1e6);
+			}
+		}
+
+		if (m_settings.asyncOutput)
+		{
+			// the consumer buffers and paces pictures itself, so every one goes out
+			if (m_sink)
+			{
+				m_sink->OnPicture(m_picture, timestamps);
+			}
+			av_frame_unref(m_picture);
+			timestamps.convert = GetSteadyTimeNs();
+			m_latencyStats.RecordPicture(timestamps);
+			++m_picturesConverted;
+			continue;
+		}
+
+		if (m_settings.framePacing)
+		{
+			ConvertPicture(m_picture, timestamps);
+			av_frame_unref(m_picture);
+			continue;
+		}
+
+		if (m_pendingPicture->data[0])
+		{
+			++m_skippedConversions;
+		}
+		av_frame_unref(m_pendingPicture);
+		av_frame_move_ref(m_pendingPicture, m_picture);
+		m_pendingTimestamps = timestamps;
+	}
+}
+
+void MrcPipeline::AddPacketTimestamps(int64_t pts, const PipelineTimestamps& timestamps)
+{
+	if (m_packetTimestampsEnd - m_packetTimestampsBegin == MaxPacketsInDecoder)
+	{
+		++m_packetTimestampsBegin;
+	}
+	PacketTimestamps& entry = m_packetTimestamps[m_packetTimestampsEnd++ % MaxPacketsInDecoder];
+	entry.pts = pts;
+	entry.timestamps = timestamps;
+}
+
+// Pictures come out in decode order, so packets older than the match
+// produced no picture and are forgotten
+bool MrcPipeline::TakePacketTimestamps(int64_t pts, PipelineTimestamps& timestamps)
+{
+	for (uint32_t i = m_packetTimestampsBegin; i != m_packetTimestampsEnd; ++i)
+	{
+		const PacketTimestamps& entry = m_packetTimestamps[i % MaxPacketsInDecoder];
+		if (entry.pts == pts)
+		{
+			timestamps = entry.timestamps;
+			m_packetTimestampsBegin = i + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+void MrcPipeline::ConvertPendingPicture()
+{
+	if (m_pendingPicture && m_pendingPicture->data[0])
+	{
+		ConvertPicture(m_pendingPicture, m_pendingTimestamps);
+		av_frame_unref(m_pendingPicture);
+	}
+}
+
+void MrcPipeline::ReleaseAudio()
+{
+	m_audioBuffer.SetTargetDelay((uint64_t)m_audioDelayMs * 1000000);
+
+	AudioChunk chunk;
+	while (m_audioBuffer.Pop(GetSteadyTimeNs(), chunk))
+	{
+		++m_audioChunks;
+		if (m_sink)
+		{
+			m_sink->OnAudio(chunk);
+		}
+	}
+	m_audioQueuedChunks = m_audioBuffer.GetQueuedChunkCount();
+	m_audioQueuedBytes = m_audioBuffer.GetQueuedBytes();
+}
+
+// Async audio follows its arrival times slowly, like the picture cadence,
+// and each chunk starts where the previous one ended; stamps only go
+// forward, by at least half a chunk
+uint64_t MrcPipeline::StampAsyncAudio(uint64_t arrivalTime, uint64_t duration)
+{
+	uint64_t stamp = arrivalTime;
+	if (m_lastAudioStamp != 0)
+	{
+		uint64_t expected = m_lastAudioStamp + m_lastAudioDuration;
+		int64_t error = (int64_t)(arrivalTime - expected);
+		if (error >= -(int64_t)AudioClockRestartNs && error <= (int64_t)AudioClockRestartNs)
+		{
+			stamp = expected + (error >> AudioClockSmoothingShift);
+		}
+		// else a gap in the stream: start over from this arrival
+		stamp = std::max(stamp, m_lastAudioStamp + m_lastAudioDuration / 2 + 1);
+	}
+	m_lastAudioStamp = stamp;
+	m_lastAudioDuration = duration;
+	return stamp;
+}
+
+void MrcPipeline::OutputAudio(const Frame& audioFrame)
+{
+	if (audioFrame.m_payloadLength < sizeof(AudioDataHeader))
+	{
+		OM_PLOG(LOG_ERROR, "[AUDIO_DATA] payload too short: %u bytes", audioFrame.m_payloadLength);
+		return;
+	}
+
+	const AudioDataHeader* audioDataHeader = (const AudioDataHeader*)(audioFrame.PayloadData());
+	if (audioDataHeader->dataLength < 0 || sizeof(AudioDataHeader) + audioDataHeader->dataLength > audioFrame.m_payloadLength)
+	{
+		OM_PLOG(LOG_ERROR, "[AUDIO_DATA] data length %d does not fit payload of %u bytes",
+			audioDataHeader->dataLength, audioFrame.m_payloadLength);
+		return;
+	}
+
+	if (audioDataHeader->channels == 1 || audioDataHeader->channels == 2)
+	{
+		AudioChunk chunk;
+		chunk.data = (const float*)(audioFrame.PayloadData() + sizeof(AudioDataHeader));
+		chunk.frames = audioDataHeader->dataLength / sizeof(float) / audioDataHeader->channels;
+		chunk.channels = audioDataHeader->channels;
+		chunk.sampleRate = m_audioSampleRate;
+		chunk.timestamp = StampAsyncAudio(audioFrame.m_receiveTime,
+			(uint64_t)chunk.frames * 1000000000ULL / std::max<uint32_t>(m_audioSampleRate, 1));
+		++m_audioChunks;
+		if (m_sink)
+		{
+			m_sink->OnAudio(chunk);
+		}
+	}
+	else
+	{
+		OM_PLOG(LOG_ERROR, "[AUDIO_DATA] unimplemented audio channels %d", audioDataHeader->channels);
+	}
+}
+
+// Converts the decoded picture to RGBA and publishes it for the consumer
+void MrcPipeline::ConvertPicture(AVFrame* picture, const PipelineTimestamps& timestamps)
+{
+	DecodedImage* image = AcquireImage();
+	if (!image)
+	{
+		return;
+	}
+
+	if (m_gpuConversion &&
+		(picture->format == AV_PIX_FMT_YUV420P || picture->format == AV_PIX_FMT_YUVJ420P))
+	{
+		// keep a reference to the decoder's planes, the shader converts them
+		if (av_frame_ref(image->m_frame, picture) == 0)
+		{
+			image->m_format = DecodedImage::Format::YUV420;
+			image->m_width = picture->width;
+			image->m_height = picture->height;
+			image->m_timestamps = timestamps;
+			image->m_timestamps.convert = GetSteadyTimeNs();
+			PublishImage(image);
+		}
+		else
+		{
+			DiscardImage(image);
+		}
+		return;
+	}
+
+	if (m_swsContext != nullptr)
+	{
+		if (m_swsContext_SrcWidth != m_codecContext->width ||
+			m_swsContext_SrcHeight != m_codecContext->height ||
+			m_swsContext_SrcPixelFormat != m_codecContext->pix_fmt ||
+			m_swsContext_DestWidth != m_codecContext->width ||
+			m_swsContext_DestHeight != m_codecContext->height)
+		{
+			OM_PLOG(LOG_DEBUG, "Need recreate m_swsContext");
+			sws_freeContext(m_swsContext);
+			m_swsContext = nullptr;
+		}
+	}
+
+	if (m_swsContext == nullptr)
+	{
+		m_swsContext = sws_getContext(
+			m_codecContext->width,
+			m_codecContext->height,
+			m_codecContext->pix_fmt,
+			m_codecContext->width,
+			m_codecContext->height,
+			AV_PIX_FMT_RGBA,
+			SWS_POINT,
+			nullptr, nullptr, nullptr
+		);
+		m_swsContext_SrcWidth = m_codecContext->width;
+		m_swsContext_SrcHeight = m_codecContext->height;
+		m_swsContext_SrcPixelFormat = m_codecContext->pix_fmt;
+		m_swsContext_DestWidth = m_codecContext->width;
+		m_swsContext_DestHeight = m_codecContext->height;
+		OM_PLOG(LOG_DEBUG, "sws_getContext(%d, %d, %d)", m_codecContext->width, m_codecContext->height, m_codecContext->pix_fmt);
+	}
+
+	assert(m_swsContext);
+	size_t imageSize = (size_t)m_codecContext->width * m_codecContext->height * 4;
+	if (image->m_data.size() < imageSize)
+	{
+		image->m_data.resize(imageSize);
+	}
+	image->m_format = DecodedImage::Format::RGBA;
+	image->m_width = m_codecContext->width;
+	image->m_height = m_codecContext->height;
+
+	uint8_t* data[1] = { image->m_data.data() };
+	int stride[1] = { (int)m_codecContext->width * 4 };
+	sws_scale(m_swsContext, picture->data,
+		picture->linesize,
+		0,
+		picture->height,
+		data,
+		stride);
+
+	image->m_timestamps = timestamps;
+	image->m_timestamps.convert = GetSteadyTimeNs();
+	PublishImage(image);
+}
+
+// Decides whether a VIDEO_DATA frame is skipped because the decoder has
+// fallen behind the stream. With a newer IDR already queued everything up
+// to it goes, since nothing before it is needed to decode what follows;
+// without one only non-reference pictures can go without damaging the
+// ones after them. Parameter sets are always decoded.
+bool MrcPipeline::ShouldShedVideo(const Frame& frame)
+{
+	BacklogPolicy policy = m_settings.backlogPolicy;
+	if (policy == BacklogPolicy::Off || (m_replaying && m_settings.replayPacing == ReplayPacing::MaxSpeed))
+	{
+		return false;
+	}
+
+	uint64_t latency = GetSteadyTimeNs() - frame.m_receiveTime;
+	bool behind = latency > (uint64_t)m_settings.backlogMaxLatencyMs * 1000000 ||
+		m_frameCollection.GetQueuedVideoCount() > m_settings.backlogMaxFrames ||
+		m_frameCollection.GetQueuedVideoBytes() > m_settings.backlogMaxBytes;
+	const H264AccessUnitInfo& info = frame.m_videoInfo;
+
+	if (m_skippingToIdr)
+	{
+		// an IDR ends the skip, unless it is stale too and a newer one is queued
+		if (info.isIdr && !(behind && m_frameCollection.GetQueuedIdrCount() > 0))
+		{
+			m_skippingToIdr = false;
+			OM_PLOG(LOG_INFO, "Decoder behind (%u pictures queued, oldest %.0f ms old), skipped %u pictures to the next IDR",
+				m_skipStartQueued, m_skipStartLatency / 1e6, m_framesSkippedToIdr);
+			return false;
+		}
+	}
+	else if (behind && policy == BacklogPolicy::SkipToIdr && !info.isIdr && m_frameCollection.GetQueuedIdrCount() > 0)
+	{
+		m_skippingToIdr = true;
+		m_skipStartLatency = latency;
+		m_skipStartQueued = m_frameCollection.GetQueuedVideoCount();
+		m_framesSkippedToIdr = 0;
+		++m_backlogIdrSkips;
+	}
+	else if (!behind || !info.hasSlices || info.isReference)
+	{
+		return false;
+	}
+
+	if (info.hasParameterSets)
+	{
+		return false;
+	}
+	++m_backlogDroppedFrames;
+	if (m_skippingToIdr)
+	{
+		++m_framesSkippedToIdr;
+	}
+	return true;
+}
+
+// Called until a stream's first IDR, returns true for the frames skipped
+// meanwhile: the decoder would only output garbage for them, or nothing at
+// all while it has no parameter sets. Streams that refresh without IDRs
+// are decoded anyway after MaxFramesBeforeIdr.
+bool MrcPipeline::WaitForFirstIdr(const Frame& frame)
+{
+	const H264AccessUnitInfo& info = frame.m_videoInfo;
+	if (info.scanned && !info.hasSlices)
+	{
+		return false;
+	}
+	if (info.scanned && !info.isIdr && m_framesBeforeIdr < MaxFramesBeforeIdr)
+	{
+		++m_framesBeforeIdr;
+		++m_totalFramesBeforeIdr;
+		return true;
+	}
+
+	m_waitingForIdr = false;
+	if (m_framesBeforeIdr > 0)
+	{
+		OM_PLOG(LOG_INFO, "Skipped %u pictures before the first IDR", m_framesBeforeIdr);
+	}
+	if (!info.hasParameterSets)
+	{
+		SendParameterSets();
+	}
+	return false;
+}
+
+// Keeps the newest SPS and PPS; every IDR normally repeats the same ones
+void MrcPipeline::UpdateParameterSets(const Frame& frame)
+{
+	static const uint8_t StartCode[4] = { 0, 0, 0, 1 };
+	const H264AccessUnitInfo& info = frame.m_videoInfo;
+	const uint8_t* data = frame.PayloadData();
+	size_t size = 2 * sizeof(StartCode) + info.spsSize + info.ppsSize;
+
+	if (size == m_parameterSetsSize &&
+		memcmp(m_parameterSets.data() + sizeof(StartCode), data + info.spsOffset, info.spsSize) == 0 &&
+		memcmp(m_parameterSets.data() + 2 * sizeof(StartCode) + info.spsSize, data + info.ppsOffset, info.ppsSize) == 0)
+	{
+		return;
+	}
+
+	m_parameterSets.assign(size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+	uint8_t* out = m_parameterSets.data();
+	memcpy(out, StartCode, sizeof(StartCode));
+	memcpy(out + sizeof(StartCode), data + info.spsOffset, info.spsSize);
+	out += sizeof(StartCode) + info.spsSize;
+	memcpy(out, StartCode, sizeof(StartCode));
+	memcpy(out + sizeof(StartCode), data + info.ppsOffset, info.ppsSize);
+	m_parameterSetsSize = size;
+
+	OM_PLOG(LOG_INFO, "New parameter sets: SPS %u bytes, PPS %u bytes", info.spsSize, info.ppsSize);
+	SaveParameterSets();
+}
+
+// Feeds the cached SPS and PPS to the decoder on their own; they produce
+// no picture, and the decoder copies them
+void MrcPipeline::SendParameterSets()
+{
+	if (m_parameterSetsSize == 0 || m_codecContext == nullptr)
+	{
+		return;
+	}
+
+	m_packet->data = m_parameterSets.data();
+	m_packet->size = (int)m_parameterSetsSize;
+	m_packet->pts = AV_NOPTS_VALUE;
+	int ret = avcodec_send_packet(m_codecContext, m_packet);
+	if (ret == AVERROR(EAGAIN))
+	{
+		ReceivePictures();
+		ret = avcodec_send_packet(m_codecContext, m_packet);
+	}
+	av_packet_unref(m_packet);
+
+	if (ret < 0)
+	{
+		OM_PLOG(LOG_WARNING, "Unable to send the cached parameter sets: %s", GetAvErrorString(ret).c_str());
+	}
+	else
+	{
+		OM_PLOG(LOG_DEBUG, "Sent the cached parameter sets to the decoder");
+	}
+}
+
+// Reads the cache file when it changes, i.e. for a different headset;
+// the parameter sets in memory belong to the previous one
+void MrcPipeline::LoadParameterSets()
+{
+	const std::string& path = m_settings.parameterSetCacheFile;
+	if (path.empty() || path == m_loadedParameterSetFile)
+	{
+		return;
+	}
+	m_loadedParameterSetFile = path;
+	m_parameterSets.clear();
+	m_parameterSetsSize = 0;
+
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		return;
+	}
+	uint8_t buffer[MaxParameterSetsSize];
+	size_t size = fread(buffer, 1, sizeof(buffer), file);
+	fclose(file);
+
+	H264AccessUnitInfo info;
+	if (size == sizeof(buffer) || !ScanH264AccessUnit(buffer, size, info) || info.spsSize == 0 || info.ppsSize == 0)
+	{
+		OM_PLOG(LOG_WARNING, "Ignoring the invalid parameter set cache %s", path.c_str());
+		return;
+	}
+
+	m_parameterSets.assign(buffer, buffer + size);
+	m_parameterSets.resize(size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+	m_parameterSetsSize = size;
+	OM_PLOG(LOG_INFO, "Loaded cached parameter sets from %s", path.c_str());
+}
+
+void MrcPipeline::SaveParameterSets()
+{
+	const std::string& path = m_settings.parameterSetCacheFile;
+	if (path.empty())
+	{
+		return;
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		OM_PLOG(LOG_WARNING, "Unable to write the parameter set cache %s", path.c_str());
+		return;
+	}
+	fwrite(m_parameterSets.data(), 1, m_parameterSetsSize, file);
+	fclose(file);
+}
+
+void MrcPipeline::ProcessFrame(FramePtr frame)
+{
+	if (frame->m_discontinuity)
+	{
+		// a new connection: the old stream's references and audio clock are void
+		OM_PLOG(LOG_DEBUG, "Stream restarted, flushing the decoder");
+		FlushDecoder();
+		m_audioBuffer.Reset();
+		m_latencyStats.ResetSenderClock();
+		m_skippingToIdr = false;
+		m_waitingForIdr = true;
+		m_framesBeforeIdr = 0;
+		m_awaitingFirstPicture = true;
+	}
+
+	if (frame->m_type == Frame::PayloadType::VIDEO_DIMENSION)
+	{
+		struct FrameDimension
+		{
+			int w;
+			int h;
+		};
+		const FrameDimension* dim = (const FrameDimension*)frame->PayloadData();
+
+		OM_PLOG(LOG_INFO, "[VIDEO_DIMENSION] width %d height %d", dim->w, dim->h);
+		if (m_sink)
+		{
+			m_sink->OnVideoDimension(dim->w, dim->h);
+		}
+	}
+	else if (frame->m_type == Frame::PayloadType::VIDEO_DATA)
+	{
+		const H264AccessUnitInfo& info = frame->m_videoInfo;
+		if (info.spsSize > 0 && info.ppsSize > 0)
+		{
+			UpdateParameterSets(*frame);
+		}
+		if (m_waitingForIdr && WaitForFirstIdr(*frame))
+		{
+			return;
+		}
+		if (ShouldShedVideo(*frame))
+		{
+			return;
+		}
+
+		// hand the padded payload over to the packet, no copy, and no new
+		// AVBufferRef either: the frame is released once it is sent
+		m_packet->data = frame->PayloadData();
+		m_packet->size = (int)frame->m_payloadLength;
+		m_packet->buf = frame->m_payload;
+		frame->m_payload = nullptr;
+		frame->m_payloadLength = 0;
+		// frames completed by one recv() share a receive time, the stamp
+		// spreads them out on the stream's cadence
+		m_packet->pts = (int64_t)m_streamClock.Stamp(frame->m_receiveTime);
+
+		PipelineTimestamps timestamps;
+		timestamps.receive = frame->m_receiveStartTime;
+		timestamps.parsed = frame->m_receiveTime;
+		timestamps.decodeIn = GetSteadyTimeNs();
+		AddPacketTimestamps(m_packet->pts, timestamps);
+
+		int ret = avcodec_send_packet(m_codecContext, m_packet);
+		if (ret == AVERROR(EAGAIN))
+		{
+			// the decoder wants its pending pictures taken first
+			ReceivePictures();
+			ret = avcodec_send_packet(m_codecContext, m_packet);
+		}
+
+		if (ret < 0)
+		{
+			OM_PLOG(LOG_ERROR, "avcodec_send_packet error %s", GetAvErrorString(ret).c_str());
+		}
+		else
+		{
+			ReceivePictures();
+		}
+
+		av_packet_unref(m_packet);
+	}
+	else if (frame->m_type == Frame::PayloadType::AUDIO_SAMPLERATE)
+	{
+		m_audioSampleRate = *(uint32_t*)(frame->PayloadData());
+		m_audioBuffer.SetSampleRate(m_audioSampleRate);
+		OM_PLOG(LOG_DEBUG, "[AUDIO_SAMPLERATE] %d", m_audioSampleRate);
+	}
+	else if (frame->m_type == Frame::PayloadType::AUDIO_DATA)
+	{
+		// audio is the only payload that carries the sender's clock
+		if (frame->m_payloadLength >= sizeof(AudioDataHeader))
+		{
+			const AudioDataHeader* header = (const AudioDataHeader*)frame->PayloadData();
+			m_latencyStats.RecordSenderTimestamp(header->timestamp, frame->m_receiveStartTime);
+		}
+
+		if (m_settings.asyncOutput)
+		{
+			// video and audio are both stamped on the smoothed arrival clock,
+			// the consumer lines them up
+			OutputAudio(*frame);
+		}
+		else
+		{
+			m_audioBuffer.Push(std::move(frame));
+		}
+#if _DEBUG
+		std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_frameCollection.GetFirstFrameTime();
+		OM_PLOG(LOG_DEBUG, "[%f][AUDIO_DATA] timestamp %llu", timePassed.count());
+#endif
+	}
+	else
+	{
+		OM_PLOG(LOG_ERROR, "Unknown payload type: %u", frame->m_type);
+	}
+}
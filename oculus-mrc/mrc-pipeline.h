@@ -0,0 +1,553 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma warning(push)
+#pragma warning(disable:4244)
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+#pragma warning(pop)
+
+#include "socket-compat.h"
+#include "mrc-connection.h"
+#include "frame.h"
+#include "audio-buffer.h"
+#include "latency-stats.h"
+#include "stream-capture.h"
+#include "io-reactor.h"
+#include "decode-pool.h"
+#include "triple-buffer.h"
+#include "spsc-queue.h"
+#include "frame-pacer.h"
+
+enum class DecoderThreading : int {
+	Auto = 0,	// frame and slice, whichever the codec supports
+	Slice = 1,
+	Frame = 2,
+	None = 3,
+};
+
+const char* GetDecoderThreadingName(DecoderThreading threading);
+
+// What the decoder skips once the queued video is older or larger than the
+// backlog limits, so the picture returns to live instead of replaying a
+// stall in slow motion
+enum class BacklogPolicy : int {
+	Off = 0,
+	DropNonReference = 1,	// pictures no other picture depends on
+	SkipToIdr = 2,			// everything up to a queued IDR, else non-reference pictures
+};
+
+const char* GetBacklogPolicyName(BacklogPolicy policy);
+
+enum class ReplayPacing : int {
+	Original = 0,	// chunks are fed at the times they were received
+	MaxSpeed = 1,	// as fast as the parser and decoder take them
+};
+
+// Network input, from StartNetwork to Stop
+enum class ConnectionState : int {
+	Disconnected = 0,
+	Connecting = 1,		// first attempt
+	Streaming = 2,
+	Backoff = 3,		// waiting before the next attempt
+	Reconnecting = 4,	// attempting again after a drop or a failure
+};
+
+const char* GetConnectionStateName(ConnectionState state);
+
+struct MrcConnectionStatus
+{
+	ConnectionState state = ConnectionState::Disconnected;
+	uint32_t failedAttempts = 0;	// since the last connection that streamed
+	uint64_t reconnects = 0;		// successful connections after the first
+	std::string lastError;
+};
+
+// Picture produced by the decoder, waiting to be taken by the
+// consumer. Either RGBA converted on the CPU, or a reference to the
+// decoder's planar YUV 4:2:0 output for conversion in a shader.
+struct DecodedImage
+{
+	enum class Format {
+		RGBA,
+		YUV420,
+	};
+
+	DecodedImage()
+	{
+		m_frame = av_frame_alloc();
+	}
+
+	DecodedImage(const DecodedImage&) = delete;
+	DecodedImage& operator=(const DecodedImage&) = delete;
+
+	~DecodedImage()
+	{
+		av_frame_free(&m_frame);
+	}
+
+	Format m_format = Format::RGBA;
+	int m_width = 0;
+	int m_height = 0;
+	std::vector<uint8_t> m_data;	// RGBA
+	AVFrame* m_frame = nullptr;		// YUV420
+	PipelineTimestamps m_timestamps;
+	uint64_t m_dueTime = 0;			// with frame pacing, when to show it
+};
+
+// Fixed for a session, from Start* to Stop
+struct MrcPipelineSettings
+{
+	DecoderThreading decoderThreading = DecoderThreading::Slice;
+	int decoderThreadCount = 0;	// let FFmpeg pick from the core count
+	bool decoderLowDelay = true;
+	bool decoderFast = false;
+	bool decoderErrorConcealment = true;
+
+	// Every decoded picture and audio chunk goes straight to the sink,
+	// stamped with its smoothed arrival time, instead of through the
+	// newest-image handoff and the audio jitter buffer
+	bool asyncOutput = false;
+
+	// Every converted picture is queued and handed to the consumer when the
+	// frame pacer says it is due, SetFrameDelay after its smoothed arrival,
+	// instead of the newest one on every take
+	bool framePacing = false;
+
+	// The decoder is behind when any limit is exceeded. A burst after a
+	// stall arrives all at once, so it shows in the queued pictures and
+	// bytes before it shows in the time since receive. Not applied to
+	// replays at maximum speed, where every frame waits in the queue by design.
+	BacklogPolicy backlogPolicy = BacklogPolicy::SkipToIdr;
+	uint32_t backlogMaxLatencyMs = 200;		// receive to decode of the oldest queued frame
+	uint32_t backlogMaxFrames = 12;			// VIDEO_DATA queued for the decoder, 200 ms at 60 fps
+	uint32_t backlogMaxBytes = 4 * 1024 * 1024;
+
+	// The SPS and PPS of the last IDR are kept in memory across sessions,
+	// and in this file when not empty, so the decoder has them before a
+	// stream's first IDR if that IDR does not repeat them
+	std::string parameterSetCacheFile;
+
+	// Size of the stream expected, used to size the RGBA buffers up front
+	uint32_t expectedWidth = 0;
+	uint32_t expectedHeight = 0;
+
+	// Written with every chunk received from the socket when not empty
+	std::string captureFile;
+
+	ReplayPacing replayPacing = ReplayPacing::Original;
+
+	// StartNetwork: keep trying with exponential backoff and jitter, between
+	// reconnectMinDelayMs and reconnectMaxDelayMs, instead of ending the
+	// input when the connection cannot be made or drops
+	bool reconnect = true;
+	uint32_t connectTimeoutMs = 1000;
+	uint32_t reconnectMinDelayMs = 100;
+	uint32_t reconnectMaxDelayMs = 1000;
+
+	// No data for this long counts as a dropped connection, 0 to wait forever
+	uint32_t stallTimeoutMs = 2000;
+};
+
+// Receives the pipeline's output. Called on a decode pool worker, one
+// call at a time per pipeline.
+class MrcPipelineSink
+{
+public:
+	virtual ~MrcPipelineSink() = default;
+
+	virtual void OnVideoDimension(int /*width*/, int /*height*/)
+	{
+	}
+
+	virtual void OnAudio(const AudioChunk& /*chunk*/)
+	{
+	}
+
+	// Only with MrcPipelineSettings::asyncOutput
+	virtual void OnPicture(const AVFrame* /*picture*/, const PipelineTimestamps& /*timestamps*/)
+	{
+	}
+};
+
+struct MrcPipelineStats
+{
+	uint64_t bytesReceived = 0;
+	uint64_t framesParsed = 0;
+	uint64_t framesParsedByType[Frame::NumPayloadTypes] = {};	// by Frame::GetPayloadTypeIndex
+	uint64_t framesDropped = 0;			// parser queue full
+	uint64_t parserResyncs = 0;			// corrupt data skipped to the next valid frame
+	uint64_t parserBytesSkipped = 0;
+	uint64_t backlogDroppedFrames = 0;	// VIDEO_DATA never decoded, the decoder was behind
+	uint64_t backlogIdrSkips = 0;		// times the decoder skipped ahead to a queued IDR
+	uint64_t framesBeforeIdr = 0;		// VIDEO_DATA skipped waiting for a stream's first IDR
+	uint64_t firstPictureNs = 0;		// Start to the first decoded picture, 0 until then
+	uint64_t picturesDecoded = 0;
+	uint64_t picturesConverted = 0;
+	uint64_t imagesTaken = 0;			// handed to the consumer
+	uint64_t skippedConversions = 0;	// superseded before conversion
+	uint64_t supersededImages = 0;		// converted but replaced before being taken
+	uint64_t repeatedPictures = 0;		// frame pacing: takes that found the next picture late
+	uint64_t pacerDroppedPictures = 0;	// frame pacing: skipped for a newer due picture, or queue full
+	uint64_t pacerDelayNs = 0;			// frame pacing: current delay after arrival
+	uint64_t audioChunks = 0;
+	uint64_t audioChunksDropped = 0;
+	int64_t audioCompensatedSamples = 0;
+
+	// Depths at the time of the call
+	size_t reassemblyBytes = 0;			// a partial frame in the parser's buffer
+	size_t frameQueueDepth = 0;			// parsed, waiting for the decoder
+	size_t frameQueueCapacity = 0;
+	size_t pacedImageDepth = 0;			// frame pacing: converted, waiting to be due
+	size_t audioQueuedChunks = 0;		// in the jitter buffer
+	size_t audioQueuedBytes = 0;
+};
+
+// The MRC stream from socket or capture file to decoded pictures and
+// scheduled audio, without any dependency on OBS. The socket is serviced by
+// an I/O reactor shared by every pipeline (a capture file by a replay
+// thread of its own), and decoding, conversion of the newest picture and
+// audio release run on a shared decode pool. The consumer takes pictures
+// with TakeNewestImage/ReturnImage from a single thread of its own.
+class MrcPipeline : private MrcIoHandler, private MrcDecodeTask
+{
+public:
+	MrcPipeline(MrcIoReactor& ioReactor, MrcDecodePool& decodePool);
+	~MrcPipeline();
+
+	// Used to prefix log messages
+	void SetName(const std::string& name)
+	{
+		m_name = name;
+	}
+
+	const std::string& GetName() const
+	{
+		return m_name;
+	}
+
+	void SetSink(MrcPipelineSink* sink)
+	{
+		m_sink = sink;
+	}
+
+	// Keep YUV 4:2:0 pictures for conversion on the GPU, may change at any time
+	void SetGpuConversion(bool gpuConversion)
+	{
+		m_gpuConversion = gpuConversion;
+	}
+
+	void SetAudioDelay(uint32_t delayMs)
+	{
+		m_audioDelayMs = delayMs;
+	}
+
+	// Target of the frame pacer, which lengthens it by itself when pictures
+	// come late; may change at any time. Images are kept for the delay up to
+	// MaxPacedImages and PacedImageMemoryBudget, a longer one is shortened
+	// to what those hold.
+	void SetFrameDelay(uint32_t delayMs)
+	{
+		m_frameDelayMs = delayMs;
+	}
+
+	// Opens the decoder, and primes it with the cached parameter sets, ahead
+	// of Start so connecting does not wait for it. Only while stopped; Start
+	// reuses the decoder if its settings are still the same.
+	bool PrepareDecoder(const MrcPipelineSettings& settings);
+
+	// Connects to the headset in the background and keeps reconnecting until
+	// Stop; progress is reported through GetConnectionStatus
+	bool StartNetwork(const std::string& host, uint32_t port, const MrcPipelineSettings& settings);
+	// Takes ownership of a connected socket, without reconnecting
+	bool StartSocket(SOCKET socket, const MrcPipelineSettings& settings);
+	bool StartReplay(const std::string& path, const MrcPipelineSettings& settings);
+	void Stop();
+
+	bool IsRunning() const
+	{
+		return m_running;
+	}
+
+	// The remote side closed or recv failed without reconnecting, or the
+	// replay finished; Stop() is still required
+	bool HasInputEnded() const
+	{
+		return m_inputEnded;
+	}
+
+	bool HasFirstFrame() const
+	{
+		return m_frameCollection.HasFirstFrame();
+	}
+
+	std::chrono::time_point<std::chrono::system_clock> GetFirstFrameTime() const
+	{
+		return m_frameCollection.GetFirstFrameTime();
+	}
+
+	// Newest converted picture published since the last call, or with
+	// frame pacing the newest one due by now, or null; never waits for the
+	// decoder. The image is the consumer's until ReturnImage, which must
+	// come before the next call and lets go of the decoder buffers it
+	// references.
+	DecodedImage* TakeNewestImage();
+	void ReturnImage(DecodedImage* image);
+
+	MrcPipelineStats GetStats() const;
+
+	ConnectionState GetConnectionState() const
+	{
+		return m_connectionState;
+	}
+
+	MrcConnectionStatus GetConnectionStatus() const;
+
+	LatencyStats& GetLatencyStats()
+	{
+		return m_latencyStats;
+	}
+
+private:
+	bool Start(const MrcPipelineSettings& settings);
+
+	// MrcIoHandler, on the reactor thread
+	SOCKET GetPollSocket(bool& wantRead, bool& wantWrite) override;
+	void OnSocketReady(bool readable, bool writable, bool error) override;
+	void OnTick(uint64_t now) override;
+
+	void StartResolve();
+	void StopResolve();
+	void BeginConnect(uint64_t now);
+	void OnConnected(uint64_t now);
+	void ReceiveAvailable(uint64_t now);
+	void OnConnectionLost(const std::string& reason, uint64_t now);
+	void CloseSocket();
+	uint32_t GetReconnectDelayMs(uint32_t failedAttempts);
+	void SetConnectionError(const std::string& error);
+
+	void ReplayThread();
+	void StartReplayThread();
+	void StopReplayThread();
+
+	// MrcDecodeTask, on a decode pool worker
+	void RunDecode() override;
+	void StartDecoding();
+	void StopDecoding();
+
+	bool StartDecoder();
+	void ConfigureDecoder();
+	void FlushDecoder();
+	void StopDecoder();
+
+	bool WaitForFirstIdr(const Frame& frame);
+	bool ShouldShedVideo(const Frame& frame);
+	void UpdateParameterSets(const Frame& frame);
+	void SendParameterSets();
+	void LoadParameterSets();
+	void SaveParameterSets();
+	void ProcessFrame(FramePtr frame);
+	void ReceivePictures();
+	void ConvertPendingPicture();
+	void ConvertPicture(AVFrame* picture, const PipelineTimestamps& timestamps);
+	DecodedImage* AcquireImage();
+	void PublishImage(DecodedImage* image);
+	void DiscardImage(DecodedImage* image);
+	DecodedImage* TakeDueImage();
+	void ResizePacedImages();
+	void ReleaseAudio();
+	void OutputAudio(const Frame& audioFrame);
+	uint64_t StampAsyncAudio(uint64_t arrivalTime, uint64_t duration);
+
+	void AddPacketTimestamps(int64_t pts, const PipelineTimestamps& timestamps);
+	bool TakePacketTimestamps(int64_t pts, PipelineTimestamps& timestamps);
+
+	std::string m_name;
+	MrcPipelineSink* m_sink = nullptr;
+	MrcPipelineSettings m_settings;
+	std::atomic<bool> m_gpuConversion { true };
+	std::atomic<uint32_t> m_audioDelayMs { 40 };
+	std::atomic<uint32_t> m_frameDelayMs { 20 };
+	bool m_running = false;
+	std::atomic<bool> m_inputEnded { false };
+
+	MrcIoReactor& m_ioReactor;
+	MrcDecodePool& m_decodePool;
+	std::atomic<bool> m_receivePaused { false };	// the reactor stopped reading on a full frame queue
+
+	// Network input, only touched by the reactor thread between Start and Stop
+	bool m_networkInput = false;
+	SOCKET m_socket = INVALID_SOCKET;
+	std::string m_host;
+	uint32_t m_port = 0;
+	uint64_t m_connectDeadline = 0;	// connect timeout, or end of the backoff
+	uint64_t m_lastReceiveTime = 0;
+	uint64_t m_bytesAtConnect = 0;
+	uint32_t m_failedAttempts = 0;
+	bool m_streamedBefore = false;
+
+	// A host name is resolved on a thread of its own, once per session or
+	// again after it failed, and the reactor connects to the cached
+	// address; a numeric address is taken as is. The result members are
+	// written by the resolve thread before it sets m_resolveDone.
+	std::thread m_resolveThread;
+	std::atomic<bool> m_resolveDone { false };
+	bool m_resolved = false;
+	HeadsetAddress m_headsetAddress;
+	std::string m_resolveError;
+
+	std::atomic<ConnectionState> m_connectionState { ConnectionState::Disconnected };
+	std::atomic<uint32_t> m_failedConnectAttempts { 0 };
+	std::atomic<uint64_t> m_reconnects { 0 };
+	mutable std::mutex m_connectionErrorMutex;
+	std::string m_connectionError;
+	std::mt19937 m_random { std::random_device()() };
+
+	bool m_replaying = false;
+	StreamCaptureReader m_replayReader;
+	StreamCaptureWriter m_captureWriter;	// written by the reactor thread
+
+	FrameCollection m_frameCollection;
+
+	std::thread m_replayThread;
+	std::atomic<bool> m_replayThreadStopping { false };
+
+	AVCodec* m_codec = nullptr;
+	// Kept open across sessions while the decoder settings stay the same
+	AVCodecContext* m_codecContext = nullptr;
+	MrcPipelineSettings m_decoderSettings;
+
+	// reused for every packet while the decoder is running
+	AVPacket* m_packet = nullptr;
+	AVFrame* m_picture = nullptr;
+	AVFrame* m_pendingPicture = nullptr;	// newest decoded picture not yet converted
+
+	// Converted images go to the consumer through a triple buffer, so the
+	// decoder always has an image to convert into and the consumer always
+	// finds the newest one, without either waiting for the other
+	TripleBuffer<DecodedImage> m_decodedImages;
+
+	// With frame pacing every image is kept instead: the decoder takes a
+	// free one, converts into it and queues it; the consumer schedules each
+	// with the pacer and returns them once shown or skipped. Only as many
+	// images circulate as the delay needs, see ResizePacedImages; the rest
+	// are parked with their memory released.
+	static const int MaxPacedImages = 16;
+	static const int MinPacedImages = 4;
+	static const size_t PacedImageMemoryBudget = 96 * 1024 * 1024;
+	DecodedImage m_pacedImages[MaxPacedImages];
+	SpscQueue<DecodedImage*> m_readyImages { MaxPacedImages };	// decoder to consumer
+	SpscQueue<DecodedImage*> m_freeImages { MaxPacedImages };	// consumer to decoder
+	DecodedImage* m_spareImage = nullptr;		// decoder side, taken but never published
+	std::deque<DecodedImage*> m_scheduledImages;	// consumer side, in due order
+	std::vector<DecodedImage*> m_parkedImages;	// consumer side, out of circulation
+	int m_pacedImageCount = 0;					// consumer side, in circulation
+	int m_pacedImageTarget = 0;					// consumer side, wanted in circulation
+	size_t m_pacedImageBytes = 0;				// consumer side, of the last image scheduled
+	bool m_pacerDelayLimited = false;			// consumer side, target shortened to fit
+	FramePacer m_framePacer;					// consumer side
+	uint64_t m_lastDueTime = 0;					// of the last image taken
+	std::atomic<uint64_t> m_repeatedPictures { 0 };
+	std::atomic<uint64_t> m_pacerDroppedPictures { 0 };
+	std::atomic<uint64_t> m_pacerDelayNs { 0 };
+	std::atomic<size_t> m_pacedImageDepth { 0 };
+
+	std::atomic<uint64_t> m_picturesDecoded { 0 };
+	std::atomic<uint64_t> m_picturesConverted { 0 };
+	std::atomic<uint64_t> m_imagesTaken { 0 };
+	std::atomic<uint64_t> m_skippedConversions { 0 };
+	std::atomic<uint64_t> m_supersededImages { 0 };
+	std::atomic<uint64_t> m_audioChunks { 0 };
+
+	// Time to first picture: from Start, and from the start of the current
+	// connection (written by the reactor thread)
+	uint64_t m_startTime = 0;
+	std::atomic<uint64_t> m_streamStartTime { 0 };
+	bool m_awaitingFirstPicture = false;
+	std::atomic<uint64_t> m_firstPictureNs { 0 };
+
+	// Decoder side: nothing decodes correctly before a stream's first IDR,
+	// so the pictures before it are skipped instead of fed to the decoder
+	bool m_waitingForIdr = true;
+	uint32_t m_framesBeforeIdr = 0;
+	std::atomic<uint64_t> m_totalFramesBeforeIdr { 0 };
+
+	// SPS and PPS in Annex-B form with start codes, plus decoder padding
+	std::vector<uint8_t> m_parameterSets;
+	size_t m_parameterSetsSize = 0;
+	std::string m_loadedParameterSetFile;
+
+	// Backlog shedding, decoder side
+	bool m_skippingToIdr = false;
+	uint64_t m_skipStartLatency = 0;	// when the skip started: age of the frame
+	uint32_t m_skipStartQueued = 0;		// and the VIDEO_DATA frames queued behind it
+	uint32_t m_framesSkippedToIdr = 0;
+	std::atomic<uint64_t> m_backlogDroppedFrames { 0 };
+	std::atomic<uint64_t> m_backlogIdrSkips { 0 };
+
+	SwsContext* m_swsContext = nullptr;
+	int m_swsContext_SrcWidth = 0;
+	int m_swsContext_SrcHeight = 0;
+	AVPixelFormat m_swsContext_SrcPixelFormat = AV_PIX_FMT_NONE;
+	int m_swsContext_DestWidth = 0;
+	int m_swsContext_DestHeight = 0;
+
+	// Decoder bookkeeping of packets sent to the decoder, matched to
+	// the pictures coming out of it by pts
+	struct PacketTimestamps
+	{
+		int64_t pts;
+		PipelineTimestamps timestamps;
+	};
+	static const uint32_t MaxPacketsInDecoder = 16;
+	PacketTimestamps m_packetTimestamps[MaxPacketsInDecoder];
+	uint32_t m_packetTimestampsBegin = 0;
+	uint32_t m_packetTimestampsEnd = 0;
+	PipelineTimestamps m_pendingTimestamps;	// for m_pendingPicture
+
+	// Decoder side. Packets are stamped on the smoothed arrival cadence, and
+	// async audio on the same arrival clock advanced by each chunk's
+	// length, so frames completed by one recv() still get distinct,
+	// evenly spaced timestamps for the consumer to pace by
+	FramePacer m_streamClock;
+	uint64_t m_lastAudioStamp = 0;
+	uint64_t m_lastAudioDuration = 0;
+
+	LatencyStats m_latencyStats;
+
+	uint32_t m_audioSampleRate = 48000;
+	AudioJitterBuffer m_audioBuffer;	// AUDIO_DATA frames waiting for their release time
+	std::atomic<size_t> m_audioQueuedChunks { 0 };	// m_audioBuffer's depth, for other threads
+	std::atomic<size_t> m_audioQueuedBytes { 0 };
+};
@@ -15,54 +15,119 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+
 #include <obs-module.h>
 #include <obs-source.h>
+#include <util/platform.h>
 
-#include <fcntl.h>  
-#include <sys/types.h>  
-#include <sys/stat.h>  
-#include <io.h>  
 #include <stdio.h>
 #include <stdint.h>
+#include <ctype.h>
 
+#include <algorithm>
 #include <string>
 #include <mutex>
-
-#include <winsock2.h>
-#include <ws2tcpip.h>
-
-#pragma comment(lib, "Ws2_32.lib")
-
-#pragma warning(push)
-#pragma warning(disable:4244)
-
-extern "C" {
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libswscale/swscale.h>
-#include <libavutil/error.h>
-}
-
-#pragma warning(pop)
+#include <atomic>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 #include "oculus-mrc.h"
-#include "frame.h"
+#include "mrc-pipeline.h"
+#include "mrc-connection.h"
+#include "stats-report.h"
 #include "log.h"
 
 #define OM_DEFAULT_WIDTH (1920*2)
 #define OM_DEFAULT_HEIGHT 1080
-#define OM_DEFAULT_AUDIO_SAMPLERATE 48000
 #define OM_DEFAULT_IP_ADDRESS "192.168.0.1"
 #define OM_DEFAULT_PORT 28734
+#define OM_DEFAULT_AUDIO_DELAY_MS 40
+// Pictures are shown on a steady clock this long after they arrive; a
+// little latency buys smooth motion over a jittery network
+#define OM_DEFAULT_FRAME_PACING true
+#define OM_DEFAULT_FRAME_DELAY_MS 20
+#define OM_LATENCY_LOG_INTERVAL_SECONDS 10
+#define OM_STATS_INTERVAL_MS 1000
+#define OM_DEFAULT_INPUT_MODE InputMode::Network
+#define OM_DEFAULT_REPLAY_PACING ReplayPacing::Original
+
+// Decoder profile tuned for latency: slice threading adds no delay, frame
+// threading holds back one picture per extra thread
+#define OM_DEFAULT_DECODER_THREADING DecoderThreading::Slice
+#define OM_DEFAULT_DECODER_THREAD_COUNT 0	// let FFmpeg pick from the core count
+#define OM_DEFAULT_DECODER_LOW_DELAY true
+#define OM_DEFAULT_DECODER_FAST false
+#define OM_DEFAULT_DECODER_ERROR_CONCEALMENT true
+
+#define OM_DEFAULT_AUTO_RECONNECT true
+#define OM_DEFAULT_BACKLOG_POLICY BacklogPolicy::SkipToIdr
+#define OM_DEFAULT_CACHE_PARAMETER_SETS true
+
+#define OM_DEFAULT_SOURCE_VIEW MrcView::Composite
+#define OM_DEFAULT_LAYER_VIEW MrcView::Foreground
+
+enum class InputMode : int {
+	Network = 0,	// TCP connection to the headset
+	Replay = 1,		// capture file written by an earlier session
+};
+
+// What part of the double-wide MRC frame is drawn. Every view but the
+// composite is half the frame's width.
+enum class MrcView : int {
+	Composite = 0,	// background on the left, foreground with alpha on the right
+	Background = 1,
+	Foreground = 2,	// colour premultiplied by the matte
+	Matte = 3,		// the foreground's alpha as greyscale
+};
 
-std::string GetAvErrorString(int errNum)
+static const char* GetViewTechnique(MrcView view, bool yuv)
 {
-	char buf[1024];
-	std::string result = av_make_error_string(buf, 1024, errNum);
-	return result;
+	switch (view)
+	{
+	case MrcView::Background:
+		return yuv ? "BackgroundYUV" : "Background";
+	case MrcView::Foreground:
+		return yuv ? "ForegroundYUV" : "Foreground";
+	case MrcView::Matte:
+		return yuv ? "MatteYUV" : "Matte";
+	default:
+		return yuv ? "FrameYUV" : "Frame";
+	}
 }
 
-class OculusMrcSource
+// Read-only text showing the source's state. OBS shows an info property's
+// description, so the text goes there rather than into the settings.
+static void AddInfoProperty(obs_properties_t* props, const char* name, const char* label, const std::string& text)
+{
+	std::string description = obs_module_text(label);
+	description += text.find('\n') == std::string::npos ? ": " : ":\n";
+	description += text;
+	obs_properties_add_text(props, name, description.c_str(), OBS_TEXT_INFO);
+}
+
+static void AddViewProperty(obs_properties_t* props)
+{
+	obs_property_t* view = obs_properties_add_list(props, "view",
+		obs_module_text("View"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(view, obs_module_text("Background and foreground side by side"), (int)MrcView::Composite);
+	obs_property_list_add_int(view, obs_module_text("Background"), (int)MrcView::Background);
+	obs_property_list_add_int(view, obs_module_text("Foreground with alpha"), (int)MrcView::Foreground);
+	obs_property_list_add_int(view, obs_module_text("Foreground matte"), (int)MrcView::Matte);
+}
+
+// Shared by every source, so a scene with many headsets still has one
+// thread for sockets and a bounded number decoding
+static MrcIoReactor* g_ioReactor = nullptr;
+static MrcDecodePool* g_decodePool = nullptr;
+
+class OculusMrcSource;
+
+// Synchronous sources, so layer sources can draw from their textures
+static std::mutex g_sourcesMutex;
+static std::vector<OculusMrcSource*> g_sources;
+
+class OculusMrcSource : public MrcPipelineSink
 {
 public:
 	// OBS source interfaces
@@ -76,11 +141,48 @@ public:
 	{
 		OculusMrcSource *context = (OculusMrcSource*)data;
 		context->Update(settings);
+		// hidden sources prepare once shown
+		if (obs_source_showing(context->m_src))
+		{
+			context->PrepareDecoderIfNeeded();
+		}
+	}
+
+	static void Show(void *data)
+	{
+		OculusMrcSource *context = (OculusMrcSource*)data;
+		context->PrepareDecoderIfNeeded();
+	}
+
+	static const char* GetAsyncName(void*)
+	{
+		return obs_module_text("OculusMrcAsyncSource");
+	}
+
+	// Earlier versions kept the status and stats text in the settings, and
+	// so in the scene collection
+	static void EraseDisplayText(obs_data_t* settings)
+	{
+		obs_data_erase(settings, "connection_status");
+		obs_data_erase(settings, "latency_stats");
+		obs_data_erase(settings, "performance_stats");
 	}
 
 	static void *Create(obs_data_t *settings, obs_source_t *source)
 	{
-		OculusMrcSource *context = new OculusMrcSource(source);
+		EraseDisplayText(settings);
+		OculusMrcSource *context = new OculusMrcSource(source, false);
+		Update(context, settings);
+		return context;
+	}
+
+	// Variant registered as OBS_SOURCE_ASYNC_VIDEO: decoded pictures go to
+	// obs_source_output_video with their timestamps, and OBS does the colour
+	// conversion, buffering and A/V alignment
+	static void *CreateAsync(obs_data_t *settings, obs_source_t *source)
+	{
+		EraseDisplayText(settings);
+		OculusMrcSource *context = new OculusMrcSource(source, true);
 		Update(context, settings);
 		return context;
 	}
@@ -96,23 +198,112 @@ public:
 
 		obs_properties_t *props = obs_properties_create();
 
+		obs_property_t* inputMode = obs_properties_add_list(props, "input_mode",
+			obs_module_text("Input"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+		obs_property_list_add_int(inputMode, obs_module_text("Quest headset"), (int)InputMode::Network);
+		obs_property_list_add_int(inputMode, obs_module_text("Replay capture file"), (int)InputMode::Replay);
+
 		obs_properties_add_text(props, "ipaddr", obs_module_text("Quest IP Address"), OBS_TEXT_DEFAULT);
 
 		obs_properties_add_int(props, "port", obs_module_text("Port"), 1025, 65535, 1);
 
+		if (!context->m_asyncVideo)
+		{
+			AddViewProperty(props);
+		}
+
+		obs_properties_add_bool(props, "auto_reconnect", obs_module_text("Reconnect automatically"));
+
+		std::string connectionStatus;
+		std::string latencyStats;
+		std::string performanceStats;
+		{
+			std::lock_guard<std::mutex> lock(context->m_displayMutex);
+			connectionStatus = context->m_connectionStatus;
+			latencyStats = context->m_latencyStats;
+			performanceStats = context->m_performanceStats;
+		}
+
+		AddInfoProperty(props, "connection_status", "Connection", connectionStatus);
+
+		// capture and replay settings take effect on the next connect
+		obs_properties_add_bool(props, "capture_enabled", obs_module_text("Capture the MRC stream to a file"));
+		obs_properties_add_path(props, "capture_file", obs_module_text("Capture file"),
+			OBS_PATH_FILE_SAVE, "MRC capture (*.mrccap)", nullptr);
+
+		obs_properties_add_path(props, "replay_file", obs_module_text("Replay file"),
+			OBS_PATH_FILE, "MRC capture (*.mrccap)", nullptr);
+		obs_property_t* replayPacing = obs_properties_add_list(props, "replay_pacing",
+			obs_module_text("Replay pacing"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+		obs_property_list_add_int(replayPacing, obs_module_text("Original timing"), (int)ReplayPacing::Original);
+		obs_property_list_add_int(replayPacing, obs_module_text("Maximum speed"), (int)ReplayPacing::MaxSpeed);
+
+		if (!context->m_asyncVideo)
+		{
+			obs_properties_add_bool(props, "gpu_conversion", obs_module_text("Convert YUV to RGB on the GPU"));
+		}
+
+		AddInfoProperty(props, "latency_stats", "Latency", latencyStats);
+		AddInfoProperty(props, "performance_stats", "Performance", performanceStats);
+		// the stats above are sampled every second but only shown when the
+		// properties are rebuilt, which this button does
+		obs_properties_add_button(props, "refresh_stats", obs_module_text("Refresh stats"),
+			[](obs_properties_t* /*props*/, obs_property_t* /*property*/, void* /*data*/) {
+			return true;
+		});
+
+		// takes effect on the next connect, like capture
+		obs_properties_add_bool(props, "stats_file_enabled", obs_module_text("Write performance stats to a file (JSON lines)"));
+		obs_properties_add_path(props, "stats_file", obs_module_text("Stats file"),
+			OBS_PATH_FILE_SAVE, "JSON lines (*.jsonl)", nullptr);
+
+		obs_properties_add_int_slider(props, "audio_delay_ms", obs_module_text("Audio delay (ms)"), 0, 500, 5);
+
+		if (!context->m_asyncVideo)
+		{
+			obs_properties_add_bool(props, "frame_pacing", obs_module_text("Smooth frame pacing (from the next connect)"));
+			obs_property_t* frameDelay = obs_properties_add_int_slider(props, "frame_delay_ms",
+				obs_module_text("Frame pacing delay (ms)"), 0, 100, 5);
+			obs_property_set_long_description(frameDelay, obs_module_text(
+				"Pictures are queued for this long to hide network and decoder jitter. The queue grows with the "
+				"delay up to 16 pictures or 96 MB per source, and a delay longer than that holds at the stream's "
+				"size and frame rate is shortened to fit. A 3840x1080 stream at 60 fps holds 200 ms with GPU "
+				"conversion, 33 ms with CPU conversion."));
+		}
+
+		// decoder settings take effect on the next connect
+		obs_property_t* threading = obs_properties_add_list(props, "decoder_threading",
+			obs_module_text("Decoder threading"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+		obs_property_list_add_int(threading, obs_module_text("Slice (lowest latency)"), (int)DecoderThreading::Slice);
+		obs_property_list_add_int(threading, obs_module_text("Frame (highest throughput, adds latency)"), (int)DecoderThreading::Frame);
+		obs_property_list_add_int(threading, obs_module_text("Auto"), (int)DecoderThreading::Auto);
+		obs_property_list_add_int(threading, obs_module_text("Single thread"), (int)DecoderThreading::None);
+
+		obs_properties_add_int(props, "decoder_thread_count", obs_module_text("Decoder threads (0 = auto)"), 0, 64, 1);
+		obs_properties_add_bool(props, "decoder_low_delay", obs_module_text("Low-delay decoding"));
+		obs_properties_add_bool(props, "decoder_fast", obs_module_text("Fast decoding (non spec-compliant speedups)"));
+		obs_properties_add_bool(props, "decoder_error_concealment", obs_module_text("Conceal decoding errors"));
+		obs_properties_add_bool(props, "cache_parameter_sets", obs_module_text("Remember the stream's parameter sets for a faster start"));
+
+		obs_property_t* backlog = obs_properties_add_list(props, "backlog_policy",
+			obs_module_text("When decoding falls behind"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+		obs_property_list_add_int(backlog, obs_module_text("Decode every picture"), (int)BacklogPolicy::Off);
+		obs_property_list_add_int(backlog, obs_module_text("Skip non-reference pictures"), (int)BacklogPolicy::DropNonReference);
+		obs_property_list_add_int(backlog, obs_module_text("Skip ahead to the next keyframe"), (int)BacklogPolicy::SkipToIdr);
+
 		obs_property_t* connectButton = obs_properties_add_button(props, "connect",
 			obs_module_text("Connect to MRC-enabled game running on Quest"), [](obs_properties_t *props,
 				obs_property_t *property, void *data) {
 			return ((OculusMrcSource *)data)->ConnectClicked(props, property);
 		});
-		obs_property_set_enabled(connectButton, context->m_connectSocket == INVALID_SOCKET);
+		obs_property_set_enabled(connectButton, !context->IsActive());
 
 		obs_property_t* disconnectButton = obs_properties_add_button(props, "disconnect",
 			obs_module_text("Disconnect from Quest game"), [](obs_properties_t *props,
 				obs_property_t *property, void *data) {
 			return ((OculusMrcSource *)data)->DisconnectClicked(props, property);
 		});
-		obs_property_set_enabled(disconnectButton, context->m_connectSocket != INVALID_SOCKET);
+		obs_property_set_enabled(disconnectButton, context->IsActive());
 
 		return props;
 	}
@@ -145,8 +336,25 @@ public:
 	{
 		obs_data_set_default_int(settings, "width", OM_DEFAULT_WIDTH);
 		obs_data_set_default_int(settings, "height", OM_DEFAULT_HEIGHT);
+		obs_data_set_default_int(settings, "input_mode", (int)OM_DEFAULT_INPUT_MODE);
 		obs_data_set_default_string(settings, "ipaddr", OM_DEFAULT_IP_ADDRESS);
 		obs_data_set_default_int(settings, "port", OM_DEFAULT_PORT);
+		obs_data_set_default_bool(settings, "auto_reconnect", OM_DEFAULT_AUTO_RECONNECT);
+		obs_data_set_default_int(settings, "view", (int)OM_DEFAULT_SOURCE_VIEW);
+		obs_data_set_default_bool(settings, "capture_enabled", false);
+		obs_data_set_default_bool(settings, "stats_file_enabled", false);
+		obs_data_set_default_int(settings, "replay_pacing", (int)OM_DEFAULT_REPLAY_PACING);
+		obs_data_set_default_bool(settings, "gpu_conversion", true);
+		obs_data_set_default_int(settings, "audio_delay_ms", OM_DEFAULT_AUDIO_DELAY_MS);
+		obs_data_set_default_bool(settings, "frame_pacing", OM_DEFAULT_FRAME_PACING);
+		obs_data_set_default_int(settings, "frame_delay_ms", OM_DEFAULT_FRAME_DELAY_MS);
+		obs_data_set_default_int(settings, "decoder_threading", (int)OM_DEFAULT_DECODER_THREADING);
+		obs_data_set_default_int(settings, "decoder_thread_count", OM_DEFAULT_DECODER_THREAD_COUNT);
+		obs_data_set_default_bool(settings, "decoder_low_delay", OM_DEFAULT_DECODER_LOW_DELAY);
+		obs_data_set_default_bool(settings, "decoder_fast", OM_DEFAULT_DECODER_FAST);
+		obs_data_set_default_bool(settings, "decoder_error_concealment", OM_DEFAULT_DECODER_ERROR_CONCEALMENT);
+		obs_data_set_default_int(settings, "backlog_policy", (int)OM_DEFAULT_BACKLOG_POLICY);
+		obs_data_set_default_bool(settings, "cache_parameter_sets", OM_DEFAULT_CACHE_PARAMETER_SETS);
 	}
 
 	void VideoTick(float /*seconds*/)
@@ -155,24 +363,31 @@ public:
 		VideoTickImpl();
 	}
 
+	// Never takes m_updateMutex: render only reads the texture set the tick
+	// last published, so it is not held up by an upload or a reconnect
 	void VideoRender(gs_effect_t* /*effect*/)
 	{
-		//std::lock_guard<std::mutex> lock(m_updateMutex);
 		VideoRenderImpl();
 	}
 
 	void RefreshButtons(obs_properties_t* props)
 	{
-		obs_property_set_enabled(obs_properties_get(props, "connect"), m_connectSocket == INVALID_SOCKET);
-		obs_property_set_enabled(obs_properties_get(props, "disconnect"), m_connectSocket != INVALID_SOCKET);
+		obs_property_set_enabled(obs_properties_get(props, "connect"), !IsActive());
+		obs_property_set_enabled(obs_properties_get(props, "disconnect"), IsActive());
 	}
 
 	bool ConnectClicked(obs_properties_t* props, obs_property_t* /*property*/) {
 		OM_BLOG(LOG_INFO, "ConnectClicked");
 
-		std::lock_guard<std::mutex> lock(m_updateMutex);
-		Connect();
-		RefreshButtons(props);
+		// a decoder being prepared is waited for here, before m_updateMutex
+		// is taken, so the tick never waits for it to open
+		SuspendPrepare();
+		{
+			std::lock_guard<std::mutex> lock(m_updateMutex);
+			Connect();
+			RefreshButtons(props);
+		}
+		ResumePrepare();
 
 		return true;
 	}
@@ -187,397 +402,710 @@ public:
 		return true;
 	}
 
-private:
-	OculusMrcSource(obs_source_t* source) :
-		m_src(source)
+	// The synchronous OculusMrcSource behind an OBS source, if it is one.
+	// The caller holds a reference to source, which keeps the result alive.
+	static OculusMrcSource* Find(obs_source_t* source)
 	{
-		m_codec = avcodec_find_decoder(AV_CODEC_ID_H264);
-		if (!m_codec)
+		std::lock_guard<std::mutex> lock(g_sourcesMutex);
+		for (OculusMrcSource* context : g_sources)
 		{
-			OM_BLOG(LOG_ERROR, "Unable to find decoder");
-		}
-		else
-		{
-			OM_BLOG(LOG_INFO, "Codec found. Capabilities 0x%x", m_codec->capabilities);
+			if (context->m_src == source)
+			{
+				return context;
+			}
 		}
+		return nullptr;
+	}
 
-		obs_enter_graphics();
-		char *filename = obs_module_file("oculusmrc.effect");
-		m_mrc_effect = gs_effect_create_from_file(filename,
-			NULL);
-		bfree(filename);
-		assert(m_mrc_effect);
-		obs_leave_graphics();
+	void GetViewSize(MrcView view, uint32_t& width, uint32_t& height) const
+	{
+		width = view == MrcView::Composite ? m_width.load() : m_width / 2;
+		height = m_height;
 	}
 
-	~OculusMrcSource()
+	// Draws one view of the textures uploaded on the last tick, scaled to
+	// width x height; nothing until the first picture has arrived. Called
+	// from video_render, of this source or of a layer source.
+	bool DrawView(MrcView view, uint32_t width, uint32_t height)
 	{
-		StopDecoder();
-		obs_enter_graphics();
-		if (m_mrc_effect)
+		// whichever view draws a new picture first times its render
+		if (m_textures.TakeNewest())
 		{
-			gs_effect_destroy(m_mrc_effect);
-			m_mrc_effect = nullptr;
+			PipelineTimestamps timestamps = m_textures.GetFront().m_timestamps;
+			timestamps.render = GetSteadyTimeNs();
+			m_pipeline.GetLatencyStats().RecordPicture(timestamps);
 		}
-		if (m_temp_texture)
+
+		const TextureSet& textures = m_textures.GetFront();
+		if (!textures.m_planeTextures[0] && !textures.m_rgbaTexture)
 		{
-			gs_texture_destroy(m_temp_texture);
-			m_temp_texture = nullptr;
+			return false;
 		}
-		if (m_swsContext)
+
+		// the foreground comes out premultiplied
+		bool premultiplied = view == MrcView::Foreground;
+		if (premultiplied)
 		{
-			sws_freeContext(m_swsContext);
-			m_swsContext = nullptr;
+			gs_blend_state_push();
+			gs_blend_function(GS_BLEND_ONE, GS_BLEND_INVSRCALPHA);
 		}
-		obs_leave_graphics();
+
+		if (textures.m_planeTextures[0])
+		{
+			gs_effect_set_texture(gs_effect_get_param_by_name(m_mrc_effect, "plane_y"), textures.m_planeTextures[0]);
+			gs_effect_set_texture(gs_effect_get_param_by_name(m_mrc_effect, "plane_u"), textures.m_planeTextures[1]);
+			gs_effect_set_texture(gs_effect_get_param_by_name(m_mrc_effect, "plane_v"), textures.m_planeTextures[2]);
+			gs_effect_set_matrix4(gs_effect_get_param_by_name(m_mrc_effect, "color_matrix"), (const matrix4*)textures.m_colorMatrix);
+			gs_effect_set_val(gs_effect_get_param_by_name(m_mrc_effect, "color_range_min"), textures.m_colorRangeMin, sizeof(textures.m_colorRangeMin));
+			gs_effect_set_val(gs_effect_get_param_by_name(m_mrc_effect, "color_range_max"), textures.m_colorRangeMax, sizeof(textures.m_colorRangeMax));
+
+			gs_technique_t *tech = gs_effect_get_technique(m_mrc_effect, GetViewTechnique(view, true));
+
+			gs_technique_begin(tech);
+			gs_technique_begin_pass(tech, 0);
+
+			gs_draw_sprite(textures.m_planeTextures[0], 0, width, height);
+
+			gs_technique_end_pass(tech);
+			gs_technique_end(tech);
+		}
+		else
+		{
+			gs_technique_t *tech = gs_effect_get_technique(m_mrc_effect, GetViewTechnique(view, false));
+
+			gs_technique_begin(tech);
+			gs_technique_begin_pass(tech, 0);
+
+			obs_source_draw(textures.m_rgbaTexture, 0, 0, width, height, true);
+
+			gs_technique_end_pass(tech);
+			gs_technique_end(tech);
+		}
+
+		if (premultiplied)
+		{
+			gs_blend_state_pop();
+		}
+		return true;
 	}
 
-	void StartDecoder()
+private:
+	OculusMrcSource(obs_source_t* source, bool asyncVideo) :
+		m_src(source),
+		m_asyncVideo(asyncVideo),
+		m_pipeline(*g_ioReactor, *g_decodePool)
 	{
-		if (m_codecContext != nullptr)
+		m_pipeline.SetSink(this);
+
+		if (!m_asyncVideo)
 		{
-			OM_BLOG(LOG_ERROR, "Decoder already started");
-			return;
+			obs_enter_graphics();
+			char *filename = obs_module_file("oculusmrc.effect");
+			m_mrc_effect = gs_effect_create_from_file(filename,
+				NULL);
+			bfree(filename);
+			assert(m_mrc_effect);
+			obs_leave_graphics();
+
+			std::lock_guard<std::mutex> lock(g_sourcesMutex);
+			g_sources.push_back(this);
 		}
+	}
 
-		if (!m_codec)
+	~OculusMrcSource()
+	{
 		{
-			OM_BLOG(LOG_ERROR, "m_codec not initalized");
-			return;
+			std::lock_guard<std::mutex> lock(g_sourcesMutex);
+			g_sources.erase(std::remove(g_sources.begin(), g_sources.end(), this), g_sources.end());
 		}
 
-		m_codecContext = avcodec_alloc_context3(m_codec);
-		if (!m_codecContext)
+		// no more callbacks come that could start it again
+		if (m_prepareThread.joinable())
 		{
-			OM_BLOG(LOG_ERROR, "Unable to create codec context");
-			return;
+			m_prepareThread.join();
 		}
 
-		AVDictionary* dict = nullptr;
-		int ret = avcodec_open2(m_codecContext, m_codec, &dict);
-		av_dict_free(&dict);
-		if (ret < 0)
+		if (IsActive())
 		{
-			OM_BLOG(LOG_ERROR, "Unable to open codec context");
-			avcodec_free_context(&m_codecContext);
-			return;
+			Disconnect();
 		}
-
-		OM_BLOG(LOG_INFO, "m_codecContext constructed and opened");
+		obs_enter_graphics();
+		if (m_mrc_effect)
+		{
+			gs_effect_destroy(m_mrc_effect);
+			m_mrc_effect = nullptr;
+		}
+		DestroyTextures();
+		obs_leave_graphics();
 	}
 
-	void StopDecoder()
+	// One uploaded picture, either as an RGBA texture or as Y, U and V planes
+	// converted by the FrameYUV technique
+	struct TextureSet
+	{
+		gs_texture_t* m_rgbaTexture = nullptr;
+		gs_texture_t* m_planeTextures[3] = {};
+		float m_colorMatrix[16] = {};
+		float m_colorRangeMin[3] = {};
+		float m_colorRangeMax[3] = {};
+		PipelineTimestamps m_timestamps;
+	};
+
+	// must be called inside obs_enter_graphics
+	static void DestroyTextureSet(TextureSet& textures)
 	{
-		if (m_codecContext)
+		if (textures.m_rgbaTexture)
 		{
-			avcodec_close(m_codecContext);
-			avcodec_free_context(&m_codecContext);
-			OM_BLOG(LOG_INFO, "m_codecContext freed");
+			gs_texture_destroy(textures.m_rgbaTexture);
+			textures.m_rgbaTexture = nullptr;
 		}
+		for (gs_texture_t*& texture : textures.m_planeTextures)
+		{
+			if (texture)
+			{
+				gs_texture_destroy(texture);
+				texture = nullptr;
+			}
+		}
+	}
 
-		if (m_temp_texture)
+	// must be called inside obs_enter_graphics, which keeps render out, and
+	// with the tick stopped or on the tick itself
+	void DestroyTextures()
+	{
+		for (int i = 0; i < TripleBuffer<TextureSet>::NumSlots; ++i)
 		{
-			obs_enter_graphics();
-			gs_texture_destroy(m_temp_texture);
-			obs_leave_graphics();
-			m_temp_texture = nullptr;
+			DestroyTextureSet(m_textures.GetSlot(i));
 		}
+		m_textures.Reset();
 	}
 
 	// settings
-	uint32_t m_width = OM_DEFAULT_WIDTH;
-	uint32_t m_height = OM_DEFAULT_HEIGHT;
-	uint32_t m_audioSampleRate = OM_DEFAULT_AUDIO_SAMPLERATE;
+	std::atomic<uint32_t> m_width { OM_DEFAULT_WIDTH };
+	std::atomic<uint32_t> m_height { OM_DEFAULT_HEIGHT };
 	std::string m_ipaddr = OM_DEFAULT_IP_ADDRESS;
 	uint32_t m_port = OM_DEFAULT_PORT;
+	InputMode m_inputMode = OM_DEFAULT_INPUT_MODE;
+	std::atomic<MrcView> m_view { OM_DEFAULT_SOURCE_VIEW };
+	bool m_autoReconnect = OM_DEFAULT_AUTO_RECONNECT;
+	bool m_captureEnabled = false;
+	std::string m_captureFile;
+	std::string m_replayFile;
+	bool m_statsFileEnabled = false;
+	std::string m_statsFile;
+	ReplayPacing m_replayPacing = OM_DEFAULT_REPLAY_PACING;
+	bool m_framePacing = OM_DEFAULT_FRAME_PACING;
+	DecoderThreading m_decoderThreading = OM_DEFAULT_DECODER_THREADING;
+	int m_decoderThreadCount = OM_DEFAULT_DECODER_THREAD_COUNT;
+	bool m_decoderLowDelay = OM_DEFAULT_DECODER_LOW_DELAY;
+	bool m_decoderFast = OM_DEFAULT_DECODER_FAST;
+	bool m_decoderErrorConcealment = OM_DEFAULT_DECODER_ERROR_CONCEALMENT;
+	BacklogPolicy m_backlogPolicy = OM_DEFAULT_BACKLOG_POLICY;
+	bool m_cacheParameterSets = OM_DEFAULT_CACHE_PARAMETER_SETS;
 
 	std::mutex m_updateMutex;
 
+	// The decoder is prepared on a thread of its own, so neither the UI nor
+	// the tick waits for it to open, and only when the settings it depends
+	// on changed since the last time. Requests while it runs are coalesced
+	// into one more pass. Connect suspends preparing and waits for the
+	// thread first, so the pipeline never starts while a decoder is being
+	// prepared, and a prepare never overlaps a session.
+	bool m_prepareNeeded = true;				// under m_updateMutex
+	std::mutex m_prepareThreadMutex;
+	std::thread m_prepareThread;
+	bool m_prepareRunning = false;				// under m_prepareThreadMutex
+	bool m_prepareRequested = false;			// under m_prepareThreadMutex
+	bool m_prepareSuspended = false;			// under m_prepareThreadMutex
+
 	obs_source_t *m_src = nullptr;
-	gs_texture_t * m_temp_texture = nullptr;
+	const bool m_asyncVideo = false;
 	gs_effect_t* m_mrc_effect = nullptr;
 
-	AVCodec* m_codec = nullptr;
-	AVCodecContext* m_codecContext = nullptr;
-
-	SOCKET m_connectSocket = INVALID_SOCKET;
-	FrameCollection m_frameCollection;
-
-	SwsContext* m_swsContext = nullptr;
-	int m_swsContext_SrcWidth = 0;
-	int m_swsContext_SrcHeight = 0;
-	AVPixelFormat m_swsContext_SrcPixelFormat = AV_PIX_FMT_NONE;
-	int m_swsContext_DestWidth = 0;
-	int m_swsContext_DestHeight = 0;
-
-	std::vector<std::pair<int, std::shared_ptr<Frame>>> m_cachedAudioFrames;
-	int m_audioFrameIndex = 0;
-	int m_videoFrameIndex = 0;
-
+	// The tick uploads into the back set and publishes it; render draws the
+	// newest complete set. Neither waits for the other, and render never
+	// sees a texture the tick is writing or recreating.
+	TripleBuffer<TextureSet> m_textures;
+
+	// Socket or replay input, parsing, decoding, conversion and audio scheduling
+	MrcPipeline m_pipeline;
+
+	uint64_t m_lastLatencyLogTime = 0;
+
+	// Rates and depths for the performance_stats property and the stats file
+	MrcStatsReport m_statsReport;
+
+	// What the connection_status, latency_stats and performance_stats
+	// properties show. Written by the tick and the buttons, read when the
+	// properties are built; never stored in the settings.
+	std::mutex m_displayMutex;
+	std::string m_connectionStatus;
+	std::string m_latencyStats;
+	std::string m_performanceStats;
+	// Under m_updateMutex: the connection state the properties were last
+	// rebuilt for
+	bool m_statusShown = false;
+	bool m_shownActive = false;
+	ConnectionState m_shownState = ConnectionState::Disconnected;
+
+	// Under m_updateMutex: the tick formats the connection status from
+	// these, and Connect reads them on a button press
 	void Update(obs_data_t* settings)
 	{
+		std::lock_guard<std::mutex> lock(m_updateMutex);
+		auto decoderInputs = GetDecoderInputs();
+
 		m_width = (uint32_t)obs_data_get_int(settings, "width");
 		m_height = (uint32_t)obs_data_get_int(settings, "height");
 		m_ipaddr = obs_data_get_string(settings, "ipaddr");
 		m_port = (uint32_t)obs_data_get_int(settings, "port");
+		m_inputMode = (InputMode)obs_data_get_int(settings, "input_mode");
+		m_view = (MrcView)obs_data_get_int(settings, "view");
+		m_autoReconnect = obs_data_get_bool(settings, "auto_reconnect");
+		m_captureEnabled = obs_data_get_bool(settings, "capture_enabled");
+		m_captureFile = obs_data_get_string(settings, "capture_file");
+		m_replayFile = obs_data_get_string(settings, "replay_file");
+		m_statsFileEnabled = obs_data_get_bool(settings, "stats_file_enabled");
+		m_statsFile = obs_data_get_string(settings, "stats_file");
+		m_replayPacing = (ReplayPacing)obs_data_get_int(settings, "replay_pacing");
+		m_pipeline.SetGpuConversion(obs_data_get_bool(settings, "gpu_conversion"));
+		m_pipeline.SetAudioDelay((uint32_t)obs_data_get_int(settings, "audio_delay_ms"));
+		m_framePacing = obs_data_get_bool(settings, "frame_pacing");
+		m_pipeline.SetFrameDelay((uint32_t)obs_data_get_int(settings, "frame_delay_ms"));
+		m_decoderThreading = (DecoderThreading)obs_data_get_int(settings, "decoder_threading");
+		m_decoderThreadCount = (int)obs_data_get_int(settings, "decoder_thread_count");
+		m_decoderLowDelay = obs_data_get_bool(settings, "decoder_low_delay");
+		m_decoderFast = obs_data_get_bool(settings, "decoder_fast");
+		m_decoderErrorConcealment = obs_data_get_bool(settings, "decoder_error_concealment");
+		m_backlogPolicy = (BacklogPolicy)obs_data_get_int(settings, "backlog_policy");
+		m_cacheParameterSets = obs_data_get_bool(settings, "cache_parameter_sets");
+
+		if (GetDecoderInputs() != decoderInputs)
+		{
+			m_prepareNeeded = true;
+		}
 	}
 
-	uint32_t GetWidth()
+	// What PrepareDecoder depends on: the decoder settings, and the
+	// parameter set cache it loads
+	std::tuple<DecoderThreading, int, bool, bool, bool, bool, InputMode, std::string, uint32_t> GetDecoderInputs() const
 	{
-		return m_width;
+		return std::make_tuple(m_decoderThreading, m_decoderThreadCount, m_decoderLowDelay, m_decoderFast,
+			m_decoderErrorConcealment, m_cacheParameterSets, m_inputMode, m_ipaddr, m_port);
 	}
 
-	uint32_t GetHeight()
+	void PrepareDecoderIfNeeded()
 	{
-		return m_height;
+		{
+			std::lock_guard<std::mutex> lock(m_updateMutex);
+			if (!m_prepareNeeded || IsActive())
+			{
+				return;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(m_prepareThreadMutex);
+		if (m_prepareSuspended)
+		{
+			// m_prepareNeeded stays set for the next update or show
+			return;
+		}
+		m_prepareRequested = true;
+		if (m_prepareRunning)
+		{
+			return;
+		}
+		if (m_prepareThread.joinable())
+		{
+			// done with its last request, only left to return
+			m_prepareThread.join();
+		}
+		m_prepareRunning = true;
+		m_prepareThread = std::thread(&OculusMrcSource::PrepareThread, this);
 	}
 
-	void ReceiveData()
+	// Keeps new prepares from starting and waits for the running one, with
+	// no other lock held
+	void SuspendPrepare()
 	{
-		if (m_connectSocket != INVALID_SOCKET)
+		std::thread thread;
 		{
-			for (;;)
-			{
-				fd_set socketSet = { 0 };
-				FD_ZERO(&socketSet);
-				FD_SET(m_connectSocket, &socketSet);
+			std::lock_guard<std::mutex> lock(m_prepareThreadMutex);
+			m_prepareSuspended = true;
+			m_prepareRequested = false;
+			thread = std::move(m_prepareThread);
+		}
+		if (thread.joinable())
+		{
+			thread.join();
+		}
+	}
 
-				timeval t = { 0, 0 };
-				int num = select(0, &socketSet, nullptr, nullptr, &t);
-				if (num >= 1)
-				{
-					const int bufferSize = 65536;
-					uint8_t buf[bufferSize];
-					int iResult = recv(m_connectSocket, (char*)buf, bufferSize, 0);
-					if (iResult < 0)
-					{
-						OM_BLOG(LOG_ERROR, "recv error %d, closing socket", iResult);
-						Disconnect();
-					}
-					else if (iResult == 0)
-					{
-						OM_BLOG(LOG_INFO, "recv 0 bytes, closing socket");
-						Disconnect();
-					}
-					else
-					{
-						//OM_BLOG(LOG_INFO, "recv: %d bytes received", iResult);
-						m_frameCollection.AddData(buf, iResult);
-					}
-				}
-				else
+	void ResumePrepare()
+	{
+		std::lock_guard<std::mutex> lock(m_prepareThreadMutex);
+		m_prepareSuspended = false;
+	}
+
+	void PrepareThread()
+	{
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_prepareThreadMutex);
+				if (!m_prepareRequested)
 				{
-					break;
+					m_prepareRunning = false;
+					return;
 				}
+				m_prepareRequested = false;
 			}
+			PrepareDecoder();
 		}
 	}
 
-	void VideoTickImpl()
+	// Opens the decoder while the source is idle, so connecting does not
+	// wait for it; the pipeline keeps it for the session if the settings
+	// still match then. m_updateMutex is only held to read the settings,
+	// the tick does not wait for the decoder; the pipeline cannot start
+	// meanwhile, see SuspendPrepare.
+	void PrepareDecoder()
+	{
+		MrcPipelineSettings settings;
+		{
+			std::lock_guard<std::mutex> lock(m_updateMutex);
+			if (!m_prepareNeeded || IsActive())
+			{
+				return;
+			}
+			m_prepareNeeded = false;
+			settings = GetPipelineSettings();
+		}
+
+		m_pipeline.SetName(obs_source_get_name(m_src));
+		m_pipeline.PrepareDecoder(settings);
+	}
+
+	// One file per headset address in the plugin's config directory
+	std::string GetParameterSetCachePath() const
+	{
+		char* dir = obs_module_config_path("");
+		if (dir)
+		{
+			os_mkdirs(dir);
+			bfree(dir);
+		}
+
+		std::string name = string_format("parameter-sets-%s-%u.h264", m_ipaddr.c_str(), m_port);
+		std::replace_if(name.begin(), name.end(), [](char c) {
+			return !isalnum((unsigned char)c) && c != '-' && c != '.';
+		}, '_');
+
+		char* path = obs_module_config_path(name.c_str());
+		std::string result = path ? path : "";
+		bfree(path);
+		return result;
+	}
+
+	uint32_t GetWidth()
+	{
+		uint32_t width, height;
+		GetViewSize(m_view, width, height);
+		return width;
+	}
+
+	uint32_t GetHeight()
 	{
-		if (m_connectSocket != INVALID_SOCKET)
+		uint32_t width, height;
+		GetViewSize(m_view, width, height);
+		return height;
+	}
+
+	// Connected to the headset, or replaying a capture
+	bool IsActive() const
+	{
+		return m_pipeline.IsRunning();
+	}
+
+	MrcPipelineSettings GetPipelineSettings() const
+	{
+		MrcPipelineSettings settings;
+		settings.decoderThreading = m_decoderThreading;
+		settings.decoderThreadCount = m_decoderThreadCount;
+		settings.decoderLowDelay = m_decoderLowDelay;
+		settings.decoderFast = m_decoderFast;
+		settings.decoderErrorConcealment = m_decoderErrorConcealment;
+		settings.asyncOutput = m_asyncVideo;
+		settings.framePacing = m_framePacing && !m_asyncVideo;
+		settings.expectedWidth = m_width;
+		settings.expectedHeight = m_height;
+		settings.captureFile = m_captureEnabled ? m_captureFile : std::string();
+		settings.replayPacing = m_replayPacing;
+		settings.reconnect = m_autoReconnect;
+		settings.backlogPolicy = m_backlogPolicy;
+		if (m_cacheParameterSets && m_inputMode == InputMode::Network)
 		{
-			ReceiveData();
+			settings.parameterSetCacheFile = GetParameterSetCachePath();
+		}
+		return settings;
+	}
+
+	// MrcPipelineSink, called on a decode pool worker
+
+	void OnVideoDimension(int width, int height) override
+	{
+		m_width = width;
+		m_height = height;
+	}
+
+	void OnAudio(const AudioChunk& chunk) override
+	{
+		obs_source_audio audio = { 0 };
+		audio.data[0] = (const uint8_t*)chunk.data;
+		audio.frames = chunk.frames;
+		audio.speakers = chunk.channels == 1 ? SPEAKERS_MONO : SPEAKERS_STEREO;
+		audio.format = AUDIO_FORMAT_FLOAT;
+		audio.samples_per_sec = chunk.sampleRate;
+		audio.timestamp = chunk.timestamp;
+		obs_source_output_audio(m_src, &audio);
+	}
 
-			if (m_connectSocket == INVALID_SOCKET)	// socket disconnected
+	void OnPicture(const AVFrame* picture, const PipelineTimestamps& /*timestamps*/) override
+	{
+		// OBS buffers and paces async frames itself, so every picture goes out
+		OutputAsyncVideo(picture);
+	}
+
+	void VideoTickImpl()
+	{
+		if (IsActive())
+		{
+			if (m_pipeline.HasInputEnded())	// connection lost without reconnecting, or replay finished
+			{
+				Disconnect();
 				return;
+			}
+
+			ShowConnectionStatus();
 
-			//std::chrono::time_point<std::chrono::system_clock> startTime = std::chrono::system_clock::now();
-			while (m_frameCollection.HasCompletedFrame())
+			DecodedImage* image = m_pipeline.TakeNewestImage();
+			if (image)
 			{
-				//std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - startTime;
-				//if (timePassed.count() > 0.05)
-				//	break;
+				UploadImage(*image);
+				m_pipeline.ReturnImage(image);
+			}
 
-				auto frame = m_frameCollection.PopFrame();
+			uint64_t now = GetSteadyTimeNs();
+			if (now - m_lastLatencyLogTime >= OM_LATENCY_LOG_INTERVAL_SECONDS * 1000000000ULL)
+			{
+				LogLatency();
+				m_lastLatencyLogTime = now;
+			}
 
-				//auto current_time = std::chrono::system_clock::now();
-				//auto seconds_since_epoch = std::chrono::duration<double>(current_time.time_since_epoch()).count();
-				//double latency = seconds_since_epoch - frame->m_secondsSinceEpoch;
+			if (m_statsReport.Sample(m_pipeline, now, OM_STATS_INTERVAL_MS * 1000000ULL))
+			{
+				ShowPerformanceStats(m_statsReport.GetText());
+			}
+		}
+	}
 
-				if (frame->m_type == Frame::PayloadType::VIDEO_DIMENSION)
-				{
-					struct FrameDimension
-					{
-						int w;
-						int h;
-					};
-					const FrameDimension* dim = (const FrameDimension*)frame->m_payload.data();
-					m_width = dim->w;
-					m_height = dim->h;
-
-					OM_BLOG(LOG_INFO, "[VIDEO_DIMENSION] width %d height %d", m_width, m_height);
-				}
-				else if (frame->m_type == Frame::PayloadType::VIDEO_DATA)
-				{
-					AVPacket* packet = av_packet_alloc();
-					AVFrame* picture = av_frame_alloc();
-
-					av_new_packet(packet, (int)frame->m_payload.size());
-					assert(packet->data);
-					memcpy(packet->data, frame->m_payload.data(), frame->m_payload.size());
-
-					int ret = avcodec_send_packet(m_codecContext, packet);
-					if (ret < 0)
-					{
-						OM_BLOG(LOG_ERROR, "avcodec_send_packet error %s", GetAvErrorString(ret).c_str());
-					}
-					else
-					{
-						ret = avcodec_receive_frame(m_codecContext, picture);
-						if (ret < 0)
-						{
-							OM_BLOG(LOG_ERROR, "avcodec_receive_frame error %s", GetAvErrorString(ret).c_str());
-						}
-						else
-						{
-#if _DEBUG
-							std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_frameCollection.GetFirstFrameTime();
-							OM_BLOG(LOG_DEBUG, "[%f][VIDEO_DATA] size %d width %d height %d format %d", timePassed.count(), packet->size, picture->width, picture->height, picture->format);
-#endif
+	std::string GetConnectionStatusText(const MrcConnectionStatus& status) const
+	{
+		if (m_inputMode == InputMode::Replay)
+		{
+			return IsActive() ? "replaying " + m_replayFile : "stopped";
+		}
 
-							while (m_cachedAudioFrames.size() > 0 && m_cachedAudioFrames[0].first <= m_videoFrameIndex)
-							{
-								std::shared_ptr<Frame> audioFrame = m_cachedAudioFrames[0].second;
-
-								struct AudioDataHeader {
-									uint64_t timestamp;
-									int channels;
-									int dataLength;
-								};
-								AudioDataHeader* audioDataHeader = (AudioDataHeader*)(audioFrame->m_payload.data());
-
-								if (audioDataHeader->channels == 1 || audioDataHeader->channels == 2)
-								{
-									obs_source_audio audio = { 0 };
-									audio.data[0] = (uint8_t*)audioFrame->m_payload.data() + sizeof(AudioDataHeader);
-									audio.frames = audioDataHeader->dataLength / sizeof(float) / audioDataHeader->channels;
-									audio.speakers = audioDataHeader->channels == 1 ? SPEAKERS_MONO : SPEAKERS_STEREO;
-									audio.format = AUDIO_FORMAT_FLOAT;
-									audio.samples_per_sec = m_audioSampleRate;
-									audio.timestamp = audioDataHeader->timestamp;
-									obs_source_output_audio(m_src, &audio);
-								}
-								else
-								{
-									OM_BLOG(LOG_ERROR, "[AUDIO_DATA] unimplemented audio channels %d", audioDataHeader->channels);
-								}
-
-								m_cachedAudioFrames.erase(m_cachedAudioFrames.begin());
-							}
-
-							++m_videoFrameIndex;
-
-							if (m_swsContext != nullptr)
-							{
-								if (m_swsContext_SrcWidth != m_codecContext->width ||
-									m_swsContext_SrcHeight != m_codecContext->height ||
-									m_swsContext_SrcPixelFormat != m_codecContext->pix_fmt ||
-									m_swsContext_DestWidth != m_codecContext->width ||
-									m_swsContext_DestHeight != m_codecContext->height)
-								{
-									OM_BLOG(LOG_DEBUG, "Need recreate m_swsContext");
-									sws_freeContext(m_swsContext);
-									m_swsContext = nullptr;
-								}
-							}
-
-							if (m_swsContext == nullptr)
-							{
-								m_swsContext = sws_getContext(
-									m_codecContext->width,
-									m_codecContext->height,
-									m_codecContext->pix_fmt,
-									m_codecContext->width,
-									m_codecContext->height,
-									AV_PIX_FMT_RGBA,
-									SWS_POINT,
-									nullptr, nullptr, nullptr
-								);
-								m_swsContext_SrcWidth = m_codecContext->width;
-								m_swsContext_SrcHeight = m_codecContext->height;
-								m_swsContext_SrcPixelFormat = m_codecContext->pix_fmt;
-								m_swsContext_DestWidth = m_codecContext->width;
-								m_swsContext_DestHeight = m_codecContext->height;
-								OM_BLOG(LOG_DEBUG, "sws_getContext(%d, %d, %d)", m_codecContext->width, m_codecContext->height, m_codecContext->pix_fmt);
-							}
-
-							assert(m_swsContext);
-							uint8_t* data[1] = { new uint8_t[m_codecContext->width * m_codecContext->height * 4] };
-							int stride[1] = { (int)m_codecContext->width * 4 };
-							sws_scale(m_swsContext, picture->data,
-								picture->linesize,
-								0,
-								picture->height,
-								data,
-								stride);
-
-							obs_enter_graphics();
-							if (m_temp_texture)
-							{
-								gs_texture_destroy(m_temp_texture);
-								m_temp_texture = nullptr;
-							}
-							m_temp_texture = gs_texture_create(m_codecContext->width,
-								m_codecContext->height,
-								GS_RGBA,
-								1,
-								const_cast<const uint8_t**>(&data[0]),
-								0);
-							obs_leave_graphics();
-
-							delete data[0];
-						}
-					}
-
-					av_frame_free(&picture);
-					av_packet_free(&packet);
-				}
-				else if (frame->m_type == Frame::PayloadType::AUDIO_SAMPLERATE)
-				{
-					m_audioSampleRate = *(uint32_t*)(frame->m_payload.data());
-					OM_BLOG(LOG_DEBUG, "[AUDIO_SAMPLERATE] %d", m_audioSampleRate);
-				}
-				else if (frame->m_type == Frame::PayloadType::AUDIO_DATA)
-				{
-					m_cachedAudioFrames.push_back(std::make_pair(m_audioFrameIndex, frame));
-					++m_audioFrameIndex;
-#if _DEBUG
-					std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_frameCollection.GetFirstFrameTime();
-					OM_BLOG(LOG_DEBUG, "[%f][AUDIO_DATA] timestamp %llu", timePassed.count());
-#endif
-				}
-				else
-				{
-					OM_BLOG(LOG_ERROR, "Unknown payload type: %u", frame->m_type);
-				}
+		std::string text = GetConnectionStateName(status.state);
+		if (status.state == ConnectionState::Streaming)
+		{
+			text += string_format(" from %s:%u", m_ipaddr.c_str(), m_port);
+			if (status.reconnects > 0)
+			{
+				text += string_format(", %llu reconnects", (unsigned long long)status.reconnects);
 			}
 		}
+		else if (status.failedAttempts > 0)
+		{
+			text += string_format(" (%u failed attempts): %s", status.failedAttempts, status.lastError.c_str());
+		}
+		return text;
 	}
 
-	void VideoRenderImpl()
+	// Sets the text one of the read-only properties shows. An open properties
+	// dialog only picks it up when it is next rebuilt.
+	void ShowText(std::string& field, const std::string& text)
 	{
-#if _DEBUG
-		if (m_connectSocket != INVALID_SOCKET && m_frameCollection.HasFirstFrame())
+		std::lock_guard<std::mutex> lock(m_displayMutex);
+		field = text;
+	}
+
+	// Rebuilds an open properties dialog only when the connection state
+	// changes, not on every tick or stats sample
+	void ShowConnectionStatus()
+	{
+		MrcConnectionStatus status = m_pipeline.GetConnectionStatus();
+		bool active = IsActive();
+		ShowText(m_connectionStatus, GetConnectionStatusText(status));
+
+		if (m_statusShown && active == m_shownActive && status.state == m_shownState)
 		{
-			std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_frameCollection.GetFirstFrameTime();
-			OM_BLOG(LOG_DEBUG, "[%f] VideoRenderImpl", timePassed.count());
+			return;
 		}
-#endif
+		m_statusShown = true;
+		m_shownActive = active;
+		m_shownState = status.state;
+		obs_source_update_properties(m_src);
+	}
+
+	void ShowPerformanceStats(const std::string& text)
+	{
+		ShowText(m_performanceStats, text);
+	}
 
-		if (m_temp_texture)
+	// Logs the percentiles of the window that just ended, shows them in the
+	// properties and starts a new window
+	void LogLatency()
+	{
+		std::string summary = m_pipeline.GetLatencyStats().GetSummary();
+		if (summary.empty())
 		{
-			gs_technique_t *tech = gs_effect_get_technique(m_mrc_effect, "Frame");
+			return;
+		}
+		m_pipeline.GetLatencyStats().ResetHistograms();
 
-			gs_technique_begin(tech);
-			gs_technique_begin_pass(tech, 0);
+		MrcPipelineStats stats = m_pipeline.GetStats();
+		if (stats.pacerDelayNs > 0 || stats.repeatedPictures > 0 || stats.pacerDroppedPictures > 0)
+		{
+			summary += string_format("frame pacing: delay %.1f ms, %llu repeated, %llu dropped\n",
+				stats.pacerDelayNs / 1e6,
+				(unsigned long long)stats.repeatedPictures,
+				(unsigned long long)stats.pacerDroppedPictures);
+		}
 
-			obs_source_draw(m_temp_texture, 0, 0, m_width, m_height, true);
+		OM_BLOG(LOG_INFO, "Latency over the last %d s:\n%s", OM_LATENCY_LOG_INTERVAL_SECONDS, summary.c_str());
+		ShowText(m_latencyStats, summary);
+	}
 
-			gs_technique_end_pass(tech);
-			gs_technique_end(tech);
+	void UploadImage(const DecodedImage& image)
+	{
+		TextureSet& textures = m_textures.GetBack();
+
+		obs_enter_graphics();
+		if (image.m_format == DecodedImage::Format::YUV420)
+		{
+			UploadPlanes(textures, image.m_frame);
 		}
 		else
+		{
+			// the texture lives as long as the decoder's output size stays the same
+			if (!textures.m_rgbaTexture ||
+				gs_texture_get_width(textures.m_rgbaTexture) != (uint32_t)image.m_width ||
+				gs_texture_get_height(textures.m_rgbaTexture) != (uint32_t)image.m_height)
+			{
+				DestroyTextureSet(textures);
+				textures.m_rgbaTexture = gs_texture_create(image.m_width,
+					image.m_height,
+					GS_RGBA,
+					1,
+					nullptr,
+					GS_DYNAMIC);
+				OM_BLOG(LOG_DEBUG, "Created RGBA texture %dx%d", image.m_width, image.m_height);
+			}
+			gs_texture_set_image(textures.m_rgbaTexture, image.m_data.data(), (uint32_t)image.m_width * 4, false);
+		}
+		obs_leave_graphics();
+
+		textures.m_timestamps = image.m_timestamps;
+		textures.m_timestamps.upload = GetSteadyTimeNs();
+		m_textures.Publish();
+	}
+
+	// must be called inside obs_enter_graphics
+	void UploadPlanes(TextureSet& textures, const AVFrame* frame)
+	{
+		uint32_t widths[3] = { (uint32_t)frame->width, (uint32_t)(frame->width + 1) / 2, (uint32_t)(frame->width + 1) / 2 };
+		uint32_t heights[3] = { (uint32_t)frame->height, (uint32_t)(frame->height + 1) / 2, (uint32_t)(frame->height + 1) / 2 };
+
+		if (textures.m_rgbaTexture || !textures.m_planeTextures[0] ||
+			gs_texture_get_width(textures.m_planeTextures[0]) != widths[0] ||
+			gs_texture_get_height(textures.m_planeTextures[0]) != heights[0])
+		{
+			DestroyTextureSet(textures);
+			for (int i = 0; i < 3; ++i)
+			{
+				textures.m_planeTextures[i] = gs_texture_create(widths[i], heights[i], GS_R8, 1, nullptr, GS_DYNAMIC);
+			}
+			OM_BLOG(LOG_DEBUG, "Created YUV plane textures %ux%u", widths[0], heights[0]);
+		}
+
+		for (int i = 0; i < 3; ++i)
+		{
+			gs_texture_set_image(textures.m_planeTextures[i], frame->data[i], (uint32_t)frame->linesize[i], false);
+		}
+
+		bool fullRange = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P;
+		video_colorspace colorspace = frame->colorspace == AVCOL_SPC_BT709 ? VIDEO_CS_709 : VIDEO_CS_601;
+		video_format_get_parameters(colorspace,
+			fullRange ? VIDEO_RANGE_FULL : VIDEO_RANGE_PARTIAL,
+			textures.m_colorMatrix, textures.m_colorRangeMin, textures.m_colorRangeMax);
+	}
+
+	void OutputAsyncVideo(const AVFrame* picture)
+	{
+		video_format format = VIDEO_FORMAT_NONE;
+		switch (picture->format)
+		{
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+			format = VIDEO_FORMAT_I420;
+			break;
+		case AV_PIX_FMT_NV12:
+			format = VIDEO_FORMAT_NV12;
+			break;
+		case AV_PIX_FMT_YUV444P:
+			format = VIDEO_FORMAT_I444;
+			break;
+		default:
+			OM_BLOG(LOG_ERROR, "Pixel format %d not supported for async video", picture->format);
+			return;
+		}
+
+		obs_source_frame obsFrame = {};
+		for (int i = 0; i < MAX_AV_PLANES && i < AV_NUM_DATA_POINTERS; ++i)
+		{
+			obsFrame.data[i] = picture->data[i];
+			obsFrame.linesize[i] = (uint32_t)picture->linesize[i];
+		}
+		obsFrame.width = (uint32_t)picture->width;
+		obsFrame.height = (uint32_t)picture->height;
+		obsFrame.format = format;
+
+		// packets carry their place on the smoothed arrival cadence as pts,
+		// see ProcessFrame
+		obsFrame.timestamp = picture->pts != AV_NOPTS_VALUE ? (uint64_t)picture->pts : os_gettime_ns();
+
+		obsFrame.full_range = picture->color_range == AVCOL_RANGE_JPEG || picture->format == AV_PIX_FMT_YUVJ420P;
+		video_format_get_parameters(picture->colorspace == AVCOL_SPC_BT709 ? VIDEO_CS_709 : VIDEO_CS_601,
+			obsFrame.full_range ? VIDEO_RANGE_FULL : VIDEO_RANGE_PARTIAL,
+			obsFrame.color_matrix, obsFrame.color_range_min, obsFrame.color_range_max);
+
+		obs_source_output_video(m_src, &obsFrame);
+	}
+
+	void VideoRenderImpl()
+	{
+#if _DEBUG
+		if (IsActive() && m_pipeline.HasFirstFrame())
+		{
+			std::chrono::duration<double> timePassed = std::chrono::system_clock::now() - m_pipeline.GetFirstFrameTime();
+			OM_BLOG(LOG_DEBUG, "[%f] VideoRenderImpl", timePassed.count());
+		}
+#endif
+
+		uint32_t width, height;
+		GetViewSize(m_view, width, height);
+		if (!DrawView(m_view, width, height) && m_view == MrcView::Composite)
 		{
 			gs_technique_t *tech = gs_effect_get_technique(m_mrc_effect, "Empty");
 
@@ -593,119 +1121,211 @@ private:
 
 	void Connect()
 	{
-		if (m_connectSocket != INVALID_SOCKET)
+		if (IsActive())
 		{
 			OM_BLOG(LOG_ERROR, "Already connected");
 			return;
 		}
 
-		struct addrinfo *result = NULL;
-		struct addrinfo *ptr = NULL;
-		struct addrinfo hints = { 0 };
-
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-
-		int iResult;
-		iResult = getaddrinfo(m_ipaddr.c_str(), std::to_string(m_port).c_str(), &hints, &result);
-		if (iResult != 0)
+		m_pipeline.SetName(obs_source_get_name(m_src));
+		m_lastLatencyLogTime = GetSteadyTimeNs();
+		m_statsReport.Reset();
+		if (m_statsFileEnabled && !m_statsFile.empty())
 		{
-			OM_BLOG(LOG_ERROR, "getaddrinfo failed: %d", iResult);
+			m_statsReport.OpenFile(m_statsFile);
 		}
 
-		ptr = result;
-		m_connectSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-		if (m_connectSocket == INVALID_SOCKET)
+		if (m_inputMode == InputMode::Replay)
 		{
-			OM_BLOG(LOG_ERROR, "Error at socket(): %d", WSAGetLastError());
-			freeaddrinfo(result);
+			m_pipeline.StartReplay(m_replayFile, GetPipelineSettings());
 		}
+		else
+		{
+			// returns straight away, the connection is made in the background
+			// and its progress shows in the connection_status property
+			m_pipeline.StartNetwork(m_ipaddr, m_port, GetPipelineSettings());
+		}
+		ShowConnectionStatus();
+	}
 
-		if (m_connectSocket != INVALID_SOCKET)
+	void Disconnect()
+	{
+		if (!IsActive())
 		{
-			// put socked in non-blocking mode...
-			u_long block = 1;
-			if (ioctlsocket(m_connectSocket, FIONBIO, &block) == SOCKET_ERROR)
-			{
-				OM_BLOG(LOG_ERROR, "Unable to put socket to unblocked mode");
-			}
+			OM_BLOG(LOG_ERROR, "Not connected");
+			return;
+		}
 
-			iResult = connect(m_connectSocket, ptr->ai_addr, (int)ptr->ai_addrlen);
-			bool hasError = true;
-			if (iResult == SOCKET_ERROR)
-			{
-				if (WSAGetLastError() == WSAEWOULDBLOCK)
-				{
-					fd_set setW, setE;
-
-					FD_ZERO(&setW);
-					FD_SET(m_connectSocket, &setW);
-					FD_ZERO(&setE);
-					FD_SET(m_connectSocket, &setE);
-
-					timeval time_out = { 0 };
-					time_out.tv_sec = 2;
-					time_out.tv_usec = 0;
-
-					int ret = select(0, NULL, &setW, &setE, &time_out);
-					if (ret > 0 && !FD_ISSET(m_connectSocket, &setE))
-					{
-						hasError = false;
-					}
-				}
-			}
-			if (hasError)
+		m_pipeline.Stop();
+		LogLatency();
+		m_statsReport.CloseFile();
+		ShowConnectionStatus();
+
+		obs_enter_graphics();
+		DestroyTextures();
+		obs_leave_graphics();
+	}
+
+};
+
+// A single view of another Oculus MRC source, drawn from the textures that
+// source uploads, so the background and foreground can be put on either
+// side of a camera without a second connection, decode or upload
+class OculusMrcLayerSource
+{
+public:
+	// OBS source interfaces
+
+	static const char* GetName(void*)
+	{
+		return obs_module_text("OculusMrcLayerSource");
+	}
+
+	static void *Create(obs_data_t *settings, obs_source_t *source)
+	{
+		OculusMrcLayerSource *context = new OculusMrcLayerSource(source);
+		Update(context, settings);
+		return context;
+	}
+
+	static void Destroy(void *data)
+	{
+		delete (OculusMrcLayerSource*)data;
+	}
+
+	static void Update(void *data, obs_data_t *settings)
+	{
+		OculusMrcLayerSource *context = (OculusMrcLayerSource*)data;
+		context->Update(settings);
+	}
+
+	static obs_properties_t *GetProperties(void*)
+	{
+		obs_properties_t *props = obs_properties_create();
+
+		obs_property_t* parent = obs_properties_add_list(props, "parent",
+			obs_module_text("Oculus MRC source"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+		obs_enum_sources([](void* data, obs_source_t* source) {
+			if (strcmp(obs_source_get_id(source), "oculus_mrc_source") == 0)
 			{
-				OM_BLOG(LOG_ERROR, "Unable to connect");
-				MessageBox(NULL, TEXT("Please verify the Quest IP address, and if MRC-enabled game is running on Quest.\n\nReboot the headset and re-launch the game if the issue remains."), TEXT("Connection failed"), MB_OK);
-				closesocket(m_connectSocket);
-				m_connectSocket = INVALID_SOCKET;
+				const char* name = obs_source_get_name(source);
+				obs_property_list_add_string((obs_property_t*)data, name, name);
 			}
-			else
-			{
-				OM_BLOG(LOG_INFO, "Socket connected to %s:%d", m_ipaddr.c_str(), m_port);
-				block = 0;
-				if (ioctlsocket(m_connectSocket, FIONBIO, &block) == SOCKET_ERROR)
-				{
-					OM_BLOG(LOG_ERROR, "Unable to put socket to blocked mode");
-				}
-			}
-		}
+			return true;
+		}, parent);
+
+		AddViewProperty(props);
+		return props;
+	}
+
+	static void GetDefaults(obs_data_t *settings)
+	{
+		obs_data_set_default_string(settings, "parent", "");
+		obs_data_set_default_int(settings, "view", (int)OM_DEFAULT_LAYER_VIEW);
+	}
+
+	static void VideoTick(void *data, float /*seconds*/)
+	{
+		OculusMrcLayerSource *context = (OculusMrcLayerSource*)data;
+		context->VideoTick();
+	}
+
+	static void VideoRender(void *data, gs_effect_t* /*effect*/)
+	{
+		OculusMrcLayerSource *context = (OculusMrcLayerSource*)data;
+		context->VideoRender();
+	}
+
+	static uint32_t GetWidth(void *data)
+	{
+		return ((OculusMrcLayerSource*)data)->m_width;
+	}
+
+	static uint32_t GetHeight(void *data)
+	{
+		return ((OculusMrcLayerSource*)data)->m_height;
+	}
+
+private:
+	explicit OculusMrcLayerSource(obs_source_t* source) :
+		m_src(source)
+	{
+	}
 
-		freeaddrinfo(result);
+	~OculusMrcLayerSource()
+	{
+		obs_weak_source_release(m_parent);
+	}
 
-		m_frameCollection.Reset();
+	void Update(obs_data_t* settings)
+	{
+		std::lock_guard<std::mutex> lock(m_updateMutex);
+		std::string parentName = obs_data_get_string(settings, "parent");
+		if (parentName != m_parentName)
+		{
+			m_parentName = parentName;
+			obs_weak_source_release(m_parent);
+			m_parent = nullptr;
+		}
+		m_view = (MrcView)obs_data_get_int(settings, "view");
+	}
+
+	// Looks the parent up by name until it exists, then follows it by
+	// reference, and takes its size for the view
+	void VideoTick()
+	{
+		std::lock_guard<std::mutex> lock(m_updateMutex);
 
-		m_audioFrameIndex = 0;
-		m_videoFrameIndex = 0;
-		m_cachedAudioFrames.clear();
+		obs_source_t* parent = obs_weak_source_get_source(m_parent);
+		if (!parent && !m_parentName.empty())
+		{
+			parent = obs_get_source_by_name(m_parentName.c_str());
+			obs_weak_source_release(m_parent);
+			m_parent = parent ? obs_source_get_weak_source(parent) : nullptr;
+		}
 
-		if (m_connectSocket != INVALID_SOCKET)
+		OculusMrcSource* context = parent ? OculusMrcSource::Find(parent) : nullptr;
+		uint32_t width = OM_DEFAULT_WIDTH / 2;
+		uint32_t height = OM_DEFAULT_HEIGHT;
+		if (context)
 		{
-			StartDecoder();
+			context->GetViewSize(m_view, width, height);
 		}
+		m_width = width;
+		m_height = height;
+		obs_source_release(parent);
 	}
 
-	void Disconnect()
+	void VideoRender()
 	{
-		if (m_connectSocket == INVALID_SOCKET)
+		// the reference keeps the parent, and its textures, alive while drawing
+		obs_source_t* parent = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_updateMutex);
+			parent = obs_weak_source_get_source(m_parent);
+		}
+		if (!parent)
 		{
-			OM_BLOG(LOG_ERROR, "Not connected");
 			return;
 		}
 
-		StopDecoder();
-
-		int ret = closesocket(m_connectSocket);
-		if (ret == INVALID_SOCKET)
+		OculusMrcSource* context = OculusMrcSource::Find(parent);
+		if (context)
 		{
-			OM_BLOG(LOG_ERROR, "closesocket error %d", WSAGetLastError());
+			context->DrawView(m_view, m_width, m_height);
 		}
-		m_connectSocket = INVALID_SOCKET;
-		OM_BLOG(LOG_INFO, "Socket disconnected");
+		obs_source_release(parent);
 	}
 
+	obs_source_t* m_src = nullptr;
+
+	std::mutex m_updateMutex;
+	std::string m_parentName;
+	obs_weak_source_t* m_parent = nullptr;
+	std::atomic<MrcView> m_view { OM_DEFAULT_LAYER_VIEW };
+
+	std::atomic<uint32_t> m_width { OM_DEFAULT_WIDTH / 2 };
+	std::atomic<uint32_t> m_height { OM_DEFAULT_HEIGHT };
 };
 
 OBS_DECLARE_MODULE()
@@ -719,13 +1339,12 @@ bool obs_module_load(void)
 {
 	avcodec_register_all();
 
-	// Initialize Winsock
-	WSADATA wsaData = { 0 };
-	int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-	if (iResult != 0) {
-		OM_LOG(LOG_ERROR, "WSAStartup failed: %d\n", iResult);
+	if (!InitializeSockets())
+	{
 		return false;
 	}
+	g_ioReactor = new MrcIoReactor();
+	g_decodePool = new MrcDecodePool();
 
 	struct obs_source_info oculus_mrc_source_info = { 0 };
 	oculus_mrc_source_info.id = "oculus_mrc_source";
@@ -734,6 +1353,7 @@ bool obs_module_load(void)
 	oculus_mrc_source_info.create = &OculusMrcSource::Create;
 	oculus_mrc_source_info.destroy = &OculusMrcSource::Destroy;
 	oculus_mrc_source_info.update = &OculusMrcSource::Update;
+	oculus_mrc_source_info.show = &OculusMrcSource::Show;
 	oculus_mrc_source_info.get_name = &OculusMrcSource::GetName;
 	oculus_mrc_source_info.get_defaults = &OculusMrcSource::GetDefaults;
 	oculus_mrc_source_info.get_width = &OculusMrcSource::GetWidth;
@@ -743,10 +1363,46 @@ bool obs_module_load(void)
 	oculus_mrc_source_info.get_properties = &OculusMrcSource::GetProperties;
 
 	obs_register_source(&oculus_mrc_source_info);
+
+	struct obs_source_info oculus_mrc_async_source_info = { 0 };
+	oculus_mrc_async_source_info.id = "oculus_mrc_async_source";
+	oculus_mrc_async_source_info.type = OBS_SOURCE_TYPE_INPUT;
+	oculus_mrc_async_source_info.output_flags = OBS_SOURCE_ASYNC_VIDEO | OBS_SOURCE_AUDIO;
+	oculus_mrc_async_source_info.create = &OculusMrcSource::CreateAsync;
+	oculus_mrc_async_source_info.destroy = &OculusMrcSource::Destroy;
+	oculus_mrc_async_source_info.update = &OculusMrcSource::Update;
+	oculus_mrc_async_source_info.show = &OculusMrcSource::Show;
+	oculus_mrc_async_source_info.get_name = &OculusMrcSource::GetAsyncName;
+	oculus_mrc_async_source_info.get_defaults = &OculusMrcSource::GetDefaults;
+	oculus_mrc_async_source_info.video_tick = &OculusMrcSource::VideoTick;	// only watches the connection
+	oculus_mrc_async_source_info.get_properties = &OculusMrcSource::GetProperties;
+
+	obs_register_source(&oculus_mrc_async_source_info);
+
+	struct obs_source_info oculus_mrc_layer_source_info = { 0 };
+	oculus_mrc_layer_source_info.id = "oculus_mrc_layer_source";
+	oculus_mrc_layer_source_info.type = OBS_SOURCE_TYPE_INPUT;
+	oculus_mrc_layer_source_info.output_flags = OBS_SOURCE_VIDEO;
+	oculus_mrc_layer_source_info.create = &OculusMrcLayerSource::Create;
+	oculus_mrc_layer_source_info.destroy = &OculusMrcLayerSource::Destroy;
+	oculus_mrc_layer_source_info.update = &OculusMrcLayerSource::Update;
+	oculus_mrc_layer_source_info.get_name = &OculusMrcLayerSource::GetName;
+	oculus_mrc_layer_source_info.get_defaults = &OculusMrcLayerSource::GetDefaults;
+	oculus_mrc_layer_source_info.get_width = &OculusMrcLayerSource::GetWidth;
+	oculus_mrc_layer_source_info.get_height = &OculusMrcLayerSource::GetHeight;
+	oculus_mrc_layer_source_info.video_tick = &OculusMrcLayerSource::VideoTick;
+	oculus_mrc_layer_source_info.video_render = &OculusMrcLayerSource::VideoRender;
+	oculus_mrc_layer_source_info.get_properties = &OculusMrcLayerSource::GetProperties;
+
+	obs_register_source(&oculus_mrc_layer_source_info);
 	return true;
 }
 
 void obs_module_unload(void)
 {
-	WSACleanup();
+	delete g_decodePool;
+	g_decodePool = nullptr;
+	delete g_ioReactor;
+	g_ioReactor = nullptr;
+	ShutdownSockets();
 }
@@ -0,0 +1,157 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <algorithm>
+#include <cassert>
+
+// Byte FIFO used to reassemble frames from the TCP stream. Data is appended at
+// the write cursor and released by moving the read cursor, so consuming a
+// frame never moves the bytes that follow it. Reads that straddle the end of
+// the storage are split into two copies.
+class RingBuffer
+{
+public:
+	explicit RingBuffer(size_t capacity)
+	{
+		Allocate(RoundUpToPowerOfTwo(capacity));
+	}
+
+	size_t Size() const
+	{
+		return (size_t)(m_writePos - m_readPos);
+	}
+
+	size_t Capacity() const
+	{
+		return m_capacity;
+	}
+
+	void Clear()
+	{
+		m_readPos = 0;
+		m_writePos = 0;
+	}
+
+	// Appends len bytes, growing the storage if they do not fit
+	void Write(const uint8_t* data, size_t len)
+	{
+		if (Size() + len > m_capacity)
+		{
+			Grow(Size() + len);
+		}
+
+		size_t offset = (size_t)(m_writePos & m_mask);
+		size_t firstPart = std::min(len, m_capacity - offset);
+		memcpy(m_data.get() + offset, data, firstPart);
+		memcpy(m_data.get(), data + firstPart, len - firstPart);
+		m_writePos += len;
+	}
+
+	// Returns the contiguous free space at the write cursor so the caller can
+	// fill it directly (e.g. with recv), growing the storage first if less than
+	// minFree bytes are free in total. Call CommitWrite with the bytes written.
+	uint8_t* GetWriteSpace(size_t minFree, size_t& available)
+	{
+		if (m_capacity - Size() < minFree)
+		{
+			Grow(Size() + minFree);
+		}
+
+		size_t offset = (size_t)(m_writePos & m_mask);
+		available = std::min(m_capacity - Size(), m_capacity - offset);
+		return m_data.get() + offset;
+	}
+
+	void CommitWrite(size_t len)
+	{
+		assert(Size() + len <= m_capacity);
+		m_writePos += len;
+	}
+
+	// Copies len bytes starting offset bytes past the read cursor, without consuming them
+	void Peek(void* dst, size_t len, size_t offset = 0) const
+	{
+		assert(offset + len <= Size());
+
+		size_t start = (size_t)((m_readPos + offset) & m_mask);
+		size_t firstPart = std::min(len, m_capacity - start);
+		memcpy(dst, m_data.get() + start, firstPart);
+		memcpy((uint8_t*)dst + firstPart, m_data.get(), len - firstPart);
+	}
+
+	// The bytes starting offset bytes past the read cursor that can be read in
+	// place, up to the end of the data or of the storage, whichever is first
+	const uint8_t* GetReadSpan(size_t offset, size_t& length) const
+	{
+		assert(offset <= Size());
+
+		size_t start = (size_t)((m_readPos + offset) & m_mask);
+		length = std::min(Size() - offset, m_capacity - start);
+		return m_data.get() + start;
+	}
+
+	void Consume(size_t len)
+	{
+		assert(len <= Size());
+		m_readPos += len;
+	}
+
+private:
+	static size_t RoundUpToPowerOfTwo(size_t value)
+	{
+		size_t result = 1;
+		while (result < value)
+		{
+			result <<= 1;
+		}
+		return result;
+	}
+
+	void Allocate(size_t capacity)
+	{
+		m_data.reset(new uint8_t[capacity]);
+		m_capacity = capacity;
+		m_mask = capacity - 1;
+	}
+
+	void Grow(size_t required)
+	{
+		size_t size = Size();
+		std::unique_ptr<uint8_t[]> old(m_data.release());
+		size_t oldCapacity = m_capacity;
+		size_t start = (size_t)(m_readPos & m_mask);
+
+		Allocate(RoundUpToPowerOfTwo(required));
+
+		size_t firstPart = std::min(size, oldCapacity - start);
+		memcpy(m_data.get(), old.get() + start, firstPart);
+		memcpy(m_data.get() + firstPart, old.get(), size - firstPart);
+		m_readPos = 0;
+		m_writePos = size;
+	}
+
+	std::unique_ptr<uint8_t[]> m_data;
+	size_t m_capacity = 0;
+	size_t m_mask = 0;
+	uint64_t m_readPos = 0;
+	uint64_t m_writePos = 0;
+};
@@ -0,0 +1,80 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// BSD sockets spelled the Winsock way, so socket code reads the same on
+// every platform
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_BOTH SHUT_RDWR
+
+inline int closesocket(SOCKET s)
+{
+	return close(s);
+}
+#endif
+
+inline int GetLastSocketError()
+{
+#ifdef _WIN32
+	return WSAGetLastError();
+#else
+	return errno;
+#endif
+}
+
+inline bool IsSocketWouldBlock(int error)
+{
+#ifdef _WIN32
+	return error == WSAEWOULDBLOCK;
+#else
+	return error == EINPROGRESS || error == EWOULDBLOCK || error == EAGAIN;
+#endif
+}
+
+inline bool SetSocketBlocking(SOCKET s, bool blocking)
+{
+#ifdef _WIN32
+	u_long nonBlocking = blocking ? 0 : 1;
+	return ioctlsocket(s, FIONBIO, &nonBlocking) != SOCKET_ERROR;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	if (flags < 0)
+	{
+		return false;
+	}
+	flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+	return fcntl(s, F_SETFL, flags) == 0;
+#endif
+}
@@ -0,0 +1,131 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <utility>
+
+#include "cache-line.h"
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Each side owns one index and only reads the other's, caching it so
+// the shared cache line is touched only when the queue looks full or empty.
+template<typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+		m_slots.resize(size);
+		m_mask = size - 1;
+	}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	size_t Capacity() const
+	{
+		return m_slots.size();
+	}
+
+	// Consumer-side snapshot; may be stale by the time it is used
+	size_t SizeApprox() const
+	{
+		return m_write.value.pos.load(std::memory_order_acquire) - m_read.value.pos.load(std::memory_order_acquire);
+	}
+
+	bool IsEmpty() const
+	{
+		return SizeApprox() == 0;
+	}
+
+	// Producer only. Returns false if the queue is full.
+	bool TryPush(T item)
+	{
+		size_t write = m_write.value.pos.load(std::memory_order_relaxed);
+		if (write - m_write.value.cachedOtherPos >= m_slots.size())
+		{
+			m_write.value.cachedOtherPos = m_read.value.pos.load(std::memory_order_acquire);
+			if (write - m_write.value.cachedOtherPos >= m_slots.size())
+			{
+				return false;
+			}
+		}
+
+		m_slots[write & m_mask] = std::move(item);
+		m_write.value.pos.store(write + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Returns false if the queue is empty.
+	bool TryPop(T& item)
+	{
+		size_t read = m_read.value.pos.load(std::memory_order_relaxed);
+		if (read == m_read.value.cachedOtherPos)
+		{
+			m_read.value.cachedOtherPos = m_write.value.pos.load(std::memory_order_acquire);
+			if (read == m_read.value.cachedOtherPos)
+			{
+				return false;
+			}
+		}
+
+		item = std::move(m_slots[read & m_mask]);
+		m_read.value.pos.store(read + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Hands every item queued at the time of the call to func,
+	// oldest first; items pushed meanwhile are left for the next call.
+	template<typename Func>
+	size_t PopAll(Func func)
+	{
+		size_t read = m_read.value.pos.load(std::memory_order_relaxed);
+		size_t write = m_write.value.pos.load(std::memory_order_acquire);
+		m_read.value.cachedOtherPos = write;
+
+		for (size_t i = read; i != write; ++i)
+		{
+			T item = std::move(m_slots[i & m_mask]);
+			// free the slot before running func so the producer is not held up
+			m_read.value.pos.store(i + 1, std::memory_order_release);
+			func(std::move(item));
+		}
+		return write - read;
+	}
+
+private:
+	std::vector<T> m_slots;
+	size_t m_mask = 0;
+
+	// One per side: its own position, and its cached copy of the other's
+	struct Cursor
+	{
+		std::atomic<size_t> pos { 0 };
+		size_t cachedOtherPos = 0;
+	};
+	CacheLinePadded<Cursor> m_write;	// producer's
+	CacheLinePadded<Cursor> m_read;		// consumer's
+};
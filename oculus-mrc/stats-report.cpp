@@ -0,0 +1,255 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "stats-report.h"
+#include "log.h"
+
+#include <chrono>
+
+const LatencyStage MrcStatsReport::ReportedStages[NumReportedStages] = {
+	LatencyStage::Decode,
+	LatencyStage::Convert,
+	LatencyStage::Upload,
+};
+
+static std::string EscapeJson(const std::string& text)
+{
+	std::string escaped;
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+			escaped += c;
+		}
+		else if ((unsigned char)c < 0x20)
+		{
+			escaped += string_format("\\u%04x", (unsigned)(unsigned char)c);
+		}
+		else
+		{
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+MrcStatsReport::~MrcStatsReport()
+{
+	CloseFile();
+}
+
+void MrcStatsReport::Reset()
+{
+	m_started = false;
+	m_hasSample = false;
+	m_seconds = 0;
+}
+
+bool MrcStatsReport::Sample(MrcPipeline& pipeline, uint64_t now, uint64_t intervalNs)
+{
+	if (m_started && now - m_sampleTime < intervalNs)
+	{
+		return false;
+	}
+
+	MrcPipelineStats stats = pipeline.GetStats();
+	if (!m_started)
+	{
+		m_started = true;
+		m_stats = stats;
+		m_sampleTime = now;
+		return false;
+	}
+
+	m_lastStats = m_stats;
+	m_stats = stats;
+	m_seconds = (now - m_sampleTime) / 1e9;
+	m_sampleTime = now;
+	m_wallTimeMs = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+
+	const LatencyStats& latency = pipeline.GetLatencyStats();
+	for (int i = 0; i < NumReportedStages; ++i)
+	{
+		const LatencyHistogram& histogram = latency.GetHistogram(ReportedStages[i]);
+		m_stageTimes[i].count = histogram.GetCount();
+		m_stageTimes[i].p50 = m_stageTimes[i].count ? histogram.GetPercentile(50) : 0;
+		m_stageTimes[i].p99 = m_stageTimes[i].count ? histogram.GetPercentile(99) : 0;
+	}
+	m_hasSample = true;
+
+	if (m_file)
+	{
+		WriteJson(pipeline.GetName());
+	}
+	return true;
+}
+
+std::string MrcStatsReport::GetText() const
+{
+	if (!m_hasSample)
+	{
+		return std::string();
+	}
+
+	const MrcPipelineStats& s = m_stats;
+	const MrcPipelineStats& l = m_lastStats;
+	auto typeRate = [&](Frame::PayloadType type) {
+		uint32_t index = Frame::GetPayloadTypeIndex(type);
+		return GetRate(s.framesParsedByType[index], l.framesParsedByType[index]);
+	};
+
+	std::string text = string_format("in %.2f Mbit/s, decoded %.1f fps, converted %.1f fps, taken %.1f fps, first picture %.0f ms\n",
+		GetRate(s.bytesReceived, l.bytesReceived) * 8 / 1e6,
+		GetRate(s.picturesDecoded, l.picturesDecoded),
+		GetRate(s.picturesConverted, l.picturesConverted),
+		GetRate(s.imagesTaken, l.imagesTaken),
+		s.firstPictureNs / 1e6);
+	text += string_format("parsed/s: video %.1f, audio %.1f, dimension %.1f, sample rate %.1f\n",
+		typeRate(Frame::PayloadType::VIDEO_DATA),
+		typeRate(Frame::PayloadType::AUDIO_DATA),
+		typeRate(Frame::PayloadType::VIDEO_DIMENSION),
+		typeRate(Frame::PayloadType::AUDIO_SAMPLERATE));
+	for (int i = 0; i < NumReportedStages; ++i)
+	{
+		text += string_format("%s p50 %.2f p99 %.2f ms%s",
+			GetLatencyStageName(ReportedStages[i]),
+			m_stageTimes[i].p50 / 1e6,
+			m_stageTimes[i].p99 / 1e6,
+			i < NumReportedStages - 1 ? ", " : "\n");
+	}
+	text += string_format("queues: reassembly %llu bytes, frames %llu/%llu, paced %llu, audio %llu chunks (%llu bytes)\n",
+		(unsigned long long)s.reassemblyBytes,
+		(unsigned long long)s.frameQueueDepth,
+		(unsigned long long)s.frameQueueCapacity,
+		(unsigned long long)s.pacedImageDepth,
+		(unsigned long long)s.audioQueuedChunks,
+		(unsigned long long)s.audioQueuedBytes);
+	text += string_format("dropped: parser %llu, resyncs %llu, backlog %llu (%llu IDR skips), conversions skipped %llu, superseded %llu, paced %llu, repeated %llu, audio %llu\n",
+		(unsigned long long)s.framesDropped,
+		(unsigned long long)s.parserResyncs,
+		(unsigned long long)s.backlogDroppedFrames,
+		(unsigned long long)s.backlogIdrSkips,
+		(unsigned long long)s.skippedConversions,
+		(unsigned long long)s.supersededImages,
+		(unsigned long long)s.pacerDroppedPictures,
+		(unsigned long long)s.repeatedPictures,
+		(unsigned long long)s.audioChunksDropped);
+	return text;
+}
+
+std::string MrcStatsReport::GetJson(const std::string& source) const
+{
+	if (!m_hasSample)
+	{
+		return std::string();
+	}
+
+	const MrcPipelineStats& s = m_stats;
+	const MrcPipelineStats& l = m_lastStats;
+
+	std::string json = string_format("{\"source\":\"%s\",\"time_ms\":%llu,\"interval_s\":%.3f",
+		EscapeJson(source).c_str(), (unsigned long long)m_wallTimeMs, m_seconds);
+	json += string_format(",\"in_mbps\":%.3f,\"decode_fps\":%.2f,\"convert_fps\":%.2f,\"taken_fps\":%.2f,\"first_picture_ms\":%.1f",
+		GetRate(s.bytesReceived, l.bytesReceived) * 8 / 1e6,
+		GetRate(s.picturesDecoded, l.picturesDecoded),
+		GetRate(s.picturesConverted, l.picturesConverted),
+		GetRate(s.imagesTaken, l.imagesTaken),
+		s.firstPictureNs / 1e6);
+
+	json += ",\"parsed_per_s\":{";
+	for (uint32_t i = 0; i < Frame::NumPayloadTypes; ++i)
+	{
+		Frame::PayloadType type = (Frame::PayloadType)((uint32_t)Frame::PayloadType::VIDEO_DIMENSION + i);
+		json += string_format("%s\"%s\":%.2f", i ? "," : "", Frame::GetPayloadTypeName(type),
+			GetRate(s.framesParsedByType[i], l.framesParsedByType[i]));
+	}
+	json += "}";
+
+	json += ",\"times_ms\":{";
+	for (int i = 0; i < NumReportedStages; ++i)
+	{
+		json += string_format("%s\"%s\":{\"n\":%llu,\"p50\":%.3f,\"p99\":%.3f}", i ? "," : "",
+			GetLatencyStageName(ReportedStages[i]),
+			(unsigned long long)m_stageTimes[i].count,
+			m_stageTimes[i].p50 / 1e6,
+			m_stageTimes[i].p99 / 1e6);
+	}
+	json += "}";
+
+	json += string_format(",\"queues\":{\"reassembly_bytes\":%llu,\"frames\":%llu,\"frames_capacity\":%llu,"
+		"\"paced_images\":%llu,\"audio_chunks\":%llu,\"audio_bytes\":%llu}",
+		(unsigned long long)s.reassemblyBytes,
+		(unsigned long long)s.frameQueueDepth,
+		(unsigned long long)s.frameQueueCapacity,
+		(unsigned long long)s.pacedImageDepth,
+		(unsigned long long)s.audioQueuedChunks,
+		(unsigned long long)s.audioQueuedBytes);
+
+	json += string_format(",\"dropped\":{\"parser\":%llu,\"resyncs\":%llu,\"resync_bytes\":%llu,\"backlog\":%llu,\"backlog_idr_skips\":%llu,\"before_idr\":%llu,"
+		"\"conversions_skipped\":%llu,\"superseded\":%llu,\"paced\":%llu,\"repeated\":%llu,\"audio\":%llu}}",
+		(unsigned long long)s.framesDropped,
+		(unsigned long long)s.parserResyncs,
+		(unsigned long long)s.parserBytesSkipped,
+		(unsigned long long)s.backlogDroppedFrames,
+		(unsigned long long)s.backlogIdrSkips,
+		(unsigned long long)s.framesBeforeIdr,
+		(unsigned long long)s.skippedConversions,
+		(unsigned long long)s.supersededImages,
+		(unsigned long long)s.pacerDroppedPictures,
+		(unsigned long long)s.repeatedPictures,
+		(unsigned long long)s.audioChunksDropped);
+	return json;
+}
+
+bool MrcStatsReport::OpenFile(const std::string& path)
+{
+	CloseFile();
+
+	m_file = fopen(path.c_str(), "a");
+	if (!m_file)
+	{
+		OM_LOG(LOG_ERROR, "Unable to open stats file %s", path.c_str());
+		return false;
+	}
+	OM_LOG(LOG_INFO, "Writing stats to %s", path.c_str());
+	return true;
+}
+
+void MrcStatsReport::CloseFile()
+{
+	if (m_file)
+	{
+		fclose(m_file);
+		m_file = nullptr;
+	}
+}
+
+void MrcStatsReport::WriteJson(const std::string& source)
+{
+	if (!m_file || !m_hasSample)
+	{
+		return;
+	}
+
+	std::string line = GetJson(source);
+	line += '\n';
+	fwrite(line.data(), 1, line.size(), m_file);
+	// a line at a time, so the file can be tailed while the source runs
+	fflush(m_file);
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include "mrc-pipeline.h"
+
+// Live view of one pipeline for operators: counter rates over the last
+// interval, the queue depths at the time of the sample and stage times from
+// the latency window in progress. Sampled from the consumer's thread, which
+// also appends each sample to the optional JSON-lines file.
+class MrcStatsReport
+{
+public:
+	~MrcStatsReport();
+
+	// Forgets the previous sample, the next one starts a new interval
+	void Reset();
+
+	// Samples the pipeline if intervalNs has passed since the last sample,
+	// returns whether it did. The first call only sets the starting point.
+	bool Sample(MrcPipeline& pipeline, uint64_t now, uint64_t intervalNs);
+
+	bool HasSample() const
+	{
+		return m_hasSample;
+	}
+
+	// The last sample as a few readable lines
+	std::string GetText() const;
+
+	// The last sample as one JSON object, without a trailing newline
+	std::string GetJson(const std::string& source) const;
+
+	// Appends to path; every sample taken while it is open becomes a line
+	bool OpenFile(const std::string& path);
+	void CloseFile();
+
+	bool IsFileOpen() const
+	{
+		return m_file != nullptr;
+	}
+
+	void WriteJson(const std::string& source);
+
+private:
+	struct StageTime
+	{
+		uint64_t count;
+		uint64_t p50;
+		uint64_t p99;
+	};
+
+	// Decode, convert and upload, the stages an operator can act on
+	static const int NumReportedStages = 3;
+	static const LatencyStage ReportedStages[NumReportedStages];
+
+	double GetRate(uint64_t now, uint64_t last) const
+	{
+		return m_seconds > 0 ? (now - last) / m_seconds : 0;
+	}
+
+	MrcPipelineStats m_stats;
+	MrcPipelineStats m_lastStats;
+	StageTime m_stageTimes[NumReportedStages] = {};
+	uint64_t m_sampleTime = 0;
+	uint64_t m_wallTimeMs = 0;
+	double m_seconds = 0;	// between the last two samples
+	bool m_started = false;
+	bool m_hasSample = false;
+
+	FILE* m_file = nullptr;
+};
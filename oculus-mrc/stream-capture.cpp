@@ -0,0 +1,252 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "stream-capture.h"
+#include "log.h"
+
+#include <string.h>
+#include <chrono>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char CaptureMagic[8] = { 'M', 'R', 'C', 'C', 'A', 'P', 0, 0 };
+static const uint32_t CaptureVersion = 1;
+
+StreamCaptureWriter::~StreamCaptureWriter()
+{
+	Close();
+}
+
+bool StreamCaptureWriter::Open(const std::string& path, uint64_t startTime)
+{
+	Close();
+
+	m_file = fopen(path.c_str(), "wb");
+	if (!m_file)
+	{
+		OM_LOG(LOG_ERROR, "Unable to open capture file %s", path.c_str());
+		return false;
+	}
+	setvbuf(m_file, nullptr, _IOFBF, 1024 * 1024);
+
+	CaptureFileHeader header = {};
+	memcpy(header.Magic, CaptureMagic, sizeof(header.Magic));
+	header.Version = CaptureVersion;
+	header.HeaderSize = sizeof(CaptureFileHeader);
+	header.StartTimeUnixMs = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	if (fwrite(&header, sizeof(header), 1, m_file) != 1)
+	{
+		OM_LOG(LOG_ERROR, "Unable to write capture file %s", path.c_str());
+		Close();
+		return false;
+	}
+
+	m_startTime = startTime;
+	m_bytesWritten = 0;
+	OM_LOG(LOG_INFO, "Capturing the MRC stream to %s", path.c_str());
+	return true;
+}
+
+void StreamCaptureWriter::Close()
+{
+	if (m_file)
+	{
+		fclose(m_file);
+		m_file = nullptr;
+		OM_LOG(LOG_INFO, "Capture closed, %llu bytes of stream written", (unsigned long long)m_bytesWritten);
+	}
+}
+
+void StreamCaptureWriter::Write(const uint8_t* data, uint32_t length, uint64_t receiveTime)
+{
+	if (!m_file)
+	{
+		return;
+	}
+
+	CaptureChunkHeader header = {};
+	header.ReceiveTime = receiveTime >= m_startTime ? receiveTime - m_startTime : 0;
+	header.Length = length;
+	if (fwrite(&header, sizeof(header), 1, m_file) != 1 ||
+		fwrite(data, 1, length, m_file) != length)
+	{
+		// a full disk should not take the stream down with it
+		OM_LOG(LOG_ERROR, "Capture write failed, capture stopped");
+		Close();
+		return;
+	}
+	m_bytesWritten += length;
+}
+
+StreamCaptureReader::~StreamCaptureReader()
+{
+	Close();
+}
+
+bool StreamCaptureReader::Open(const std::string& path)
+{
+	Close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		OM_LOG(LOG_ERROR, "Unable to open replay file %s", path.c_str());
+		return false;
+	}
+	m_fileHandle = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		OM_LOG(LOG_ERROR, "Replay file %s is empty", path.c_str());
+		Close();
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		OM_LOG(LOG_ERROR, "Unable to map replay file %s", path.c_str());
+		Close();
+		return false;
+	}
+	m_mappingHandle = mapping;
+
+	m_data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	m_size = (size_t)size.QuadPart;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		OM_LOG(LOG_ERROR, "Unable to open replay file %s", path.c_str());
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		OM_LOG(LOG_ERROR, "Replay file %s is empty", path.c_str());
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data != MAP_FAILED)
+	{
+		madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+		m_data = (const uint8_t*)data;
+		m_size = (size_t)info.st_size;
+	}
+#endif
+
+	if (!m_data)
+	{
+		OM_LOG(LOG_ERROR, "Unable to map replay file %s", path.c_str());
+		Close();
+		return false;
+	}
+
+	const CaptureFileHeader* header = (const CaptureFileHeader*)m_data;
+	if (m_size < sizeof(CaptureFileHeader) ||
+		memcmp(header->Magic, CaptureMagic, sizeof(CaptureMagic)) != 0 ||
+		header->HeaderSize < sizeof(CaptureFileHeader) ||
+		header->HeaderSize > m_size)
+	{
+		OM_LOG(LOG_ERROR, "%s is not an MRC capture file", path.c_str());
+		Close();
+		return false;
+	}
+	if (header->Version != CaptureVersion)
+	{
+		OM_LOG(LOG_WARNING, "Capture file version %u, expected %u", header->Version, CaptureVersion);
+	}
+
+	m_dataOffset = header->HeaderSize;
+	m_offset = m_dataOffset;
+	OM_LOG(LOG_INFO, "Replaying %s, %llu bytes", path.c_str(), (unsigned long long)m_size);
+	return true;
+}
+
+void StreamCaptureReader::Close()
+{
+#ifdef _WIN32
+	if (m_data)
+	{
+		UnmapViewOfFile(m_data);
+	}
+	if (m_mappingHandle)
+	{
+		CloseHandle((HANDLE)m_mappingHandle);
+		m_mappingHandle = nullptr;
+	}
+	if (m_fileHandle)
+	{
+		CloseHandle((HANDLE)m_fileHandle);
+		m_fileHandle = nullptr;
+	}
+#else
+	if (m_data)
+	{
+		munmap((void*)m_data, m_size);
+	}
+#endif
+	m_data = nullptr;
+	m_size = 0;
+	m_offset = 0;
+	m_dataOffset = 0;
+}
+
+bool StreamCaptureReader::ReadChunk(Chunk& chunk)
+{
+	if (!m_data || m_size - m_offset < sizeof(CaptureChunkHeader))
+	{
+		return false;
+	}
+
+	CaptureChunkHeader header;
+	memcpy(&header, m_data + m_offset, sizeof(header));
+	if (m_size - m_offset - sizeof(CaptureChunkHeader) < header.Length)
+	{
+		OM_LOG(LOG_WARNING, "Capture file truncated at offset %llu", (unsigned long long)m_offset);
+		m_offset = m_size;
+		return false;
+	}
+
+	chunk.data = m_data + m_offset + sizeof(CaptureChunkHeader);
+	chunk.length = header.Length;
+	chunk.receiveTime = header.ReceiveTime;
+	m_offset += sizeof(CaptureChunkHeader) + header.Length;
+	return true;
+}
+
+void StreamCaptureReader::Rewind()
+{
+	m_offset = m_dataOffset;
+}
@@ -0,0 +1,114 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// Capture files hold the MRC byte stream exactly as recv() returned it, so a
+// session can be fed through the parser and decoder again later. The file
+// is a CaptureFileHeader followed by one CaptureChunkHeader plus data per
+// recv() call.
+#pragma pack(push, 1)
+struct CaptureFileHeader
+{
+	char Magic[8];				// "MRCCAP\0\0"
+	uint32_t Version;
+	uint32_t HeaderSize;		// sizeof(CaptureFileHeader)
+	uint64_t StartTimeUnixMs;	// wall clock when the capture started
+};
+
+struct CaptureChunkHeader
+{
+	uint64_t ReceiveTime;		// nanoseconds since the capture started
+	uint32_t Length;
+	uint32_t Reserved;
+};
+#pragma pack(pop)
+
+// Appends received chunks to a capture file from a single thread.
+class StreamCaptureWriter
+{
+public:
+	~StreamCaptureWriter();
+
+	bool Open(const std::string& path, uint64_t startTime);
+	void Close();
+
+	bool IsOpen() const
+	{
+		return m_file != nullptr;
+	}
+
+	// receiveTime is in steady_clock nanoseconds, like Frame::m_receiveTime
+	void Write(const uint8_t* data, uint32_t length, uint64_t receiveTime);
+
+	uint64_t GetBytesWritten() const
+	{
+		return m_bytesWritten;
+	}
+
+private:
+	FILE* m_file = nullptr;
+	uint64_t m_startTime = 0;
+	uint64_t m_bytesWritten = 0;
+};
+
+// Reads a capture file through a read-only memory mapping, handing out
+// pointers into the mapping rather than copies
+class StreamCaptureReader
+{
+public:
+	struct Chunk
+	{
+		const uint8_t* data = nullptr;
+		uint32_t length = 0;
+		uint64_t receiveTime = 0;	// nanoseconds since the capture started
+	};
+
+	~StreamCaptureReader();
+
+	bool Open(const std::string& path);
+	void Close();
+
+	bool IsOpen() const
+	{
+		return m_data != nullptr;
+	}
+
+	// Returns false at the end of the file or on a truncated chunk
+	bool ReadChunk(Chunk& chunk);
+
+	void Rewind();
+
+	size_t GetSize() const
+	{
+		return m_size;
+	}
+
+private:
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+	size_t m_offset = 0;
+	size_t m_dataOffset = 0;
+
+	void* m_fileHandle = nullptr;		// Windows only
+	void* m_mappingHandle = nullptr;	// Windows only
+};
@@ -0,0 +1,102 @@
+/*
+Copyright (C) 2019-present, Facebook, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#include "cache-line.h"
+
+// Lock-free handoff of the newest value from one producer thread to one
+// consumer thread. The producer fills the back slot and publishes it by
+// swapping it with the middle one; the consumer swaps its front slot with
+// the middle one when something new was published. Neither side ever
+// waits for the other, and a value the consumer had no time to take is
+// simply overwritten by the next one.
+template<typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer()
+	{
+		Reset();
+	}
+
+	TripleBuffer(const TripleBuffer&) = delete;
+	TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+	// Producer only: the slot to fill before Publish
+	T& GetBack()
+	{
+		return m_slots[m_back.value];
+	}
+
+	// Producer only. Returns true if the value published before this one was
+	// never taken by the consumer.
+	bool Publish()
+	{
+		uint8_t previous = m_middle.value.exchange((uint8_t)(m_back.value | FreshBit), std::memory_order_acq_rel);
+		m_back.value = previous & IndexMask;
+		return (previous & FreshBit) != 0;
+	}
+
+	// Consumer only. Moves the newest published value to the front, if there
+	// is one the consumer has not taken yet.
+	bool TakeNewest()
+	{
+		if (!(m_middle.value.load(std::memory_order_acquire) & FreshBit))
+		{
+			return false;
+		}
+		uint8_t previous = m_middle.value.exchange(m_front.value, std::memory_order_acq_rel);
+		m_front.value = previous & IndexMask;
+		return true;
+	}
+
+	// Consumer only: the value last taken, the consumer's until the next TakeNewest
+	T& GetFront()
+	{
+		return m_slots[m_front.value];
+	}
+
+	// Neither side may be running
+	void Reset()
+	{
+		m_back.value = 0;
+		m_middle.value.store(1, std::memory_order_relaxed);
+		m_front.value = 2;
+	}
+
+	// Neither side may be running, for setting up or tearing down every slot
+	T& GetSlot(int index)
+	{
+		return m_slots[index];
+	}
+
+	static const int NumSlots = 3;
+
+private:
+	static const uint8_t IndexMask = 0x3;
+	static const uint8_t FreshBit = 0x4;	// set in m_middle when published and not yet taken
+
+	T m_slots[NumSlots];
+
+	CacheLinePadded<uint8_t> m_back;					// producer's slot
+	CacheLinePadded<std::atomic<uint8_t>> m_middle;
+	CacheLinePadded<uint8_t> m_front;					// consumer's slot
+};